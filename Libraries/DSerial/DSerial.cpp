@@ -9,189 +9,739 @@
 #include <string.h>
 #include "stringQueue.h"
 
+const unsigned long dserial_baud_rates[NUM_BAUD_RATES] = {
+  19200, 38400, 57600, 115200
+};
+
+// Broadcast sequence numbers run from 1 to 127, 0 means "none yet".
+static uint8_t nextSeq(uint8_t seq){
+  return (seq >= 127) ? 1 : seq + 1;
+}
+
+// Number of broadcasts from "from" up to and including "to"
+static uint8_t seqDistance(uint8_t from, uint8_t to){
+  return (to + 127 - from) % 127;
+}
+
+// Length of a discovery reply slot at baud, see DISCOVERY_ACK_LEN
+static unsigned long discoverySlot(unsigned long baud){
+  // Framing adds a COBS code byte, the CRC and the closing 0
+  return (DISCOVERY_ACK_LEN + 3 + DISCOVERY_GUARD_BYTES) * 10 * 1000000UL /
+         baud + TDMA_TURNAROUND_US;
+}
+
+// Index of the fastest rate in dserial_baud_rates at most max_baud
+static uint8_t baudIndex(unsigned long max_baud){
+  uint8_t index = SAFE_BAUD_INDEX;
+  for(uint8_t i = 0; i < NUM_BAUD_RATES; i++){
+    if(dserial_baud_rates[i] <= max_baud){
+      index = i;
+    }
+  }
+  return index;
+}
+
+/** @brief Creates a new packet parser with no packet in progress
+ *
+ *  @param rx_storage  RX_RING_STORAGE bytes for the ring receiveByte puts
+ *                       packets in, NULL if it is not used
+ */
+DSerialParser::DSerialParser(char *rx_storage){
+  _noise = 0;
+  _frame_micros = 0;
+  _rx_isr = 0;
+  _rx_lost = 0;
+  _rx_lost_seen = 0;
+  _rx_has_ring = stringQueueInit(&_rx_ring, rx_storage, RX_RING_SIZE,
+                                 sizeof(dserial_rx_frame_t));
+  resetCounts();
+  reset();
+}
+
+/** @brief Drops any partially received packet
+ */
+void DSerialParser::reset(){
+  _index = 0;
+  _code = 0;
+  _pending_zero = 0;
+  _overflow = 0;
+  _crc = CRC8_INIT;
+}
+
+/** @brief Reports whether bad packets were thrown away since the last call
+ *
+ *  Packets that fail their CRC, are cut short or are too long are all
+ *  returned as -1 by readPacket, but on a bus where several clients may
+ *  answer at once this is also the only sign that two transmissions
+ *  collided.
+ *
+ *  @return 1 if any packets were discarded, 0 otherwise
+ */
+int DSerialParser::sawNoise(){
+  int noise = _noise;
+  _noise = 0;
+  return noise;
+}
+
+/** @brief fills in the packets counted by readPacket
+ *
+ *  @param stats  frames_in and bad_frames are set, the rest left alone
+ */
+void DSerialParser::getCounts(dserial_stats_t *stats){
+  stats->frames_in = _frames;
+  stats->bad_frames = _bad_frames;
+}
+
+void DSerialParser::resetCounts(){
+  _frames = 0;
+  _bad_frames = 0;
+}
+
+/** @brief adds a decoded byte to the packet in progress
+ *
+ *  @param c  The byte
+ */
+void DSerialParser::addByte(uint8_t c){
+  if(_index >= sizeof(_buf)){
+    _overflow = 1;
+    return;
+  }
+  _buf[_index++] = c;
+  _crc = crc8Update(_crc, c);
+}
+
+/** @brief Decodes one byte of a packet
+ *
+ *  @param c    The byte as it came off the wire
+ *  @param msg  Where a finished packet goes, NULL to throw it away
+ *  @return 0 if the packet is not finished yet, 1 if a valid packet was put
+ *            in msg, -1 if a bad one was (with length 0)
+ */
+int DSerialParser::decodeByte(uint8_t c, dserial_msg_t *msg){
+  int valid;
+
+  if (c == 0) { // End of a packet
+    if(_index == 0 && !_pending_zero && !_overflow){
+      return 0; // Nothing in it
+    }
+    // The CRC over the message and its own CRC byte comes out as 0
+    valid = (!_overflow && _code == 0 && _index >= 2 && _crc == 0);
+    if(msg != NULL){
+      msg->len = valid ? _index - 1 : 0; // Leave the CRC byte out
+      memcpy(msg->data, _buf, msg->len);
+    }
+    reset();
+    return valid ? 1 : -1;
+  }
+  if (_code == 0) { // A code byte, the length of the next block
+    if(_pending_zero){
+      addByte(0);
+    }
+    _code = c - 1;
+    _pending_zero = (c != 0xFF);
+  } else {
+    addByte(c);
+    _code--;
+  }
+  return 0;
+}
+
 /** @brief Reads a packet from the specified stream if one is available
  *
  *  If the data in the stream contains a full packet, the packet will be put
- *  into the return buffer and the return code will indicate it's validity.
- *  If there is not enough data in the stream buffer for a full packet, the
- *  function not populate the buffer and the return code will indicate no new
- *  packet.
+ *  into msg and the return code will indicate it's validity. If there is not
+ *  enough data in the stream buffer for a full packet, the function will not
+ *  populate msg and the return code will indicate no new packet.
+ *
+ *  Returned data DOES include the address as the first byte of the message.
+ *
+ *  Packets are COBS decoded and their CRC is updated as each byte comes in,
+ *  so nothing is gone over twice once the closing 0 arrives.
+ *
+ *  All parsing state lives in the parser object, so a partial packet is kept
+ *  across calls and every stream should be read through its own parser.
  *
- *  Returned data DOES include the address as the first byte of the buffer.
+ *  Once receiveByte has been called the stream is left alone, and packets
+ *  are taken from the ring receiveByte fills instead.
+ *
+ *  Every packet returned here is counted, see getCounts.
  *
  *  @param s      The stream object from which to read
- *  @param buffer A pointer to the buffer to populate with the possible packet
+ *  @param msg    The message to populate with the possible packet
  *  @return A status code indicating the status of the packet:
- *            0 - No new packet, buffer is returned empty.
- *            1 - New packet in buffer, packet is valid.
- *           -1 - New packet in buffer, packet failed parity check.
- */
-int readPacket(Stream &s, char *buffer){
-  static int in_packet = 0;
-  static int index = 0;
-  static char buf[MAX_MSG_LEN+1];
-  static char data_parity = 0;
-  static int escape_next = 0;
-  char rc;
-  int passed_parity = 0;
+ *            0 - No new packet, msg is left alone.
+ *            1 - New packet in msg, packet is valid.
+ *           -1 - Bad packet, msg is returned empty.
+ */
+int DSerialParser::readPacket(Stream &s, dserial_msg_t *msg){
+  dserial_rx_frame_t *next;
+  uint8_t lost;
+  int result;
+
+  if(__atomic_load_n(&_rx_isr, __ATOMIC_ACQUIRE)){
+    lost = __atomic_load_n(&_rx_lost, __ATOMIC_RELAXED);
+    if(lost != _rx_lost_seen){
+      _bad_frames += (uint8_t)(lost - _rx_lost_seen);
+      _rx_lost_seen = lost;
+      _noise = 1;
+    }
+    next = NULL;
+    if(_rx_has_ring){
+      next = (dserial_rx_frame_t *)stringQueueFront(&_rx_ring);
+    }
+    if(next == NULL){
+      return 0;
+    }
+    _frame_micros = next->micros;
+    msg->len = next->msg.len;
+    memcpy(msg->data, next->msg.data, next->msg.len);
+    stringQueuePop(&_rx_ring);
+    if(msg->len == 0){
+      _noise = 1;
+      _bad_frames++;
+      return -1;
+    }
+    _frames++;
+    return 1;
+  }
 
   while (s.available() > 0) {
-    rc = s.read();
-    if (rc == START) {
-      in_packet = 1;
-      data_parity = START;
-      index = 0;
-    }
-    else if (in_packet == 1) {
-      data_parity ^= rc;
-      if (rc != END) {
-        if(rc == ESC) { // next char was greater than 0x7F, add 0x80 to it.
-          escape_next = 1;
-        } else {
-          buf[index] = rc | (escape_next << 7);
-          escape_next = 0;
-          index++;
-        }
-      }
-      if(rc == END || index >= MAX_MSG_LEN){
-        index--;
-        buf[index] = '\0'; //purposefully overwrite parity byte.
-        strcpy(buffer, buf);
-        passed_parity = ((data_parity & 0x7F) == 0);
-        index = 0;
-        in_packet = 0;
-        data_parity = 0;
-        if(passed_parity){
-          return 1;
-        } else {
-          return -1;
-        }
-      }
+    result = decodeByte(s.read(), msg);
+    if(result != 0){
+      _frame_micros = micros();
+    }
+    if(result == 1){
+      _frames++;
+      return 1;
+    } else if(result == -1){
+      _noise = 1;
+      _bad_frames++;
+      return -1;
     }
   }
   return 0;
 }
 
+/** @brief tells when the last packet readPacket returned finished arriving
+ *
+ *  For packets decoded by receiveByte this is when the interrupt got the
+ *  closing 0, however long the packet then waited for the sketch's loop.
+ *  Otherwise it is when readPacket decoded it.
+ *
+ *  @return The micros() the packet ended at
+ */
+unsigned long DSerialParser::frameMicros(){
+  return _frame_micros;
+}
+
+/** @brief Decodes a byte straight from the UART receive interrupt
+ *
+ *  Finished packets are put in a ring of RX_RING_SIZE slots that readPacket
+ *  takes them from, so packets keep being received while the sketch is busy
+ *  between calls to doSerial. If the ring is full the packet is dropped,
+ *  which sawNoise then reports. Only call this from one place (normally the
+ *  interrupt), and don't call reset at the same time.
+ *
+ *  The ring is only there if the parser was given storage for it (see
+ *  DSerialIsrParser), without it every packet is dropped.
+ *
+ *  @param c  The received byte
+ */
+void DSerialParser::receiveByte(uint8_t c){
+  dserial_rx_frame_t *slot = NULL;
+
+  if(_rx_has_ring){
+    slot = (dserial_rx_frame_t *)stringQueueBack(&_rx_ring);
+  }
+
+  if(decodeByte(c, slot != NULL ? &slot->msg : NULL) != 0){
+    if(slot != NULL){
+      slot->micros = micros();
+      stringQueuePush(&_rx_ring);
+    } else {
+      __atomic_store_n(&_rx_lost, (uint8_t)(_rx_lost + 1), __ATOMIC_RELAXED);
+    }
+  }
+  __atomic_store_n(&_rx_isr, (uint8_t)1, __ATOMIC_RELEASE);
+}
+
 /** @brief Writes a packet to the specified stream.
- * 
+ *
+ *  The message and its CRC are COBS encoded: each block starts with a code
+ *  byte, one more than the number of non-zero bytes following it, and
+ *  stands for those bytes and one 0 after them (no 0 after a full block of
+ *  254 bytes, or after the last block). A 0 then ends the packet.
+ *
  *  @param s        The stream object from which to read
  *  @param message  A pointer to the message to send, first byte should be
-                      a client address, message should be null terminated,
-                      however the null byte will not be sent over the wire.
+ *                    a client address
+ *  @param len      The length of the message, at most MAX_MSG_LEN
  *  @return A status code indicating the whether or not the message was sent
- *            - Currently this function will always succeed
+ *            - Only fails for an empty or oversized message
  */
-int sendPacket(Stream &s, char *message){
-  char data_parity = 0;
-  if(strlen(message) == 0){
+int sendPacket(Stream &s, const uint8_t *message, uint8_t len){
+  uint8_t frame[MAX_MSG_LEN + 1];
+  uint8_t start = 0;
+  uint8_t end;
+
+  if(len == 0 || len > MAX_MSG_LEN){
     return 0; // Should only happen on library failure
   }
-  for (int i = 0; message[i] != 0; i++) {
-    data_parity = data_parity ^ (uint8_t)message[i];
-  }
-  s.write(START);
-  for (int i = 0; message[i] != 0; i++) {
-    if((message[i] & 0x80) == 0) {
-      s.write(message[i]);
-    } else {  // special case for bytes over 0x7F
-      s.write(ESC);
-      data_parity = data_parity ^ ESC;
-      s.write(message[i] & 0x7F);
+  memcpy(frame, message, len);
+  frame[len] = crc8(message, len);
+  len++;
+
+  for(;;){
+    end = start;
+    while(end < len && frame[end] != 0 && end - start < 254){
+      end++;
+    }
+    s.write((uint8_t)(end - start + 1));
+    for(uint8_t i = start; i < end; i++){
+      s.write(frame[i]);
+    }
+    if(end >= len){
+      break;
     }
+    start = (end - start == 254) ? end : end + 1;
   }
-  s.write((START ^ data_parity ^ END) & 0x7F);
-  s.write(END);
+  s.write((uint8_t)0);
   return 1;
 }
 
-/** @brief Creates a new DSerialMaster object
+/** @brief Creates a new DSerialMasterBase object
  * 
- *  @param port The underlying stream object used for communication.
+ *  @param port    The underlying stream object used for communication.
+ *  @param storage Where the client lists and queues live, see
+ *                   DSerialMasterT
 
- *  @return A new initialized DSerialMaster object
+ *  @return A new initialized DSerialMasterBase object
  */
-DSerialMaster::DSerialMaster(Stream &port):_stream(port){
+DSerialMasterBase::DSerialMasterBase(Stream &port,
+                                     const dserial_master_storage_t &storage)
+                                     :_stream(port),
+                                      _parser(storage.rx_storage){
+  _max_clients = storage.max_clients;
+  _queue_size = storage.queue_size;
+  _clients = storage.clients;
+  _client_state = storage.client_state;
+  _rx_next = storage.rx_next;
+  _rx_valid = storage.rx_valid;
+  _dead = storage.dead;
+  _out_lists = storage.out_lists;
   _state = 0;
+  _last_micros = 0;
+  _timeout = 0;
+  _num_attempts = 0;
+  _resent = 0;
+  _client_index = 0;
+  _current_msg.len = 0;
   _num_clients = 0;
-  memset(_clients, 0, MAX_CLIENTS);
-  stringQueueInit(&_in_messages, MAX_MASTER_QUEUE_SIZE);
-  stringQueueInit(&_out_messages, MAX_MASTER_QUEUE_SIZE);
+  memset(_clients, 0, _max_clients);
+  _bcast_seq = 0;
+  _bcast_epoch = 0;
+  _bcast_count = 0;
+  _bcast_head = 0;
+  _poll_has_data = 0;
+  _window = 1;
+  _replied = 0;
+  _reply_data = 0;
+  _attention = 0;
+  memset(_client_state, 0, _max_clients * sizeof(client_state_t));
+  memset(_rx_next, 0, _max_clients);
+  memset(_rx_valid, 0, CLIENT_BITMAP_LEN(_max_clients));
+  _default_scheduler = storage.scheduler;
+  _scheduler = _default_scheduler;
+  stringQueueInit(&_in_messages, storage.in_storage, _queue_size,
+                  MSG_SLOT_LEN);
+  stringPoolInit(&_out_pool, storage.out_storage, storage.out_links,
+                 _queue_size, MSG_SLOT_LEN);
+  for(int i = 0; i < _max_clients; i++){
+    stringListInit(&_out_lists[i]);
+  }
+  _write_index = 0;
+  memset(_dead, 0, CLIENT_BITMAP_LEN(_max_clients));
+  _probe_addr = 0;
+  _probe_millis = 0;
+  _probe_target = 0;
+  _probe_nudged = 0;
+  _hotplug_interval = HOTPLUG_INTERVAL;
+  _hotplug_addr = 0;
+  _hotplug_millis = 0;
+  _nudge_millis = 0;
+  _event_head = 0;
+  _event_count = 0;
+  _exchange_error = 0;
+  _set_baud = NULL;
+  _baud_index = SAFE_BAUD_INDEX;
+  _baud_max = SAFE_BAUD_INDEX;
+  _baud_pending = BAUD_NONE;
+  _sample_exchanges = 0;
+  _sample_errors = 0;
+  _baud_millis = millis();
+  memset(_baud_stats, 0, sizeof(_baud_stats));
+  memset(&_stats, 0, sizeof(_stats));
 }
 
-/** @brief sends a data string to the specified client.
+/** @brief sends data to the specified client.
  *
- *  Internally, this function enqueues the data to be written when convenient.
- *  This function fails when there is not enough memory to enqueue the message
- *  or when the queue is full.
+ *  Internally, this function copies the data into a free slot on the
+ *  client's own queue, to be written the next time the client is polled.
+ *  Messages for an address that is not (yet) a known client wait until it
+ *  is. This function fails when the pool of slots is full, when the client
+ *  already has MAX_CLIENT_OUT_MSGS messages waiting, or when the data is
+ *  empty or longer than MAX_DATA_LEN.
  *
  *  @param client_id  The ID of the client to write to
  *  @param data       The data to write to the given client
+ *  @param len        The number of bytes of data
  *  @return A status code indicating success or failure
  */
-int DSerialMaster::sendData(uint8_t client_id, char *data){
-  if(stringQueueIsFull(&_out_messages)){
+int DSerialMasterBase::sendData(uint8_t client_id, const void *data, uint8_t len){
+  stringList_t *list = &_out_lists[client_id % _max_clients];
+  dserial_msg_t *new_message = (dserial_msg_t *)stringListBack(&_out_pool,
+                                                               list);
+  if(client_id == 0 || client_id >= _max_clients || new_message == NULL ||
+     list->count >= MAX_CLIENT_OUT_MSGS || len == 0 || len > MAX_DATA_LEN){
     return 0;
   }
-  char *new_message = (char*) malloc(MAX_MSG_LEN+2);
-  if(new_message == NULL){
+  new_message->data[0] = client_id;
+  new_message->data[1] = WRITE;
+  memcpy(new_message->data + 2, data, len);
+  new_message->len = len + 2;
+  stringListPush(&_out_pool, list);
+  if(stringPoolCount(&_out_pool) > _stats.out_high){
+    _stats.out_high = stringPoolCount(&_out_pool);
+  }
+  return 1;
+}
+
+/** @brief sends a null terminated string to the specified client.
+ *
+ *  @param client_id  The ID of the client to write to
+ *  @param data       The string to write, the null is not sent
+ *  @return A status code indicating success or failure
+ */
+int DSerialMasterBase::sendData(uint8_t client_id, char *data){
+  size_t len = strlen(data);
+  if(len > MAX_DATA_LEN){
+    return 0;
+  }
+  return sendData(client_id, data, len);
+}
+
+/** @brief sends data to every client in the given groups at once
+ *
+ *  A broadcast is a single packet that is not ACK'd by anyone. Instead every
+ *  broadcast carries a sequence number, and clients report the last one they
+ *  received whenever they answer a poll. A client that is behind gets the
+ *  broadcasts it missed resent to it directly, as long as they are among the
+ *  last BROADCAST_HISTORY sent. Use broadcastDelivered to check whether
+ *  every client has caught up with a given broadcast.
+ *
+ *  @param groups A bitmask of client groups to deliver to, ALL_GROUPS for all
+ *  @param data   The data to write to the clients
+ *  @param len    The number of bytes of data, at most MAX_BROADCAST_LEN
+ *  @return The sequence number of the broadcast, 0 on failure
+ */
+uint8_t DSerialMasterBase::sendBroadcast(uint8_t groups, const void *data,
+                                     uint8_t len){
+  dserial_msg_t *new_message = (dserial_msg_t *)stringListBack(&_out_pool,
+                                                               &_out_lists[0]);
+  if(new_message == NULL || groups == 0 || len == 0 ||
+     len > MAX_BROADCAST_LEN){
+    return 0;
+  }
+  _bcast_seq = nextSeq(_bcast_seq);
+  _bcast_head = (_bcast_head + 1) % BROADCAST_HISTORY;
+  if(_bcast_count < BROADCAST_HISTORY){
+    _bcast_count++;
+  }
+  new_message->data[0] = BROADCAST_ADDR;
+  new_message->data[1] = GROUP_WRITE;
+  new_message->data[2] = _bcast_seq;
+  new_message->data[3] = groups;
+  memcpy(new_message->data + 4, data, len);
+  new_message->len = len + 4;
+  _bcast_history[_bcast_head] = *new_message;
+  stringListPush(&_out_pool, &_out_lists[0]);
+  if(stringPoolCount(&_out_pool) > _stats.out_high){
+    _stats.out_high = stringPoolCount(&_out_pool);
+  }
+  return _bcast_seq;
+}
+
+/** @brief sends a null terminated string to every client in the given groups
+ *
+ *  @param groups A bitmask of client groups to deliver to, ALL_GROUPS for all
+ *  @param data   The string to write, the null is not sent
+ *  @return The sequence number of the broadcast, 0 on failure
+ */
+uint8_t DSerialMasterBase::sendBroadcast(uint8_t groups, char *data){
+  size_t len = strlen(data);
+  if(len > MAX_BROADCAST_LEN){
     return 0;
   }
-  strcpy(new_message+2, data);
-  new_message[0] = (char)client_id;
-  new_message[1] = WRITE;
-  stringQueueAdd(&_out_messages, new_message);
+  return sendBroadcast(groups, data, len);
+}
+
+/** @brief checks whether every client has received a broadcast
+ *
+ *  @param seq  A sequence number returned by sendBroadcast
+ *  @return 1 if every known client has reported seq or a later broadcast
+ */
+int DSerialMasterBase::broadcastDelivered(uint8_t seq){
+  for(int i = 0; i < _num_clients; i++){
+    if(_client_state[i].bseq == 0 || seqDistance(seq, _client_state[i].bseq) >= 64){
+      return 0;
+    }
+  }
   return 1;
 }
 
+/** @brief treats every client as up to date with the broadcasts sent so far
+ *
+ *  Clients that have just started (or restarted) report that they have seen
+ *  no broadcasts. After this call such clients are only sent broadcasts newer
+ *  than the current one. Call it after broadcasting something that makes the
+ *  clients restart, so that it is not resent to them forever.
+ */
+void DSerialMasterBase::markBroadcastEpoch(){
+  _bcast_epoch = _bcast_seq;
+  for(int i = 0; i < _max_clients; i++){
+    _client_state[i].bseq = 0;
+  }
+}
+
+/** @brief resends any broadcasts a client has missed
+ *
+ *  @param index    The index of the client in _clients
+ *  @param reported The last broadcast sequence number the client reported
+ */
+void DSerialMasterBase::repairBroadcasts(uint8_t index, uint8_t reported){
+  uint8_t missing;
+  stringList_t *list = &_out_lists[_clients[index]];
+  dserial_msg_t *new_message;
+
+  if(reported != 0){
+    _client_state[index].bseq = reported;
+  } else if(_client_state[index].bseq == 0){
+    // Fresh client, it only needs what was sent since the epoch
+    _client_state[index].bseq = _bcast_epoch;
+  }
+  if(_bcast_seq == 0 || _client_state[index].bseq == _bcast_seq){
+    return;
+  }
+  missing = _bcast_count;
+  if(_client_state[index].bseq != 0 &&
+     seqDistance(_client_state[index].bseq, _bcast_seq) < missing){
+    missing = seqDistance(_client_state[index].bseq, _bcast_seq);
+  }
+  while(missing > 0){
+    missing--;
+    new_message = (dserial_msg_t *)stringListBack(&_out_pool, list);
+    if(new_message == NULL || list->count >= MAX_CLIENT_OUT_MSGS){
+      return; // Try again on the next poll
+    }
+    *new_message = _bcast_history[(_bcast_head + BROADCAST_HISTORY -
+                                   missing) % BROADCAST_HISTORY];
+    new_message->data[0] = _clients[index];
+    stringListPush(&_out_pool, list);
+    if(stringPoolCount(&_out_pool) > _stats.out_high){
+      _stats.out_high = stringPoolCount(&_out_pool);
+    }
+  }
+}
+
 /** @brief Retrieve data if there is any to get
  *
- *  @param buffer A string to populate with the possible data
+ *  At most maxlen bytes are copied, the rest of a longer message is lost.
+ *
+ *  @param buffer A buffer to populate with the possible data
+ *  @param maxlen The size of the buffer
+ *  @param len    Set to the number of bytes put in the buffer, may be NULL
  *  @return The ID of the client that sent the message, 0 if no data.
  */
-int DSerialMaster::getData(char *buffer){
+int DSerialMasterBase::getData(void *buffer, uint8_t maxlen, uint8_t *len){
   int client_id;
-  char *message;
-  if(stringQueueIsEmpty(&_in_messages)){
+  uint8_t data_len;
+  dserial_msg_t *message = (dserial_msg_t *)stringQueueFront(&_in_messages);
+  if(message == NULL){
     return 0;
   }
-  message = stringQueueRemove(&_in_messages);
-  client_id = message[0];
-  strcpy(buffer, message+1);
-  free(message);
+  client_id = message->data[0];
+  data_len = message->len - 1;
+  if(data_len > maxlen){
+    data_len = maxlen;
+  }
+  memcpy(buffer, message->data + 1, data_len);
+  if(len != NULL){
+    *len = data_len;
+  }
+  stringQueuePop(&_in_messages);
+  return client_id;
+}
+
+/** @brief Retrieve data as a null terminated string if there is any to get
+ *
+ *  @param buffer A string of at least MAX_DATA_LEN+1 bytes to populate with
+ *                  the possible data
+ *  @return The ID of the client that sent the message, 0 if no data.
+ */
+int DSerialMasterBase::getData(char *buffer){
+  uint8_t len;
+  int client_id = getData(buffer, MAX_DATA_LEN, &len);
+  if(client_id){
+    buffer[len] = '\0';
+  }
   return client_id;
 }
 
+/** @brief Looks at the oldest received message where it is queued
+ *
+ *  Nothing is copied, the message stays queued (and the pointer good) until
+ *  consumeData or getData takes it. doSerial only ever adds messages, so
+ *  it can be called in between.
+ *
+ *  @param client_id  Set to the ID of the client that sent the message
+ *  @param len        Set to the number of bytes of data
+ *  @return The data, NULL if there is no message
+ */
+const uint8_t *DSerialMasterBase::peekData(uint8_t *client_id, uint8_t *len){
+  dserial_msg_t *message = (dserial_msg_t *)stringQueueFront(&_in_messages);
+  if(message == NULL){
+    return NULL;
+  }
+  *client_id = message->data[0];
+  *len = message->len - 1;
+  return message->data + 1;
+}
+
+/** @brief Drops the oldest received message, the one peekData gave
+ */
+void DSerialMasterBase::consumeData(){
+  stringQueuePop(&_in_messages);
+}
+
+/** @brief sends a packet, counting it in the stats
+ *
+ *  @param message  The message, the address first
+ *  @param len      The length of the message
+ */
+void DSerialMasterBase::transmit(const uint8_t *message, uint8_t len){
+  if(sendPacket(_stream, message, len)){
+    _baud_stats[_baud_index].bytes += len;
+    _stats.frames_out++;
+  }
+}
+
+/** @brief pings a single client and waits for its answer
+ *
+ *  @param client_id  The address to ping
+ *  @return 1 if the client answered, 0 if it timed out
+ */
+int DSerialMasterBase::pingClient(uint8_t client_id) {
+  unsigned long start_millis;
+  dserial_msg_t temp;
+  uint8_t message[2] = {client_id, PING};
+
+  transmit(message, sizeof(message));
+  start_millis = millis();
+  while(millis() - start_millis < TIMEOUT){
+    if(_parser.readPacket(_stream, &temp) == 1 && temp.len >= 2 &&
+       temp.data[0] == client_id && temp.data[1] == ACK){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** @brief broadcasts a slotted PING to a range of addresses
+ *
+ *  Every client with an address between first and last answers, each one
+ *  waiting |address - first| reply slots (see DISCOVERY_ACK_LEN) from the
+ *  end of the PING before doing so, so all of the answers fit back to back
+ *  in a single listening window.
+ *
+ *  @param first  The address that answers first
+ *  @param last   The address that answers last, may be below first
+ *  @param found  A bitmap indexed by address, answering clients are set in it
+ *  @return 1 if the window was clean, 0 if a collision or corruption was seen
+ */
+int DSerialMasterBase::discoverRange(uint8_t first, uint8_t last, uint8_t *found) {
+  unsigned long start_micros;
+  unsigned long window;
+  dserial_msg_t temp;
+  uint8_t message[4] = {BROADCAST_ADDR, PING, first, last};
+  uint8_t low = (first < last) ? first : last;
+  uint8_t high = (first < last) ? last : first;
+  int clean = 1;
+
+  window = (unsigned long)(high - low + 1) *
+           discoverySlot(dserial_baud_rates[_baud_index]) + TIMEOUT * 1000UL;
+  _parser.sawNoise();
+  transmit(message, sizeof(message));
+  start_micros = micros();
+  while(micros() - start_micros < window){
+    int result = _parser.readPacket(_stream, &temp);
+    if(result == 1 && temp.len >= 2 && temp.data[1] == ACK &&
+       temp.data[0] >= low && temp.data[0] <= high){
+      found[temp.data[0] / 8] |= 1 << (temp.data[0] % 8);
+    } else if(result == -1) {
+      clean = 0;
+    }
+  }
+  if(_parser.sawNoise()){
+    clean = 0;
+  }
+  return clean;
+}
+
 /** @brief runs a client search
  *
- *  A client search consists of pinging each client address between 1 and 
- *  MAX_CLIENTS. If the client responds, then it gets put in our array.
+ *  A client search broadcasts one slotted PING covering every address
+ *  between 1 and MAX_CLIENTS-1 (CLIENTS-1 for a DSerialMasterT) and listens
+ *  for all of the answers at once, so it takes roughly one round trip plus
+ *  one reply slot per address rather than a full TIMEOUT for every empty
+ *  address. If replies collided the broadcast is repeated, up to
+ *  DISCOVERY_PASSES times, with the reply slots in the other order each
+ *  time.
+ *
+ *  Because colliding replies can merge into a packet that looks valid, every
+ *  address heard during discovery is then confirmed with a normal PING
+ *  before it gets put in our array.
  *
  *  @return The number of clients found
  */
-int DSerialMaster::identifyClients() {
-  unsigned long start_millis;
-  char temp[MAX_MSG_LEN];
-  char message[3] = {(char)1, PING, '\0'};
+int DSerialMasterBase::identifyClients() {
+  uint8_t found[CLIENT_BITMAP_LEN(MAX_CLIENTS)];
   _num_clients = 0;
-  memset(_clients, 0, MAX_CLIENTS);
+  memset(_clients, 0, _max_clients);
+  memset(_client_state, 0, _max_clients * sizeof(client_state_t));
+  memset(_rx_next, 0, _max_clients);
+  memset(_rx_valid, 0, CLIENT_BITMAP_LEN(_max_clients));
+  memset(_dead, 0, CLIENT_BITMAP_LEN(_max_clients));
+  memset(found, 0, sizeof(found));
 
   while(_state != MASTER_WAITING){
     doSerial(); // RETURN_CODE?
   }
 
-  for (int i = 1; i < MAX_CLIENTS; i++) {
-    message[0] = (char)i;
-    sendPacket(_stream, message);
-    start_millis = millis();
-    while(millis() - start_millis < TIMEOUT){
-      int result = readPacket(_stream, temp);
-      if(result > 0){
-        _clients[_num_clients] = i;
-        _num_clients++;
-        break;
-      }
+  for (int pass = 0; pass < DISCOVERY_PASSES; pass++) {
+    int clean = (pass % 2 == 0) ? discoverRange(1, _max_clients - 1, found) :
+                                  discoverRange(_max_clients - 1, 1, found);
+    if(clean){
+      break;
+    }
+  }
+
+  for (int i = 1; i < _max_clients; i++) {
+    if((found[i / 8] & (1 << (i % 8))) && pingClient(i)){
+      _clients[_num_clients] = i;
+      _num_clients++;
     }
   }
+  _scheduler->begin(_num_clients);
   return _num_clients;
 }
 
@@ -200,235 +750,1466 @@ int DSerialMaster::identifyClients() {
  *  If the clients argument is NULL, the number of clients will still be
  *  returned, but it will not attempt to populate the array.
  *
- *  @param clients  a pointer to memory of at least MAX_CLIENTS size to put
-                      the the clients into 
+ *  @param clients  a pointer to memory of at least MAX_CLIENTS (CLIENTS for
+                      a DSerialMasterT) size to put the the clients into 
  *  @return The number of clients found
  */
-int DSerialMaster::getClients(uint8_t *clients){
+int DSerialMasterBase::getClients(uint8_t *clients){
   if(clients != NULL){
     memcpy(clients, _clients, _num_clients);
   }
   return _num_clients;
 }
 
-int DSerialMaster::doSerial(){
-  static unsigned long last_millis;
-  static uint8_t num_attempts;
-  static uint8_t client_index = 0;
-  static char    current_msg[MAX_MSG_LEN+1];
-  char *msg_ptr;
-  char short_msg[3] = {(char)_clients[client_index], '\0', '\0'};
-
-  // Read stream for input
-  char *buffer = (char*) malloc(MAX_MSG_LEN+1);
-  if(buffer == NULL){ // Fail if buffer allocation failed
-    return 0;
-  }
-  int result = readPacket(_stream, buffer);
-  if(result != 1){ // Free buffer if we didn't get a useful packet
-    free(buffer);
+/** @brief Retrieve the oldest client event if there is one
+ *
+ *  Events tell about clients that stop answering, get dropped from the
+ *  client list, and come back. If more than EVENT_QUEUE_SIZE events pile up
+ *  the oldest ones are lost, getClients always has the current list.
+ *
+ *  @param client_id  Set to the address of the client the event is about
+ *  @return The event, one of EVENT_*, EVENT_NONE if there is none
+ */
+int DSerialMasterBase::getEvent(uint8_t *client_id){
+  uint8_t *event;
+  if(_event_count == 0){
+    return EVENT_NONE;
   }
-  if(result == -1) {            // Bad data, send NAK.
-    short_msg[0] = current_msg[0];
-    short_msg[1] = NAK;
-    sendPacket(_stream, short_msg);
-    strcpy(current_msg, short_msg);
-    return 1;
+  event = _events[(_event_head + EVENT_QUEUE_SIZE - _event_count) %
+                  EVENT_QUEUE_SIZE];
+  _event_count--;
+  if(client_id != NULL){
+    *client_id = event[1];
   }
-  switch(_state){
-    // WAITING state: ignore incoming, send waiting, otherwise poll.
-    case MASTER_WAITING:
-      if(!stringQueueIsEmpty(&_out_messages)){
-        msg_ptr =  stringQueueRemove(&_out_messages);
-        strcpy(current_msg, msg_ptr);
-        free(msg_ptr);
-        _state = MASTER_ACK;
-      } else if(_num_clients > 0 && !stringQueueIsFull(&_in_messages)) {
-        client_index = (client_index + 1) % _num_clients;
-        short_msg[0] = (char)_clients[client_index];
-        short_msg[1] = READ;
-        strcpy(current_msg, short_msg);
-        _state = MASTER_SENT;
-      } else {
-        return 1; // No data to send and no clients to poll
-      }
-      sendPacket(_stream, current_msg);
-      num_attempts = 0;
-      last_millis = millis();
+  return event[0];
+}
 
-      break;
+/** @brief queues a client event, over the oldest one if the queue is full */
+void DSerialMasterBase::addEvent(uint8_t event, uint8_t client_id){
+  _events[_event_head][0] = event;
+  _events[_event_head][1] = client_id;
+  _event_head = (_event_head + 1) % EVENT_QUEUE_SIZE;
+  if(_event_count < EVENT_QUEUE_SIZE){
+    _event_count++;
+  }
+}
 
-    // SENT state: assumed mid-read, deal with timeout/valid read.
-    case MASTER_SENT:
-      if(result == 0){
-        if(millis() - last_millis > TIMEOUT) { // Timed out, send READ again
-          if(num_attempts >= MAX_RETRIES){
-            _state = MASTER_WAITING;
-            return 0;
-          }
-          sendPacket(_stream, current_msg);
-          num_attempts++;
-        }
-      } else if(result == 1) { // Useful packet
-        if(buffer[1] == ACK){ // Client ACK'd read request indicating no data
-          free(buffer);
-          _state = MASTER_WAITING;
-        } else {
-          stringQueueAdd(&_in_messages, buffer); // we're safe because of earlier check
-          short_msg[1] = ACK;
-          sendPacket(_stream, short_msg);
-          strcpy(current_msg, short_msg);
-          _state = MASTER_ACK;
-        }
-      }
+/** @brief counts a poll that was never answered against the current client
+ */
+void DSerialMasterBase::pollFailed(){
+  client_state_t *client = &_client_state[_client_index];
 
-      break;
+  _scheduler->polled(_client_index, POLL_FAILED);
+  if(client->fails < 0xFF){
+    client->fails++;
+  }
+  if(client->fails >= DEAD_AFTER){
+    dropClient(_client_index);
+  } else if(client->fails == SUSPECT_AFTER){
+    addEvent(EVENT_CLIENT_SUSPECT, _clients[_client_index]);
+  }
+}
 
-    // ACK state: waiting for client ACK, dealing with timeouts and non-ACKs
-    case MASTER_ACK:
-      // Deal with packet
-      if(result == 0){       // Timed out, send ACK again
-        if(millis() - last_millis > TIMEOUT) {
-          if(num_attempts >= MAX_RETRIES){
-            _state = MASTER_WAITING;
-            return 0;
-          }
-          sendPacket(_stream, current_msg);
-          num_attempts++;
-        }
-      } else if(result == 1) {      // Useful packet
-        if(buffer[1] == ACK){
-          free(buffer);
-          _state = MASTER_WAITING;
-        } else {
-          free(buffer);
-          short_msg[1] = NAK;
-          sendPacket(_stream, short_msg);
-          strcpy(current_msg, short_msg);
-        }
-      }
+/** @brief takes a client out of the client list so it is no longer polled
+ *
+ *  Messages waiting for it stay queued, in case it comes back.
+ *
+ *  @param index  The index of the client in _clients
+ */
+void DSerialMasterBase::dropClient(uint8_t index){
+  uint8_t client_id = _clients[index];
 
-      break;
+  _dead[client_id / 8] |= 1 << (client_id % 8);
+  _num_clients--;
+  for(int i = index; i < _num_clients; i++){
+    _clients[i] = _clients[i+1];
+    _client_state[i] = _client_state[i+1];
   }
-  return 1;
+  _clients[_num_clients] = 0;
+  _client_index = 0;
+  _write_index = 0;
+  _scheduler->begin(_num_clients);
+  addEvent(EVENT_CLIENT_LOST, client_id);
 }
 
-/** @brief Creates a new DSerialClient object
- * 
- *  @param port The underlying stream object used for communication.
-
- *  @return A new initialized DSerialClient object
+/** @brief puts a dropped or new client that answered a probe in the list
+ *
+ *  It starts over as if it were new, a dropped one has most likely
+ *  restarted.
+ *
+ *  @param client_id  The address of the client
  */
-DSerialClient::DSerialClient(Stream &port, uint8_t client_number):_stream(port){
-  _state = 0;
-  _client_number = client_number;
-  stringQueueInit(&_in_messages, MAX_CLIENT_QUEUE_SIZE);
-  stringQueueInit(&_out_messages, MAX_CLIENT_QUEUE_SIZE);
+void DSerialMasterBase::admitClient(uint8_t client_id){
+  _dead[client_id / 8] &= ~(1 << (client_id % 8));
+  memset(&_client_state[_num_clients], 0, sizeof(client_state_t));
+  _clients[_num_clients] = client_id;
+  _num_clients++;
+  _scheduler->begin(_num_clients);
+  addEvent(EVENT_CLIENT_JOINED, client_id);
 }
 
-/** @brief sends a data string to the master.
+/** @brief sends a {BAUD}{INDEX} at the safe rate
  *
- *  Internally, this function enqueues the data to be written when convenient.
- *  This function fails when there is not enough memory to enqueue the message
- *  or when the queue is full.
+ *  Brings a client that (re)started at the safe rate to the bus rate, one
+ *  sent to its address straight away and BROADCAST_ADDR after
+ *  BAUD_SWITCH_DELAY_MS. Every client at the bus rate hears it as noise, so
+ *  it is kept for when it is likely to be needed. Does nothing at the safe
+ *  rate.
  *
- *  @param data The data to write to the given client
- *  @return A status code indicating success or failure
+ *  @param addr  A client's address, or BROADCAST_ADDR
  */
-int DSerialClient::sendData(char *data){
-  if(stringQueueIsFull(&_out_messages)){
-    return 0;
-  }
-  char *new_message = (char*) malloc(MAX_MSG_LEN+1);
-  if(new_message == NULL){
-    return 0;
+void DSerialMasterBase::sendBaudNudge(uint8_t addr){
+  uint8_t nudge[3] = {addr, BAUD, _baud_index};
+
+  if(_baud_index == SAFE_BAUD_INDEX){
+    return;
   }
-  strcpy(new_message+1, data);
-  new_message[0] = (char)_client_number;
-  stringQueueAdd(&_out_messages, new_message);
-  return 1;
+  _set_baud(dserial_baud_rates[SAFE_BAUD_INDEX]);
+  _stream.write((uint8_t)0); // End whatever it made of the bus traffic
+  transmit(nudge, sizeof(nudge));
+  _set_baud(dserial_baud_rates[_baud_index]);
+  _stream.write((uint8_t)0); // Same for the clients at the bus rate
 }
 
-/** @brief Retrieve data if there is any to get
+/** @brief PINGs an address that is not in the client list
  *
- *  @param buffer A string to populate with the possible data
- *  @return A status code indicating whether data was retrieved
+ *  The answer is dealt with by doSerial in the MASTER_PROBE state.
+ *
+ *  @param client_id  The address to PING
+ *  @param timeout    How long to wait for the answer in us
  */
-int DSerialClient::getData(char *buffer){
-  char *message;
-  if(stringQueueIsEmpty(&_in_messages)){
-    return 0;
-  }
-  message = stringQueueRemove(&_in_messages);
-  strcpy(buffer, message+2);
-  free(message);
-  return 1;
+void DSerialMasterBase::probeAddress(uint8_t client_id, unsigned long timeout){
+  uint8_t message[2] = {client_id, PING};
+
+  transmit(message, sizeof(message));
+  _probe_target = client_id;
+  _state = MASTER_PROBE;
+  _timeout = timeout;
+  _last_micros = micros();
 }
 
-int DSerialClient::doSerial(){
-  static char    current_msg[MAX_MSG_LEN+1];
-  char short_msg[3] = {(char)_client_number, '\0', '\0'};
-  char *msg_ptr;
+/** @brief PINGs the next dropped client, if it is time to
+ *
+ *  With a scheduler that grants probes the nudge and the PING each take a
+ *  SCHEDULE_PROBE slot, the PING the next one.
+ */
+void DSerialMasterBase::sendProbe(){
+  uint8_t client_id = _probe_addr;
 
-  // Read stream for input
-  char *buffer = (char*) malloc(MAX_MSG_LEN+1);
-  if(buffer == NULL){ // Fail if buffer allocation failed
-    return 0;
+  if(_probe_nudged){
+    _probe_nudged = 0;
+    if(_dead[client_id / 8] & (1 << (client_id % 8))){
+      probeAddress(client_id, _scheduler->probeTimeout(TIMEOUT * 1000UL));
+    }
+    return;
   }
-  int result = readPacket(_stream, buffer);
-  if(result != 1){ // Free buffer if we didn't get a useful packet
-    free(buffer);
-    return 1;
+  if(millis() - _probe_millis < DEAD_PROBE_INTERVAL){
+    return;
   }
-  if(buffer[0] != _client_number){
-    free(buffer);
-    return 1;
+  _probe_millis = millis();
+  for(int i = 1; i <= _max_clients; i++){
+    client_id = (_probe_addr + i) % _max_clients;
+    if(_dead[client_id / 8] & (1 << (client_id % 8))){
+      _probe_addr = client_id;
+      // It most likely restarted, at the safe rate. It answers the next
+      // PING if it missed this one.
+      sendBaudNudge(client_id);
+      if(_scheduler->grantsProbes() && _baud_index != SAFE_BAUD_INDEX){
+        _probe_nudged = 1;
+        return;
+      }
+      probeAddress(client_id, _scheduler->probeTimeout(TIMEOUT * 1000UL));
+      return;
+    }
   }
-  if(buffer[1] == NAK){
-    free(buffer);
-    sendPacket(_stream, current_msg);
-    return 1;
+}
+
+/** @brief PINGs the next address nobody is known at, if it is time to
+ *
+ *  Only called when no client is due, or in a slot the scheduler grants for
+ *  it, so a module that powers up late (or is plugged in mid-game) gets
+ *  found without holding up the polling. Dropped clients are left to
+ *  sendProbe.
+ *
+ *  A module that powers up late does so at the safe rate. Rather than
+ *  sending it a {BAUD}{INDEX} before every PING, a pass over the addresses
+ *  starts with one broadcast, which brings it to the bus rate in time for
+ *  its PING.
+ */
+void DSerialMasterBase::sendHotplugProbe(){
+  if(_hotplug_interval == 0 ||
+     millis() - _hotplug_millis < _hotplug_interval){
+    return;
+  }
+  _hotplug_millis = millis();
+  for(int i = 1; i <= _max_clients; i++){
+    uint8_t client_id = (_hotplug_addr + i) % _max_clients;
+    if(client_id != 0 && clientIndex(client_id) < 0 &&
+       !(_dead[client_id / 8] & (1 << (client_id % 8)))){
+      // The first PING, or wrapped around to the start of the addresses
+      if((_hotplug_addr == 0 || _hotplug_addr + i >= _max_clients) &&
+         _baud_index != SAFE_BAUD_INDEX &&
+         millis() - _nudge_millis >= HOTPLUG_NUDGE_INTERVAL){
+        _nudge_millis = millis();
+        sendBaudNudge(BROADCAST_ADDR);
+        return; // PINGs start next time, once the clients have switched
+      }
+      _hotplug_addr = client_id;
+      probeAddress(client_id, _scheduler->probeTimeout(HOTPLUG_TIMEOUT_US));
+      return;
+    }
+  }
+}
+
+/** @brief sets how often an unknown address is PINGed in idle time
+ *
+ *  @param interval  ms between PINGs, 0 to turn hot-plug discovery off
+ */
+void DSerialMasterBase::setHotplugInterval(uint16_t interval){
+  _hotplug_interval = interval;
+}
+
+/** @brief replaces the scheduler that picks which client to poll
+ *
+ *  @param scheduler  The new scheduler, NULL to go back to the master's own
+ *                      DSerialPrioritySchedulerT. It must outlive the master.
+ */
+void DSerialMasterBase::setScheduler(DSerialScheduler *scheduler){
+  if(scheduler == NULL){
+    scheduler = _default_scheduler;
+  }
+  _scheduler = scheduler;
+  _scheduler->begin(_num_clients);
+}
+
+/** @brief hands the master a byte from the UART receive interrupt
+ *
+ *  Received packets are then decoded as they come in rather than when
+ *  doSerial gets to them, see DSerialParser::receiveByte. Once this has
+ *  been called the stream is only used for sending. The master needs the
+ *  ring for it, DSerialMasterT<CLIENTS, QUEUE_SIZE, true>, without it every
+ *  packet is dropped.
+ *
+ *  @param c  The received byte
+ */
+void DSerialMasterBase::receiveByte(uint8_t c){
+  _parser.receiveByte(c);
+}
+
+/** @brief lets the master change the bus baud rate
+ *
+ *  Until this is called the bus stays at the safe rate.
+ *
+ *  @param set_baud  Called to change the port's rate, see dserial_baud_fn
+ *  @param max_baud  The fastest rate the master's port can run at
+ */
+void DSerialMasterBase::setBaudControl(dserial_baud_fn set_baud,
+                                   unsigned long max_baud){
+  _set_baud = set_baud;
+  _baud_max = (set_baud != NULL) ? baudIndex(max_baud) : SAFE_BAUD_INDEX;
+}
+
+/** @brief asks a client for the fastest baud rate it can run at
+ *
+ *  @param client_id  The address of the client
+ *  @return The index of the rate in dserial_baud_rates, -1 if it never
+ *            answered
+ */
+int DSerialMasterBase::queryBaud(uint8_t client_id){
+  unsigned long start_millis;
+  dserial_msg_t temp;
+  uint8_t message[2] = {client_id, BAUD};
+
+  for(int attempt = 0; attempt <= MAX_RETRIES; attempt++){
+    transmit(message, sizeof(message));
+    start_millis = millis();
+    while(millis() - start_millis < TIMEOUT){
+      if(_parser.readPacket(_stream, &temp) == 1 && temp.len == 3 &&
+         temp.data[0] == client_id && temp.data[1] == BAUD){
+        return (temp.data[2] < NUM_BAUD_RATES) ? temp.data[2] : -1;
+      }
+    }
+  }
+  return -1;
+}
+
+/** @brief broadcasts a baud rate switch and waits to follow it
+ *
+ *  doSerial changes the master's own rate once BAUD_SWITCH_DELAY_MS is up,
+ *  counted from when the last copy is done sending, so that clients that
+ *  only heard that one have switched too.
+ *
+ *  @param index  The index of the new rate in dserial_baud_rates
+ */
+void DSerialMasterBase::startBaudSwitch(uint8_t index){
+  uint8_t message[3] = {BROADCAST_ADDR, BAUD, index};
+
+  for(int i = 0; i < BAUD_SWITCH_REPEATS; i++){
+    transmit(message, sizeof(message));
+  }
+  _baud_pending = index;
+  _state = MASTER_SWITCHING;
+  _timeout = BAUD_SWITCH_DELAY_MS * 1000UL +
+             BAUD_SWITCH_REPEATS * wireTime(sizeof(message));
+  _last_micros = micros();
+}
+
+/** @brief switches the bus to a baud rate, blocking until it has
+ *
+ *  @param index  The index of the new rate in dserial_baud_rates
+ */
+void DSerialMasterBase::switchBaud(uint8_t index){
+  startBaudSwitch(index);
+  while(_state != MASTER_WAITING){
+    doSerial();
+  }
+}
+
+/** @brief changes the master's own baud rate
+ *
+ *  Round trip times measured at the old rate say nothing about the new
+ *  one, so every client starts over with the default timeout.
+ *
+ *  @param index  The index of the new rate in dserial_baud_rates
+ */
+void DSerialMasterBase::applyBaud(uint8_t index){
+  unsigned long now = millis();
+
+  _baud_stats[_baud_index].millis += now - _baud_millis;
+  _baud_millis = now;
+  _set_baud(dserial_baud_rates[index]);
+  _baud_index = index;
+  _baud_pending = BAUD_NONE;
+  _sample_exchanges = 0;
+  _sample_errors = 0;
+  for(int i = 0; i < _max_clients; i++){
+    _client_state[i].srtt = 0;
+    _client_state[i].rttvar = 0;
+    _client_state[i].backoff = 0;
+    _client_state[i].rtt_min = 0xFFFF;
+    _client_state[i].rtt_max = 0;
+  }
+  _parser.sawNoise(); // Whatever was half received is garbage now
+}
+
+/** @brief counts the current exchange as one that saw an error, once */
+void DSerialMasterBase::countError(){
+  if(!_exchange_error){
+    _exchange_error = 1;
+    _sample_errors++;
+  }
+}
+
+/** @brief steps the bus down a baud rate if too many exchanges go wrong
+ *
+ *  Exchanges are counted BAUD_SAMPLE_EXCHANGES at a time. The rate that
+ *  was stepped down from is not switched to again by negotiateBaud.
+ *
+ *  @return 1 if a switch was started, 0 otherwise
+ */
+int DSerialMasterBase::checkErrorRate(){
+  uint8_t fallback;
+
+  if(_sample_exchanges < BAUD_SAMPLE_EXCHANGES){
+    return 0;
+  }
+  fallback = (_sample_errors >= BAUD_FALLBACK_ERRORS &&
+              _baud_index != SAFE_BAUD_INDEX);
+  _sample_exchanges = 0;
+  _sample_errors = 0;
+  if(!fallback){
+    return 0;
+  }
+  _baud_stats[_baud_index].fallbacks++;
+  _baud_max = _baud_index - 1;
+  startBaudSwitch(_baud_max);
+  return 1;
+}
+
+/** @brief moves the bus to the fastest baud rate every client can run at
+ *
+ *  Every client is asked for the fastest rate it supports (one that does
+ *  not answer is taken to only support the safe rate), and the switch is
+ *  broadcast. Every client is then PINGed at the new rate. If one does not
+ *  answer, everybody goes back to the old rate and the next slower one is
+ *  tried. Like identifyClients this blocks, call it once the clients are
+ *  known (and again after identifyClients). Afterwards doSerial steps the
+ *  rate down by itself if errors pile up, see BAUD_FALLBACK_ERRORS.
+ *
+ *  @return The baud rate the bus ended up at
+ */
+unsigned long DSerialMasterBase::negotiateBaud(){
+  uint8_t previous;
+  int target = _baud_max;
+  int verified;
+
+  while(_state != MASTER_WAITING){
+    doSerial();
+  }
+  if(_set_baud == NULL){
+    return getBaud();
+  }
+  for(int i = 0; i < _num_clients; i++){
+    int client_max = queryBaud(_clients[i]);
+    if(client_max < target){
+      target = (client_max < 0) ? SAFE_BAUD_INDEX : client_max;
+    }
+  }
+
+  previous = _baud_index;
+  if(target < previous){
+    switchBaud(target);
+  }
+  for(; target > previous; target--){
+    switchBaud(target);
+    verified = 1;
+    for(int i = 0; i < _num_clients && verified; i++){
+      verified = pingClient(_clients[i]) || pingClient(_clients[i]);
+    }
+    if(verified){
+      break;
+    }
+    switchBaud(previous); // Somebody did not follow, everybody back
+  }
+  return getBaud();
+}
+
+/** @brief gives the current bus baud rate
+ *
+ *  @return The baud rate
+ */
+unsigned long DSerialMasterBase::getBaud(){
+  return dserial_baud_rates[_baud_index];
+}
+
+/** @brief gives what the master saw at one of the baud rates
+ *
+ *  The throughput at a rate is stats->bytes * 1000 / stats->millis bytes
+ *  per second, its error rate (bad_packets + timeouts) / packets.
+ *
+ *  @param index  The index of the rate in dserial_baud_rates
+ *  @param stats  Filled in with the stats, the time spent at the current
+ *                  rate counted up to now
+ *  @return The baud rate, 0 if index is out of range
+ */
+unsigned long DSerialMasterBase::getBaudStats(uint8_t index,
+                                          dserial_baud_stats_t *stats){
+  if(index >= NUM_BAUD_RATES){
+    return 0;
+  }
+  *stats = _baud_stats[index];
+  if(index == _baud_index){
+    stats->millis += millis() - _baud_millis;
+  }
+  return dserial_baud_rates[index];
+}
+
+/** @brief gives what the master counted since it started or resetStats
+ *
+ *  Counting costs an increment here and there, so it is always on. Look
+ *  at it when a bus misbehaves: bad_frames points at noise or wiring,
+ *  timeouts at clients that stopped answering, naks and retries at how
+ *  much of the bus goes to repeating things, and a high water mark at
+ *  QUEUE_SIZE at queues that fill up.
+ *
+ *  @param stats  Filled in with the counts
+ */
+void DSerialMasterBase::getStats(dserial_stats_t *stats){
+  *stats = _stats;
+  _parser.getCounts(stats);
+}
+
+/** @brief gives a client's round trip times
+ *
+ *  Times are measured from exchanges answered the first time, since the
+ *  last baud rate change or resetStats.
+ *
+ *  @param client_id  The address of the client
+ *  @param rtt        Filled in with the times, all 0 if none were measured
+ *  @return 1 if the client has been measured, 0 if not or if it is not a
+ *            known client
+ */
+int DSerialMasterBase::getClientRtt(uint8_t client_id, dserial_rtt_stats_t *rtt){
+  int index = clientIndex(client_id);
+  client_state_t *client;
+
+  memset(rtt, 0, sizeof(*rtt));
+  if(index < 0){
+    return 0;
+  }
+  client = &_client_state[index];
+  if(client->srtt == 0 || client->rtt_min > client->rtt_max){
+    return 0;
+  }
+  rtt->min_us = client->rtt_min;
+  rtt->avg_us = client->srtt;
+  rtt->max_us = client->rtt_max;
+  return 1;
+}
+
+/** @brief starts the counts of getStats and getClientRtt over
+ *
+ *  The per baud rate stats are left alone.
+ */
+void DSerialMasterBase::resetStats(){
+  memset(&_stats, 0, sizeof(_stats));
+  _parser.resetCounts();
+  for(int i = 0; i < _max_clients; i++){
+    _client_state[i].rtt_min = 0xFFFF;
+    _client_state[i].rtt_max = 0;
+  }
+}
+
+/** @brief finds where a client address is in _clients
+ *
+ *  @param client_id  The address to look for
+ *  @return The index of the client, -1 if it is not a known client
+ */
+int DSerialMasterBase::clientIndex(uint8_t client_id){
+  for(int i = 0; i < _num_clients; i++){
+    if(_clients[i] == client_id){
+      return i;
+    }
+  }
+  return -1;
+}
+
+/** @brief folds a round trip time measurement into a client's estimate
+ *
+ *  Only exchanges that were answered without any resend are measured, as
+ *  there is no telling which copy a resent poll's reply belongs to. What
+ *  is kept is the client's turnaround, the time the poll and reply took to
+ *  cross the bus is taken out since it depends on their lengths.
+ *
+ *  @param index  The index of the client in _clients
+ *  @param rtt    The measured round trip time in us
+ *  @param wire   The time the poll and reply took to send, in us
+ */
+void DSerialMasterBase::sampleRtt(uint8_t index, unsigned long rtt,
+                                  unsigned long wire){
+  client_state_t *client = &_client_state[index];
+  long err;
+
+  rtt = (rtt > wire) ? rtt - wire : 0;
+  if(rtt > 0xFFFF){
+    rtt = 0xFFFF;
+  }
+  if(rtt < client->rtt_min || client->srtt == 0){
+    client->rtt_min = rtt;
+  }
+  if(rtt > client->rtt_max){
+    client->rtt_max = rtt;
+  }
+  if(client->srtt == 0){ // First measurement
+    client->srtt = rtt ? rtt : 1;
+    client->rttvar = rtt / 2;
+  } else {
+    err = (long)rtt - client->srtt;
+    client->srtt += err / 8;
+    if(client->srtt == 0){
+      client->srtt = 1;
+    }
+    if(err < 0){
+      err = -err;
+    }
+    client->rttvar += (err - (long)client->rttvar) / 4;
+  }
+  client->backoff = 0;
+}
+
+/** @brief works out how long a message takes to send at the current rate
+ *
+ *  @param len  Length of the message, address included
+ *  @return The time in us for the message, its CRC, the COBS code byte and
+ *            the closing 0, at 10 bits per byte
+ */
+unsigned long DSerialMasterBase::wireTime(uint8_t len){
+  return (len + 3) * 10 * 1000000UL / dserial_baud_rates[_baud_index];
+}
+
+/** @brief works out how long to wait for a client's reply to _current_msg
+ *
+ *  The port sends in the background, so the wait starts with the poll
+ *  still going out. On top of the client's turnaround it allows for the
+ *  poll and the longest reply to cross the bus.
+ *
+ *  @param index  The index of the client in _clients
+ *  @return The timeout in us
+ */
+unsigned long DSerialMasterBase::retransmitTimeout(uint8_t index){
+  client_state_t *client = &_client_state[index];
+  unsigned long rto;
+
+  if(client->srtt == 0){
+    rto = TIMEOUT * 1000UL;
+  } else {
+    rto = client->srtt + 4UL * client->rttvar;
+  }
+  if(rto < RTO_MIN_US){
+    rto = RTO_MIN_US;
+  }
+  for(uint8_t i = 0; i < client->backoff && rto < RTO_MAX_US; i++){
+    rto *= 2;
+  }
+  if(rto > RTO_MAX_US){
+    rto = RTO_MAX_US;
+  }
+  return rto + wireTime(_current_msg.len) + wireTime(MAX_MSG_LEN);
+}
+
+/** @brief picks which waiting write the scheduler is offered next
+ *
+ *  Broadcasts go first, then clients with messages waiting take turns.
+ *
+ *  @return SCHEDULE_WRITE for a broadcast, the index of a client with a
+ *            message waiting, or SCHEDULE_IDLE if nothing is waiting
+ */
+int DSerialMasterBase::nextWrite(){
+  uint8_t index;
+
+  if(!stringListIsEmpty(&_out_lists[0])){
+    return SCHEDULE_WRITE;
+  }
+  for(int i = 1; i <= _num_clients; i++){
+    index = (_write_index + i) % _num_clients;
+    if(!stringListIsEmpty(&_out_lists[_clients[index]])){
+      return index;
+    }
+  }
+  return SCHEDULE_IDLE;
+}
+
+/** @brief starts an exchange by polling a client
+ *
+ *  The poll carries the oldest message waiting for the client, if any.
+ *
+ *  @param index  The index of the client in _clients
+ */
+void DSerialMasterBase::sendPoll(uint8_t index){
+  client_state_t *client = &_client_state[index];
+  dserial_msg_t *payload = (dserial_msg_t *)stringListFront(&_out_pool,
+                                            &_out_lists[_clients[index]]);
+  uint8_t client_id = _clients[index];
+  uint8_t ctl = CTL_BASE;
+
+  // No more replies than there is room for
+  _window = _queue_size - stringQueueCount(&_in_messages);
+  if(_scheduler->replyWindow(index) < _window){
+    _window = _scheduler->replyWindow(index);
+  }
+  if(_window < 1){
+    _window = 1;
+  } else if(_window > MAX_WINDOW){
+    _window = MAX_WINDOW;
+  }
+  ctl |= (_window - 1) << CTL_WINDOW_SHIFT;
+  if(client->flags & LINK_SYNACK){
+    ctl |= CTL_SYNACK;
+  }
+  // Until a reply has told us the client's SEQs, RACK could ACK anything
+  if(_rx_valid[client_id / 8] & (1 << (client_id % 8))){
+    ctl |= CTL_RACK_VALID;
+  }
+  if(!(client->flags & LINK_SYNCED)){
+    ctl |= CTL_SYN;
+    payload = NULL; // Nothing can be written until the client has synced
+  }
+  if(payload != NULL){
+    _write_index = index;
+    if(client->flags & LINK_TX_SEQ){
+      ctl |= CTL_DATA_SEQ;
+    }
+  }
+
+  _client_index = index;
+  _poll_has_data = (payload != NULL);
+  _current_msg.data[0] = client_id;
+  _current_msg.data[1] = READ;
+  _current_msg.data[2] = ctl;
+  _current_msg.data[3] = _rx_next[client_id];
+  _current_msg.len = 4;
+  if(payload != NULL){ // Everything but the address
+    memcpy(_current_msg.data + 4, payload->data + 1, payload->len - 1);
+    _current_msg.len += payload->len - 1;
+  }
+  transmit(_current_msg.data, _current_msg.len);
+  _state = MASTER_SENT;
+  _num_attempts = 0;
+  _resent = 0;
+  _replied = 0;
+  _reply_data = 0;
+  _attention = 0;
+  _exchange_error = 0;
+  if(_sample_exchanges < 0xFF){
+    _sample_exchanges++;
+  }
+  _timeout = _scheduler->replyTimeout(index, retransmitTimeout(index));
+  _last_micros = micros();
+}
+
+/** @brief deals with the first reply of a burst to come in
+ *
+ *  Every reply of a burst carries the same CTL bits (but CTL_MORE) and
+ *  BSEQ, so whichever one comes in first does.
+ *
+ *  @param reply The reply, {ADDR}{ACK}{CTL}{BSEQ}{SEQ}{DATA}
+ */
+void DSerialMasterBase::handleReply(dserial_msg_t *reply){
+  client_state_t *client = &_client_state[_client_index];
+  uint8_t client_id = reply->data[0];
+  uint8_t ctl = reply->data[2];
+
+  if(ctl & CTL_SYN){ // Client (re)started, its SEQs start over
+    client->flags |= LINK_SYNACK;
+    _rx_valid[client_id / 8] &= ~(1 << (client_id % 8));
+    _rx_next[client_id] = 0;
+  } else {
+    client->flags &= ~LINK_SYNACK;
+  }
+  if(ctl & CTL_SYNACK){
+    client->flags |= LINK_SYNCED;
+  }
+
+  if(client->fails >= SUSPECT_AFTER){
+    addEvent(EVENT_CLIENT_RECOVERED, client_id);
+  }
+  client->fails = 0;
+
+  // Our write got through if the client ACKs its sequence bit
+  if(_poll_has_data &&
+     !(ctl & CTL_ACK_SEQ) == !(client->flags & LINK_TX_SEQ)){
+    stringListPop(&_out_pool, &_out_lists[client_id]);
+    client->flags ^= LINK_TX_SEQ;
+  }
+
+  // Only look for missed broadcasts when nothing is queued for the client,
+  // otherwise the resends queued last time may still be waiting.
+  if(!_poll_has_data){
+    repairBroadcasts(_client_index, reply->data[3] & 0x7F);
+  }
+}
+
+/** @brief takes the data of a reply, if it is the next the client sent
+ *
+ *  The data gets ACK'd by RACK in the next poll of the client. Anything
+ *  after a lost reply is dropped and sent again by the client in its next
+ *  burst.
+ *
+ *  @param reply The reply, {ADDR}{ACK}{CTL}{BSEQ}{SEQ}{DATA}
+ */
+void DSerialMasterBase::acceptReplyData(dserial_msg_t *reply){
+  uint8_t client_id = reply->data[0];
+  uint8_t ctl = reply->data[2];
+  uint8_t seq = reply->data[4];
+  uint8_t mask = 1 << (client_id % 8);
+  dserial_msg_t *new_message;
+
+  if(reply->len <= 5 || (ctl & CTL_SYN)){
+    return;
+  }
+  _reply_data = 1;
+  if(!(_rx_valid[client_id / 8] & mask)){
+    if(!(ctl & CTL_OLDEST)){
+      return; // Can't tell whether earlier messages were lost
+    }
+    _rx_next[client_id] = seq;
+    _rx_valid[client_id / 8] |= mask;
+  }
+  if(seq != _rx_next[client_id]){
+    return; // Already have it, or one before it was lost
+  }
+  new_message = (dserial_msg_t *)stringQueueBack(&_in_messages);
+  if(new_message == NULL){
+    return; // No room, it gets resent
+  }
+  // Keep the address, drop ACK, CTL, BSEQ and SEQ
+  new_message->data[0] = client_id;
+  memcpy(new_message->data + 1, reply->data + 5, reply->len - 5);
+  new_message->len = reply->len - 4;
+  stringQueuePush(&_in_messages);
+  if(stringQueueCount(&_in_messages) > _stats.in_high){
+    _stats.in_high = stringQueueCount(&_in_messages);
+  }
+  _rx_next[client_id]++;
+}
+
+/** @brief finishes the current exchange once the last reply is in
+ */
+void DSerialMasterBase::endExchange(){
+  _scheduler->polled(_client_index, (_poll_has_data || _reply_data) ?
+                                    POLL_ACTIVE : POLL_QUIET);
+  if(_attention){
+    _scheduler->wake(_client_index);
+  }
+  _state = MASTER_WAITING;
+}
+
+int DSerialMasterBase::doSerial(){
+  dserial_msg_t buffer;
+  uint8_t nak_msg[2] = {_current_msg.data[0], NAK};
+  dserial_msg_t *next;
+  int index;
+  int next_index;
+
+  // Read stream for input
+  int result = _parser.readPacket(_stream, &buffer);
+  if(result == 1){
+    _baud_stats[_baud_index].packets++;
+    _baud_stats[_baud_index].bytes += buffer.len;
+  } else if(result == -1 && _baud_stats[_baud_index].bad_packets < 0xFFFF){
+    _baud_stats[_baud_index].bad_packets++;
   }
+
   switch(_state){
-    // WAITING state: respond to any requests
-    case CLIENT_WAITING:
-      if(buffer[1] == READ){
-        if(!stringQueueIsEmpty(&_out_messages)){
-          msg_ptr =  stringQueueRemove(&_out_messages);
-          strcpy(current_msg, msg_ptr);
-          free(msg_ptr);
-          _state = CLIENT_SENT;
-        } else {
-          short_msg[1] = ACK;
-          strcpy(current_msg, short_msg);
+    // WAITING state: ignore incoming, send broadcasts, otherwise poll the
+    // client the scheduler picks, carrying a message waiting for that
+    // client if there is one.
+    case MASTER_WAITING:
+      if(checkErrorRate()){
+        break;
+      }
+      if(!_scheduler->grantsProbes()){
+        sendProbe();
+        if(_state != MASTER_WAITING){
+          break;
         }
-        free(buffer);
-      } else if(buffer[1] == WRITE && !stringQueueIsFull(&_in_messages)) {
-        stringQueueAdd(&_in_messages, buffer);
-        short_msg[1] = ACK;
-        strcpy(current_msg, short_msg);
-      } else if(buffer[1] == PING) {
-        short_msg[1] = ACK;
-        strcpy(current_msg, short_msg);
-        free(buffer);
-      } else {
+      }
+      next_index = nextWrite();
+      index = _scheduler->nextClient(next_index);
+      if(index == SCHEDULE_IDLE){
+        if(!_scheduler->grantsProbes()){
+          sendHotplugProbe();
+        }
+        break;
+      } else if(index == SCHEDULE_PROBE){
+        sendProbe();
+        if(_state == MASTER_WAITING && !_probe_nudged){ // A nudge fills it
+          sendHotplugProbe();
+        }
+        break;
+      }
+      if(index == SCHEDULE_WRITE && next_index == SCHEDULE_WRITE){
+        next = (dserial_msg_t *)stringListFront(&_out_pool, &_out_lists[0]);
+        transmit(next->data, next->len); // Nobody ACKs a broadcast
+        stringListPop(&_out_pool, &_out_lists[0]);
+        break;
+      } else if(index == SCHEDULE_WRITE){
+        index = next_index;
+      }
+      if(index < 0 || index >= _num_clients){
+        break;
+      }
+      if(!stringListIsEmpty(&_out_lists[_clients[index]]) ||
+         !stringQueueIsFull(&_in_messages)){
+        sendPoll(index);
+      }
+
+      break;
+
+    // SENT state: waiting for the replies to a poll, deal with timeouts.
+    case MASTER_SENT:
+      if(result == -1 && _window == 1 && !_replied &&
+         !_scheduler->resendsPolls()){
+        // No time for it to be sent again, the client keeps it until the
+        // next poll like any lost reply.
+        countError();
+        _state = MASTER_WAITING;
+        pollFailed();
         return 0;
+      } else if(result == -1 && _window == 1 && !_replied) {
+        // Bad data, ask for the reply again.
+        countError();
+        transmit(nak_msg, sizeof(nak_msg));
+        _stats.naks++;
+        _resent = 1;
+        _timeout = _scheduler->replyTimeout(_client_index,
+                                            retransmitTimeout(_client_index));
+        _last_micros = micros();
+      } else if(result == -1) { // Part of a burst, wait for the rest
+        countError();
+        _resent = 1;
+        _last_micros = micros();
+      } else if(result == 1 && buffer.len >= 4 &&
+                buffer.data[0] == _current_msg.data[0] &&
+                buffer.data[1] == ACK) {
+        if(!_replied){
+          if(!_resent){
+            sampleRtt(_client_index, micros() - _last_micros,
+                      wireTime(_current_msg.len) + wireTime(buffer.len));
+          }
+          handleReply(&buffer);
+          _replied = 1;
+        }
+        acceptReplyData(&buffer);
+        if(buffer.data[2] & CTL_ATTENTION){
+          _attention = 1;
+        }
+        if(buffer.data[2] & CTL_MORE){
+          _last_micros = micros();
+        } else {
+          endExchange();
+        }
+      } else if(micros() - _last_micros > _timeout && _replied) {
+        endExchange(); // The end of the burst was lost
+      } else if(micros() - _last_micros > _timeout) { // Timed out, poll again
+        client_state_t *client = &_client_state[_client_index];
+        if(client->backoff < 8){
+          client->backoff++;
+        }
+        if(_baud_stats[_baud_index].timeouts < 0xFFFF){
+          _baud_stats[_baud_index].timeouts++;
+        }
+        _stats.timeouts++;
+        if(client->fails < SUSPECT_AFTER){ // Not just a client gone quiet
+          countError();
+        }
+        if(!_scheduler->resendsPolls()){ // Wait for the client's next turn
+          _state = MASTER_WAITING;
+          pollFailed();
+          return 0;
+        }
+        if(_num_attempts >= MAX_RETRIES || client->fails >= SUSPECT_AFTER){
+          if(_poll_has_data){
+            // Leave the write at the front of the client's list, it goes
+            // again with a fresh SEQ once the client has synced.
+            client->flags &= ~LINK_SYNCED;
+          }
+          _state = MASTER_WAITING;
+          pollFailed();
+          return 0;
+        }
+        transmit(_current_msg.data, _current_msg.len);
+        _stats.retries++;
+        _num_attempts++;
+        _resent = 1;
+        _timeout = _scheduler->replyTimeout(_client_index,
+                                            retransmitTimeout(_client_index));
+        _last_micros = micros();
       }
-      sendPacket(_stream, current_msg);
 
       break;
 
-    // SENT state: look for and respond to ACK.
-    case CLIENT_SENT:
-      if(buffer[1] == ACK){ // Client ACK'd read request indicating no data
-        _state = CLIENT_WAITING;
-        short_msg[1] = ACK;
-        strcpy(current_msg, short_msg);
-        sendPacket(_stream, current_msg);
+    // PROBE state: waiting for a dropped or unknown client to answer a PING.
+    case MASTER_PROBE:
+      if(result == 1 && buffer.len >= 2 && buffer.data[0] == _probe_target &&
+         buffer.data[1] == ACK){
+        admitClient(_probe_target);
+        _state = MASTER_WAITING;
+      } else if(micros() - _last_micros > _timeout) {
+        _state = MASTER_WAITING;
+      }
+
+      break;
+
+    // SWITCHING state: waiting to change baud rate along with the clients.
+    case MASTER_SWITCHING:
+      if(micros() - _last_micros > _timeout){
+        applyBaud(_baud_pending);
+        // End whatever the clients made of the bus traffic at the old rate
+        _stream.write((uint8_t)0);
+        _state = MASTER_WAITING;
       }
-      free(buffer);
 
       break;
   }
   return 1;
-}
\ No newline at end of file
+}
+
+/** @brief Creates a new DSerialClientBase object
+ * 
+ *  @param port           The underlying stream object used for communication.
+ *  @param client_number  The client's address
+ *  @param in_storage     CLIENT_QUEUE_STORAGE(in_size) bytes for messages
+ *                          from the master
+ *  @param in_size        Number of them, a power of two
+ *  @param out_storage    CLIENT_QUEUE_STORAGE(out_size) bytes for messages
+ *                          to the master
+ *  @param out_size       Number of them, a power of two
+ *  @param rx_storage     RX_RING_STORAGE bytes for receiveByte, or NULL
+
+ *  @return A new initialized DSerialClientBase object
+ */
+DSerialClientBase::DSerialClientBase(Stream &port, uint8_t client_number,
+                                     char *in_storage, uint8_t in_size,
+                                     char *out_storage, uint8_t out_size,
+                                     char *rx_storage)
+                                     :_stream(port), _parser(rx_storage){
+  _flags = 0;
+  _discovery_pending = 0;
+  _bcast_seq = 0;
+  _groups = ALL_GROUPS;
+  _current_msg.len = 0;
+  _tx_base = 0;
+  _tx_sent = 0;
+  _reply_ctl = 0;
+  _reply_window = 0;
+  _set_baud = NULL;
+  _baud_index = SAFE_BAUD_INDEX;
+  _baud_max = SAFE_BAUD_INDEX;
+  _baud_pending = BAUD_NONE;
+  _baud_switch_millis = 0;
+  _heard_millis = 0;
+  memset(&_stats, 0, sizeof(_stats));
+  _client_number = client_number;
+  stringQueueInit(&_in_messages, in_storage, in_size, MSG_SLOT_LEN);
+  stringQueueInit(&_out_messages, out_storage, out_size, MSG_SLOT_LEN);
+}
+
+/** @brief sends data to the master.
+ *
+ *  Internally, this function copies the data into a free queue slot to be
+ *  written when convenient. This function fails when the queue is full or
+ *  when the data is empty or longer than MAX_DATA_LEN.
+ *
+ *  @param data The data to write to the master
+ *  @param len  The number of bytes of data
+ *  @return A status code indicating success or failure
+ */
+int DSerialClientBase::sendData(const void *data, uint8_t len){
+  dserial_msg_t *new_message = (dserial_msg_t *)stringQueueBack(&_out_messages);
+  if(new_message == NULL || len == 0 || len > MAX_DATA_LEN){
+    return 0;
+  }
+  memcpy(new_message->data, data, len);
+  new_message->len = len;
+  stringQueuePush(&_out_messages);
+  if(stringQueueCount(&_out_messages) > _stats.out_high){
+    _stats.out_high = stringQueueCount(&_out_messages);
+  }
+  return 1;
+}
+
+/** @brief sends a null terminated string to the master.
+ *
+ *  @param data The string to write, the null is not sent
+ *  @return A status code indicating success or failure
+ */
+int DSerialClientBase::sendData(char *data){
+  size_t len = strlen(data);
+  if(len > MAX_DATA_LEN){
+    return 0;
+  }
+  return sendData(data, len);
+}
+
+/** @brief sets which broadcast groups this client belongs to
+ *
+ *  @param groups A bitmask of groups, ALL_GROUPS (the default) for all
+ */
+void DSerialClientBase::setGroups(uint8_t groups){
+  _groups = groups;
+}
+
+/** @brief lets the master move this client to a faster baud rate
+ *
+ *  Until this is called the client tells the master it can only run at the
+ *  safe rate.
+ *
+ *  @param set_baud  Called to change the port's rate, see dserial_baud_fn
+ *  @param max_baud  The fastest rate the client's port can run at
+ */
+void DSerialClientBase::setBaudControl(dserial_baud_fn set_baud,
+                                   unsigned long max_baud){
+  _set_baud = set_baud;
+  _baud_max = (set_baud != NULL) ? baudIndex(max_baud) : SAFE_BAUD_INDEX;
+}
+
+/** @brief gives the baud rate the client is at
+ *
+ *  @return The baud rate
+ */
+unsigned long DSerialClientBase::getBaud(){
+  return dserial_baud_rates[_baud_index];
+}
+
+/** @brief gives what the client counted since it started or resetStats
+ *
+ *  See DSerialMaster::getStats. A module can pass them on to the
+ *  controller, see KTANEModule::sendStats.
+ *
+ *  @param stats  Filled in with the counts
+ */
+void DSerialClientBase::getStats(dserial_stats_t *stats){
+  *stats = _stats;
+  _parser.getCounts(stats);
+}
+
+void DSerialClientBase::resetStats(){
+  memset(&_stats, 0, sizeof(_stats));
+  _parser.resetCounts();
+}
+
+/** @brief sends a packet, counting it in the stats
+ *
+ *  @param message  The message, the address first
+ *  @param len      The length of the message
+ */
+void DSerialClientBase::transmit(const uint8_t *message, uint8_t len){
+  if(sendPacket(_stream, message, len)){
+    _stats.frames_out++;
+  }
+}
+
+/** @brief changes the client's baud rate
+ *
+ *  @param index  The index of the new rate in dserial_baud_rates
+ */
+void DSerialClientBase::applyBaud(uint8_t index){
+  _baud_pending = BAUD_NONE;
+  _heard_millis = millis();
+  if(index != _baud_index){
+    _set_baud(dserial_baud_rates[index]);
+    _baud_index = index;
+  }
+}
+
+/** @brief deals with a baud rate query or switch from the master
+ *
+ *  A switch broadcast takes effect BAUD_SWITCH_DELAY_MS after the first
+ *  copy of it, one sent to this client alone straight away. A rate faster
+ *  than the client supports is ignored, the master finds out when it
+ *  verifies the switch.
+ *
+ *  @param msg  The message, {ADDR}{BAUD} or {ADDR}{BAUD}{INDEX}
+ */
+void DSerialClientBase::handleBaud(dserial_msg_t *msg){
+  uint8_t reply[3] = {_client_number, BAUD, _baud_max};
+  uint8_t index;
+
+  if(msg->len == 2 && msg->data[0] == _client_number){
+    transmit(reply, sizeof(reply));
+    return;
+  }
+  index = msg->data[2];
+  if(msg->len != 3 || _set_baud == NULL || index > _baud_max){
+    return;
+  }
+  if(msg->data[0] == _client_number){
+    applyBaud(index);
+  } else if(index != _baud_pending){
+    _baud_pending = index;
+    _baud_switch_millis = millis();
+  }
+}
+
+/** @brief hands the client a byte from the UART receive interrupt
+ *
+ *  Polls are then decoded as they come in, so they are not lost while the
+ *  sketch is busy (they are still answered by doSerial). Once this has been
+ *  called the stream is only used for sending. The client needs the ring for
+ *  it, so it has to be a DSerialClientT with RX_ISR set. For example, with
+ *  NeoICSerial:
+ *
+ *    DSerialClientT<2, 2, true> client(serial_port, MY_ADDRESS);
+ *    static void rxISR(uint8_t c){ client.receiveByte(c); }
+ *    ...
+ *    serial_port.attachInterrupt(rxISR);
+ *
+ *  @param c  The received byte
+ */
+void DSerialClientBase::receiveByte(uint8_t c){
+  _parser.receiveByte(c);
+}
+
+/** @brief Retrieve data if there is any to get
+ *
+ *  At most maxlen bytes are copied, the rest of a longer message is lost.
+ *
+ *  @param buffer A buffer to populate with the possible data
+ *  @param maxlen The size of the buffer
+ *  @return The number of bytes put in the buffer, 0 if no data.
+ */
+int DSerialClientBase::getData(void *buffer, uint8_t maxlen){
+  uint8_t len;
+  dserial_msg_t *message = (dserial_msg_t *)stringQueueFront(&_in_messages);
+  if(message == NULL){
+    return 0;
+  }
+  len = (message->len > maxlen) ? maxlen : message->len;
+  memcpy(buffer, message->data, len);
+  stringQueuePop(&_in_messages);
+  return len;
+}
+
+/** @brief Retrieve data as a null terminated string if there is any to get
+ *
+ *  @param buffer A string of at least MAX_DATA_LEN+1 bytes to populate with
+ *                  the possible data
+ *  @return A status code indicating whether data was retrieved
+ */
+int DSerialClientBase::getData(char *buffer){
+  int len = getData(buffer, MAX_DATA_LEN);
+  if(len == 0){
+    return 0;
+  }
+  buffer[len] = '\0';
+  return 1;
+}
+
+/** @brief Looks at the oldest received message where it is queued
+ *
+ *  See DSerialMaster::peekData.
+ *
+ *  @param len  Set to the number of bytes of data
+ *  @return The data, NULL if there is no message
+ */
+const uint8_t *DSerialClientBase::peekData(uint8_t *len){
+  dserial_msg_t *message = (dserial_msg_t *)stringQueueFront(&_in_messages);
+  if(message == NULL){
+    return NULL;
+  }
+  *len = message->len;
+  return message->data;
+}
+
+/** @brief Drops the oldest received message, the one peekData gave
+ */
+void DSerialClientBase::consumeData(){
+  stringQueuePop(&_in_messages);
+}
+
+/** @brief builds a reply to the master in _current_msg
+ *
+ *  @param ctl   Extra CTL bits to send
+ *  @param data  A queued message to send along, NULL for none
+ *  @param seq   The SEQ of the message
+ */
+void DSerialClientBase::makeReply(uint8_t ctl, dserial_msg_t *data, uint8_t seq){
+  ctl |= CTL_BASE;
+  if(_flags & LINK_RX_SEQ){
+    ctl |= CTL_ACK_SEQ;
+  }
+  if(!(_flags & LINK_SYNCED)){
+    ctl |= CTL_SYN;
+  }
+  _current_msg.data[0] = _client_number;
+  _current_msg.data[1] = ACK;
+  _current_msg.data[2] = ctl;
+  _current_msg.data[3] = _bcast_seq ? _bcast_seq : 0x80; // 0x80 means none
+  _current_msg.len = 4;
+  if(data != NULL){
+    _current_msg.data[4] = seq;
+    memcpy(_current_msg.data + 5, data->data, data->len);
+    _current_msg.len += 1 + data->len;
+  }
+}
+
+/** @brief sends a burst of replies to the master
+ *
+ *  The burst starts at the oldest message not yet acknowledged, and holds
+ *  as many queued messages as the window allows. With nothing to send (or
+ *  before the link has synced) it is a single reply without data.
+ *
+ *  @param ctl     Extra CTL bits to send
+ *  @param window  The most replies to send, 0 for one without data
+ */
+void DSerialClientBase::sendReplies(uint8_t ctl, uint8_t window){
+  uint8_t count = stringQueueCount(&_out_messages);
+  uint8_t n = (count < window) ? count : window;
+  uint8_t extra;
+
+  if(!(_flags & LINK_SYNCED)){
+    n = 0;
+  }
+  if(n == 0){
+    makeReply(ctl, NULL, 0);
+    transmit(_current_msg.data, _current_msg.len);
+    return;
+  }
+  for(uint8_t i = 0; i < n; i++){
+    extra = (i == 0) ? CTL_OLDEST : 0;
+    if(i + 1 < n){
+      extra |= CTL_MORE;
+    }
+    if(count > n){
+      extra |= CTL_ATTENTION;
+    }
+    makeReply(ctl | extra,
+              (dserial_msg_t *)stringQueueAt(&_out_messages, i),
+              _tx_base + i);
+    transmit(_current_msg.data, _current_msg.len);
+  }
+  _stats.retries += (n < _tx_sent) ? n : _tx_sent;
+  if(n > _tx_sent){
+    _tx_sent = n;
+  }
+}
+
+/** @brief queues a write from the master
+ *
+ *  @param payload  The written message, {WRITE}{DATA} or
+ *                    {GROUP_WRITE}{SEQ}{GROUPS}{DATA} for a resent broadcast
+ *  @param len      The length of the payload
+ *  @return 0 if there was no room to queue it, 1 otherwise
+ */
+int DSerialClientBase::acceptWrite(const uint8_t *payload, uint8_t len){
+  dserial_msg_t *new_message;
+
+  if(payload[0] == GROUP_WRITE && len >= 3){
+    return acceptGroupWrite(payload, len);
+  }
+  if(len < 2){ // Nothing written
+    return 1;
+  }
+  new_message = (dserial_msg_t *)stringQueueBack(&_in_messages);
+  if(new_message == NULL){
+    return 0;
+  }
+  memcpy(new_message->data, payload + 1, len - 1);
+  new_message->len = len - 1;
+  stringQueuePush(&_in_messages);
+  if(stringQueueCount(&_in_messages) > _stats.in_high){
+    _stats.in_high = stringQueueCount(&_in_messages);
+  }
+  return 1;
+}
+
+/** @brief queues the data of a broadcast, or of a resent broadcast
+ *
+ *  @param payload  A {GROUP_WRITE}{SEQ}{GROUPS}{DATA} message
+ *  @param len      The length of the payload, at least 3
+ *  @return 0 if there was no room to queue it, 1 otherwise
+ */
+int DSerialClientBase::acceptGroupWrite(const uint8_t *payload, uint8_t len){
+  uint8_t seq = payload[1];
+  dserial_msg_t *new_message;
+
+  if(seq == _bcast_seq){ // Already have this one
+    return 1;
+  }
+  if((payload[2] & _groups) && len > 3){
+    new_message = (dserial_msg_t *)stringQueueBack(&_in_messages);
+    if(new_message == NULL){
+      return 0;
+    }
+    memcpy(new_message->data, payload + 3, len - 3);
+    new_message->len = len - 3;
+    stringQueuePush(&_in_messages);
+    if(stringQueueCount(&_in_messages) > _stats.in_high){
+      _stats.in_high = stringQueueCount(&_in_messages);
+    }
+  }
+  _bcast_seq = seq;
+  return 1;
+}
+
+/** @brief deals with a poll from the master and answers it
+ *
+ *  @param poll The poll, {ADDR}{READ}{CTL}{RACK}{PAYLOAD}
+ */
+void DSerialClientBase::handlePoll(dserial_msg_t *poll){
+  uint8_t ctl = poll->data[2];
+  uint8_t seq = (ctl & CTL_DATA_SEQ) ? LINK_RX_SEQ : 0;
+  uint8_t acked = poll->data[3] - _tx_base;
+  uint8_t reply_ctl = 0;
+
+  if(ctl & CTL_SYN){ // Master (re)started, take its next write as new
+    _flags &= ~LINK_RX_VALID;
+    reply_ctl |= CTL_SYNACK;
+  } else if((ctl & CTL_RACK_VALID) && acked <= _tx_sent){
+    // RACK acknowledges everything before it. It means nothing until the
+    // master has seen our oldest SEQ since either side (re)started, a
+    // stale one could otherwise fall inside what we have sent.
+    for(uint8_t i = 0; i < acked; i++){
+      stringQueuePop(&_out_messages);
+    }
+    _tx_base += acked;
+    _tx_sent -= acked;
+  }
+  if(ctl & CTL_SYNACK){
+    _flags |= LINK_SYNCED;
+  }
+
+  // Master data, resent writes are ACK'd again but not queued twice
+  if(poll->len > 4){
+    if(!(_flags & LINK_RX_VALID) || seq != (_flags & LINK_RX_SEQ)){
+      if(acceptWrite(poll->data + 4, poll->len - 4)){
+        _flags = (_flags & ~LINK_RX_SEQ) | seq | LINK_RX_VALID;
+      } else if(!(_flags & LINK_RX_VALID)){
+        // No room, make sure the reply does not look like an ACK
+        _flags = (_flags & ~LINK_RX_SEQ) | (seq ^ LINK_RX_SEQ);
+      }
+    }
+  }
+
+  _reply_ctl = reply_ctl;
+  _reply_window = ((ctl & CTL_WINDOW) >> CTL_WINDOW_SHIFT) + 1;
+  sendReplies(_reply_ctl, _reply_window);
+}
+
+int DSerialClientBase::doSerial(){
+  dserial_msg_t buffer;
+
+  // Answer a discovery broadcast once our reply slot comes up
+  if(_discovery_pending &&
+     micros() - _discovery_micros >= _discovery_delay){
+    _discovery_pending = 0;
+    sendReplies(0, 0);
+  }
+
+  // Follow a baud rate switch, or go back to the safe rate if the master
+  // can't be heard at this one (it may have restarted)
+  if(_baud_pending != BAUD_NONE &&
+     millis() - _baud_switch_millis >= BAUD_SWITCH_DELAY_MS){
+    applyBaud(_baud_pending);
+  } else if(_baud_index != SAFE_BAUD_INDEX &&
+            millis() - _heard_millis >= BAUD_LISTEN_MS){
+    applyBaud(SAFE_BAUD_INDEX);
+    _stats.timeouts++;
+  }
+
+  // Read stream for input
+  int result = _parser.readPacket(_stream, &buffer);
+  if(result != 1 || buffer.len < 2){ // Nothing useful to act on
+    return 1;
+  }
+  _heard_millis = millis();
+  if(buffer.data[1] == BAUD && (buffer.data[0] == BROADCAST_ADDR ||
+                                buffer.data[0] == _client_number)){
+    handleBaud(&buffer);
+    return 1;
+  }
+  if(buffer.data[0] == BROADCAST_ADDR && buffer.data[1] == PING &&
+     buffer.len == 4){
+    uint8_t first = buffer.data[2];
+    uint8_t last = buffer.data[3];
+    uint8_t slot;
+    if(first <= last && _client_number >= first && _client_number <= last){
+      slot = _client_number - first;
+    } else if(first > last && _client_number <= first &&
+              _client_number >= last){
+      slot = first - _client_number; // Slots given out in reverse
+    } else {
+      return 1;
+    }
+    // Slots count from the end of the PING, not from when the loop got
+    // to it
+    _discovery_pending = 1;
+    _discovery_micros = _parser.frameMicros();
+    _discovery_delay = slot * discoverySlot(dserial_baud_rates[_baud_index]);
+    return 1;
+  }
+  if(buffer.data[0] == BROADCAST_ADDR && buffer.data[1] == GROUP_WRITE &&
+     buffer.len >= 4){
+    // Take broadcasts in order only, a gap gets filled by a resend
+    if(_bcast_seq == 0 || buffer.data[2] == nextSeq(_bcast_seq)){
+      acceptGroupWrite(buffer.data + 1, buffer.len - 1);
+    }
+    return 1;
+  }
+  if(buffer.data[0] != _client_number){
+    return 1;
+  }
+
+  if(buffer.data[1] == NAK){
+    _stats.naks++;
+    sendReplies(_reply_ctl, _reply_window);
+  } else if(buffer.data[1] == READ && buffer.len >= 4){
+    handlePoll(&buffer);
+  } else if(buffer.data[1] == PING){
+    sendReplies(0, 0);
+  } else {
+    return 0;
+  }
+  return 1;
+}
@@ -9,23 +9,35 @@
  *  The library is divided into Master and Client classes. In order for constant
  *  data flow, all communicating parties should call "doSerial" often. Functions
  *  in the DSerial library do not block and all but getClients should be
- *  execute relatively quickly.
+ *  execute relatively quickly. Nothing in the library allocates from the heap,
+ *  all queued messages live in fixed size slots inside the master and client
+ *  objects (see MSG_SLOT_LEN).
  *
- *  Currently, only bytes with values between 1 and 127 inclusive are allowed 
- *  to be sent via this protocol. Bytes above 127 will work, but could cause 
- *  errors if they are reserved bytes (see #define section below) and support
- *  for sending 0's is hopefully coming soon.
+ *  Received bytes are normally read from the stream by doSerial. A sketch
+ *  that can not call doSerial often enough can instead pass every byte from
+ *  its UART receive interrupt to receiveByte, which decodes packets into a
+ *  small lock-free ring for doSerial to pick up.
+ *
+ *  Messages are binary, any byte value (0 included) can be sent. Every
+ *  message carries its length, so nothing has to be scanned for a terminator.
  *
  *  Definitions:
- *    - Packet: Data in the form of {START}{MESSAGE}{PARITY}{END}
+ *    - Packet: The COBS encoding of {MESSAGE}{CRC}, followed by a 0 byte
+ *      - CRC is a CRC-8 of the message bytes (see crc8.h)
+ *      - COBS (Consistent Overhead Byte Stuffing) removes every 0 from the
+ *        encoded bytes, so a 0 on the wire always ends a packet and a
+ *        receiver that lost track picks up again at the next one. It costs
+ *        one byte per 254 (so one for any packet DSerial sends) plus the 0.
  *      - Currently, the first byte of the message is the client address
  *    - Valid addresses for clients are between 1 and MAX_CLIENTS
  *      - MAX_CLIENTS can be at most 126.
+ *      - BROADCAST_ADDR (0x7F) is reserved for packets to every client.
  *
  *  The overall interaction method with this library should be through the 
  *  sendData and getData methods on the master and client objects. Unlike the
- *  notion of a message used internally, these strings do not contain the id
- *  of the intended recipient.
+ *  notion of a message used internally, this data does not contain the id
+ *  of the intended recipient. The versions taking a plain string are kept
+ *  for data that is a null terminated string.
  *
  *  (Internally however, a "message" always contains the destination client id
  *   as the first byte)
@@ -36,23 +48,66 @@
  *  takes longer, but because the whole library is non-blocking it's fine.
  *
  *  Future improvements:
- *    - Switch to all length based binary processing to allow nulls
  *    - Have the client address be broken out into the packet datatype.
  *
  *  Current transaction structure:
- *    Client -> Master:
- *      1 M: {READ}
- *      2 C: {DATA}
- *      3 M: {ACK}
- *      4 C: {ACK}
- *    
- *    Client -> Master (If no data):
- *      1 M: {READ}
- *      2 C: {ACK}
- *    
- *    Master -> Client:
- *      1 M: {WRITE}{DATA}
- *      2 C: {ACK}
+ *    Every exchange is one poll and a burst of replies, data in either
+ *    direction rides along with them:
+ *      1 M: {READ}{CTL}{RACK}{WRITE}{DATA}  (WRITE and DATA only if the
+ *                                              master has something for
+ *                                              the client)
+ *      2 C: {ACK}{CTL}{BSEQ}{SEQ}{DATA}     (SEQ and DATA only if the
+ *                                              client has something for the
+ *                                              master)
+ *      3 C: {ACK}{CTL}{BSEQ}{SEQ}{DATA}     (as many as the poll's window
+ *      ...                                     allows, CTL_MORE set in all
+ *                                              but the last)
+ *
+ *    The master's writes use a stop-and-wait sequence bit in the poll's CTL,
+ *    acknowledged by the CTL of the reply. The client's messages are sent a
+ *    window at a time (go-back-N): each carries a SEQ one higher than the
+ *    last, and RACK in the next poll is the SEQ the master expects next,
+ *    acknowledging every message before it at once. RACK only counts with
+ *    CTL_RACK_VALID set, which the master sets once it has taken a reply
+ *    with CTL_OLDEST since the client last (re)started. The master only takes
+ *    the SEQ it expects, so resent copies are never queued twice, and the
+ *    client sends everything from the oldest unacknowledged message again
+ *    on every poll. Data stays queued until the other side has
+ *    acknowledged it. SYN/SYNACK resync the sequence numbers when either
+ *    side has (re)started.
+ *
+ *    If the only reply allowed is corrupted the master NAKs and the client
+ *    resends it (NAKing a burst could collide with the rest of it), if
+ *    there is no reply the master resends the poll. When the master gives
+ *    up on a poll that carried a write, the write stays queued and goes
+ *    again after a SYN, so a client that got it and only lost the reply
+ *    takes it twice.
+ *
+ *    Broadcast (sent to BROADCAST_ADDR, nobody replies):
+ *      1 M: {GROUP_WRITE}{SEQ}{GROUPS}{DATA}
+ *
+ *    BSEQ in every reply is the last broadcast SEQ the client received (0x80
+ *    if none), which lets the master resend missed ones in a poll, with
+ *    {GROUP_WRITE}{SEQ}{GROUPS}{DATA} in place of {WRITE}{DATA}.
+ *
+ *    Discovery (sent to BROADCAST_ADDR):
+ *      1 M: {PING}{FIRST}{LAST}
+ *      2 C: {ACK}  (each client from FIRST to LAST, |addr - FIRST| reply
+ *                    slots after the end of the PING, LAST may be below
+ *                    FIRST to give the slots out in reverse)
+ *
+ *    Baud rate query and switch (see DSerialMaster::negotiateBaud):
+ *      1 M: {BAUD}                   (to one client)
+ *      2 C: {BAUD}{MAX}              (MAX is the index of the fastest rate
+ *                                      in dserial_baud_rates it can run at)
+ *      1 M: {BAUD}{INDEX}            (to BROADCAST_ADDR, BAUD_SWITCH_REPEATS
+ *                                      times, nobody replies)
+ *
+ *    Everybody moves to the new rate BAUD_SWITCH_DELAY_MS after the switch
+ *    broadcast, and the master PINGs every client at the new rate before
+ *    keeping it. The same {BAUD}{INDEX} sent at the safe rate to a single
+ *    client, or to BROADCAST_ADDR, brings a client that restarted back to
+ *    the bus rate.
  *
  *  @author Dillon Lareau (dlareau)
  */
@@ -60,64 +115,789 @@
 #pragma once
 #include "Arduino.h"
 #include "stringQueue.h"
+#include "stringPool.h"
+#include "crc8.h"
 
 // Control characters
 // All of the form 0x80 + (most appropriate ascii character)
-#define ACK (char)0x86
-#define NAK (char)0x95
-#define START (char)0x82
-#define END (char)0x83
-#define WRITE (char)0xD7
-#define READ (char)0xD2
-#define NO_DATA (char)0xB0
-#define PING (char)0xB1
-#define ESC (char)0x9B
+#define ACK (uint8_t)0x86
+#define NAK (uint8_t)0x95
+#define WRITE (uint8_t)0xD7
+#define READ (uint8_t)0xD2
+#define NO_DATA (uint8_t)0xB0
+#define PING (uint8_t)0xB1
+#define GROUP_WRITE (uint8_t)0xC7
+#define BAUD (uint8_t)0xE2
+
+#define BROADCAST_ADDR (uint8_t)0x7F
+#define ALL_GROUPS 0x7F
 
 #define TIMEOUT 50
-#define MAX_CLIENTS 16
-#define MAX_MSG_LEN 16
-#define MAX_MASTER_QUEUE_SIZE 40
-#define MAX_CLIENT_QUEUE_SIZE 20
+#ifndef MAX_CLIENTS
+#define MAX_CLIENTS 16 // Addresses 1 to MAX_CLIENTS-1, at most 127
+#endif
+#define MAX_MSG_LEN 16 // Address included, CRC not. At most 254.
+#define MAX_MASTER_QUEUE_SIZE 16 // Queue sizes must be powers of two
+#define MAX_CLIENT_QUEUE_SIZE 8
 #define MAX_RETRIES 3
 
+// MAX_CLIENTS and the queue sizes are what DSerialMaster and DSerialClient
+// are built with. DSerialMasterT and DSerialClientT take their own (smaller)
+// sizes instead, so that each sketch only pays for what it needs.
+// MAX_MSG_LEN is part of the protocol and has to be the same everywhere.
+
+// Longest data that can be given to sendData (either side) and to
+// sendBroadcast. A poll has to fit the address, READ, CTL, RACK and WRITE
+// in front of the data, a reply the address, ACK, CTL, BSEQ and SEQ, and a
+// resent broadcast GROUP_WRITE, SEQ and GROUPS in place of WRITE.
+#define MAX_DATA_LEN (MAX_MSG_LEN - 5)
+#define MAX_BROADCAST_LEN (MAX_MSG_LEN - 7)
+
+// Most replies a client sends to one poll, at most 4 and at most
+// MAX_CLIENT_QUEUE_SIZE.
+#define MAX_WINDOW 4
+
+// Most messages the master holds for any one client, so that a client that
+// stopped answering can not take up every slot of the shared pool.
+#define MAX_CLIENT_OUT_MSGS 4
+
+// Poll retransmit timeout, worked out per client from the measured round
+// trip time (Jacobson/Karels): RTO = SRTT + 4 * RTTVAR, kept between
+// RTO_MIN_US and RTO_MAX_US. Until a client has been measured TIMEOUT is
+// used. Each retransmit doubles the timeout, up to RTO_MAX_US. The round
+// trip time leaves out the time packets take to send, which is added back
+// on for each poll.
+#define RTO_MIN_US 2000UL
+#define RTO_MAX_US 100000UL
+
+// Longest a client is left unpolled by DSerialPriorityScheduler, unless the
+// bus is too busy to get to it.
+#define DEFAULT_MAX_POLL_INTERVAL 25
+
+// Values passed to and returned by DSerialScheduler::nextClient
+#define SCHEDULE_IDLE -1   // Nothing to do / nothing waiting to be written
+#define SCHEDULE_WRITE -2  // Send the master's waiting message / a
+                           // broadcast is waiting to be sent
+#define SCHEDULE_PROBE -3  // PING a dropped or unknown address now, see
+                           // DSerialScheduler::grantsProbes
+
+// How a poll went, passed to DSerialScheduler::polled
+#define POLL_QUIET 0       // Answered, nothing moved
+#define POLL_ACTIVE 1      // Answered, data moved in either direction
+#define POLL_FAILED 2      // Never answered
+
+// Time allowed in a TDMA slot for each side to turn the bus around, i.e.
+// for a node to notice a packet and start answering, and for the last
+// reply of a slot to clear the bus.
+#define TDMA_TURNAROUND_US 1000UL
+
+// Discovery reply slot: the ACK (DISCOVERY_ACK_LEN bytes before framing)
+// crossing the bus at the current rate, DISCOVERY_GUARD_BYTES byte times
+// more so that neighbours whose clocks run a little apart do not overlap,
+// and TDMA_TURNAROUND_US for a client's loop to notice its slot came up.
+// Each pass of a discovery gives the slots out in the other order, so two
+// clients that collide in one do not collide again in the next.
+#define DISCOVERY_ACK_LEN 4
+#define DISCOVERY_GUARD_BYTES 4
+#define DISCOVERY_PASSES 3
+
+// Number of recent broadcasts kept around to resend to clients that missed
+// them.
+#define BROADCAST_HISTORY 4
+
+// Every queued message lives inline in a slot of this size, holding a
+// dserial_msg_t.
+#define MSG_SLOT_LEN (MAX_MSG_LEN+1)
+#define MASTER_QUEUE_STORAGE(size) STRING_QUEUE_STORAGE(size, MSG_SLOT_LEN)
+#define MASTER_POOL_STORAGE(size) STRING_POOL_STORAGE(size, MSG_SLOT_LEN)
+#define CLIENT_QUEUE_STORAGE(size) STRING_QUEUE_STORAGE(size, MSG_SLOT_LEN)
+
+// Bytes of a bitmap with one bit per client address
+#define CLIENT_BITMAP_LEN(clients) (((clients) + 7) / 8)
+
+// Packets received from a UART interrupt wait in a ring of this many slots
+// (a power of two) until doSerial gets to them, see receiveByte. Only a
+// parser, master or client that opts in to receiveByte has the ring.
+#define RX_RING_SIZE 4
+#define RX_RING_STORAGE STRING_QUEUE_STORAGE(RX_RING_SIZE, \
+                                             sizeof(dserial_rx_frame_t))
+
 #define MASTER_WAITING 0
 #define MASTER_SENT 1
-#define MASTER_ACK 2
-#define CLIENT_WAITING 0
-#define CLIENT_SENT 1
+#define MASTER_PROBE 2
+#define MASTER_SWITCHING 3
+
+// Client health. A poll that is never answered (after all of its resends)
+// is a failure. After SUSPECT_AFTER failures in a row a client is suspect
+// and its polls are no longer resent, after DEAD_AFTER it is dropped from
+// the client list and no longer polled. Every DEAD_PROBE_INTERVAL ms one
+// dropped client is PINGed, and taken back if it answers.
+#define SUSPECT_AFTER 1
+#define DEAD_AFTER 3
+#define DEAD_PROBE_INTERVAL 1000
+
+// Hot-plug discovery. When the scheduler has nothing due, one address that
+// is not a known client is PINGed every HOTPLUG_INTERVAL ms (see
+// DSerialMaster::setHotplugInterval), with HOTPLUG_TIMEOUT_US for the
+// answer, and taken into the client list if it answers. With a scheduler
+// that grants probes they only go in its SCHEDULE_PROBE slots instead, the
+// dead client probes as well. Away from the safe
+// rate a pass over the addresses starts with a switch broadcast at the safe
+// rate in place of a PING, at most every HOTPLUG_NUDGE_INTERVAL ms, as
+// every client running at the bus rate hears it as noise.
+#define HOTPLUG_INTERVAL 100
+#define HOTPLUG_TIMEOUT_US 10000UL
+#define HOTPLUG_NUDGE_INTERVAL 1000
+
+// Events reported by DSerialMaster::getEvent
+#define EVENT_NONE 0
+#define EVENT_CLIENT_SUSPECT 1   // Stopped answering
+#define EVENT_CLIENT_RECOVERED 2 // Answering again before it was dropped
+#define EVENT_CLIENT_LOST 3      // Dropped from the client list
+#define EVENT_CLIENT_JOINED 4    // Taken (back) into the client list, or
+                                 // found by hot-plug discovery
+#define EVENT_QUEUE_SIZE 8
+
+// Baud rates the bus can run at, slowest first. Every node starts at
+// dserial_baud_rates[SAFE_BAUD_INDEX] (the rate the port was begun at).
+#define NUM_BAUD_RATES 4
+#define SAFE_BAUD_INDEX 0
+#define BAUD_NONE 0xFF
+extern const unsigned long dserial_baud_rates[NUM_BAUD_RATES];
+
+// Baud rate switching. The switch broadcast is sent BAUD_SWITCH_REPEATS
+// times and everybody changes rate BAUD_SWITCH_DELAY_MS after it. A client
+// away from the safe rate that hears no valid packet for BAUD_LISTEN_MS
+// goes back to it. The master steps down a rate when at least
+// BAUD_FALLBACK_ERRORS out of BAUD_SAMPLE_EXCHANGES exchanges saw a bad
+// packet or a timeout.
+#define BAUD_SWITCH_REPEATS 3
+#define BAUD_SWITCH_DELAY_MS 20
+#define BAUD_LISTEN_MS 1000
+#define BAUD_SAMPLE_EXCHANGES 64
+#define BAUD_FALLBACK_ERRORS 8
+
+// Called to change the port's baud rate, e.g. with NeoICSerial:
+//   static void setBaud(unsigned long baud){
+//     serial_port.flushOutput(); // Let what was sent go out first
+//     serial_port.begin(baud);
+//   }
+typedef void (*dserial_baud_fn)(unsigned long baud);
+
+// What the master saw at one baud rate, see DSerialMaster::getBaudStats
+typedef struct {
+  uint32_t millis;      // Time spent at the rate
+  uint32_t bytes;       // Message bytes sent and received
+  uint32_t packets;     // Valid packets received
+  uint16_t bad_packets; // Packets thrown away, corrupt or cut short
+  uint16_t timeouts;    // Polls that went unanswered
+  uint8_t  fallbacks;   // Times the master stepped down from the rate
+} dserial_baud_stats_t;
+
+// What a master or client counted since it started (or resetStats), see
+// getStats. The counters wrap rather than stop, so take differences.
+typedef struct {
+  uint32_t frames_in;   // Valid packets received, whoever they were for
+  uint32_t frames_out;  // Packets sent
+  uint16_t bad_frames;  // Packets thrown away: failed CRC, cut short, too
+                        // long, or lost with the receive ring full
+  uint16_t timeouts;    // Master: polls that went unanswered. Client: times
+                        // it went back to the safe rate not hearing the
+                        // master
+  uint16_t retries;     // Master: polls sent again. Client: replies sent
+                        // again, on a NAK or because they were not ACK'd
+  uint16_t naks;        // Master: NAKs sent. Client: NAKs answered
+  uint8_t  in_high;     // Most messages waiting for getData at once
+  uint8_t  out_high;    // Most messages waiting to be sent at once
+} dserial_stats_t;
+
+// A client's round trip times as the master measured them, in us less the
+// time the poll and reply took to send, see DSerialMaster::getClientRtt
+typedef struct {
+  uint16_t min_us;
+  uint16_t avg_us;      // Smoothed, as the retransmit timeout uses it
+  uint16_t max_us;
+} dserial_rtt_stats_t;
+
+// Bits of the CTL byte in polls and replies. CTL_BASE is always set, it
+// kept the byte clear of null and of the old framing bytes.
+#define CTL_BASE 0x40
+#define CTL_SYN 0x04      // Sender (re)started, resync sequence numbers
+#define CTL_SYNACK 0x08   // Answer to a SYN
+// Polls only
+#define CTL_DATA_SEQ 0x01 // Sequence bit of the write in this poll
+#define CTL_RACK_VALID 0x02 // RACK is meaningful, the master knows the SEQs
+#define CTL_WINDOW 0x30   // Replies the client may send, minus one
+#define CTL_WINDOW_SHIFT 4
+// Replies only
+#define CTL_ACK_SEQ 0x02  // Sequence bit of the last write taken
+#define CTL_MORE 0x10     // Another reply follows in this burst
+#define CTL_ATTENTION 0x20 // Client has more queued, poll it again soon
+#define CTL_OLDEST 0x80   // SEQ is the oldest message not yet acknowledged
+
+// Sequence state kept by each end of a master/client link
+#define LINK_TX_SEQ 0x01    // Sequence bit of the master's next write
+#define LINK_RX_SEQ 0x02    // Sequence bit of the last write taken
+#define LINK_RX_VALID 0x04  // LINK_RX_SEQ is meaningful
+#define LINK_SYNCED 0x08    // The other side answered our SYN
+#define LINK_SYNACK 0x10    // The other side sent a SYN we have to answer
+
+// A message as it is queued and sent, its length and then its bytes, the
+// address first. Nothing in it is null terminated.
+typedef struct {
+  uint8_t len;
+  uint8_t data[MAX_MSG_LEN];
+} dserial_msg_t;
 
-int readPacket(Stream *s, char *buffer);
-int sendPacket(Stream *s, char *message);
+// A packet in the receive ring, with when it finished arriving
+typedef struct {
+  unsigned long micros;
+  dserial_msg_t msg;
+} dserial_rx_frame_t;
+
+typedef struct {
+  uint8_t flags;   // LINK_* bits
+  uint8_t bseq;    // Last broadcast the client is known to have
+  uint8_t backoff; // Times the timeout is doubled until the next sample
+  uint8_t fails;   // Polls in a row that were never answered
+  uint16_t srtt;   // Smoothed round trip time in us (less the time on the
+                   // wire), 0 until measured
+  uint16_t rttvar; // Round trip time variation in us
+  uint16_t rtt_min; // Extremes of the measurements, for getClientRtt
+  uint16_t rtt_max;
+} client_state_t;
+
+class DSerialScheduler;
+
+// Where a DSerialMasterBase keeps everything that is sized by the number
+// of clients or by its queue size, see DSerialMasterT.
+typedef struct {
+  uint8_t max_clients;       // Client addresses are 1 to max_clients-1
+  uint8_t queue_size;
+  uint8_t *clients;          // max_clients entries
+  client_state_t *client_state;
+  uint8_t *rx_next;
+  uint8_t *rx_valid;         // CLIENT_BITMAP_LEN(max_clients) bytes
+  uint8_t *dead;
+  stringList_t *out_lists;   // max_clients entries
+  char    *in_storage;       // MASTER_QUEUE_STORAGE(queue_size) bytes
+  char    *out_storage;      // MASTER_POOL_STORAGE(queue_size) bytes
+  uint8_t *out_links;        // queue_size entries
+  DSerialScheduler *scheduler; // The default, sized by max_clients
+  char    *rx_storage;       // RX_RING_STORAGE bytes, or NULL
+} dserial_master_storage_t;
+
+int sendPacket(Stream &s, const uint8_t *message, uint8_t len);
+
+/** @brief Decides which client DSerialMaster polls next.
+ *
+ *  Clients are referred to by their index in the master's client list,
+ *  begin is called again whenever that list changes.
+ */
+class DSerialScheduler {
+  public:
+    virtual void begin(uint8_t num_clients) = 0;
+    // What the master should do now, given where its waiting message goes
+    // (a client index, SCHEDULE_WRITE for a broadcast or SCHEDULE_IDLE if
+    // there is none). Returns the index of a client to poll, SCHEDULE_WRITE
+    // to send the waiting message, or SCHEDULE_IDLE. A poll of the waiting
+    // message's client carries the message.
+    virtual int nextClient(int write_to) = 0;
+    // A client should be polled as soon as possible
+    virtual void wake(uint8_t index) = 0;
+    // A poll of a client finished, result is one of POLL_*
+    virtual void polled(uint8_t index, uint8_t result) = 0;
+    // How long to wait for a reply, given the client's retransmit timeout
+    virtual unsigned long replyTimeout(uint8_t index, unsigned long rto){
+      return rto;
+    }
+    // Whether an unanswered poll is resent straight away, and a damaged
+    // reply NAKed. If not, the exchange is dropped and anything it carried
+    // stays queued for the client's next poll.
+    virtual uint8_t resendsPolls(){
+      return 1;
+    }
+    // Most replies the client may send to a poll, 1 to MAX_WINDOW
+    virtual uint8_t replyWindow(uint8_t index){
+      return MAX_WINDOW;
+    }
+    // Whether PINGs of dropped and unknown addresses only go out when
+    // nextClient returns SCHEDULE_PROBE. If not, they go whenever it
+    // returns SCHEDULE_IDLE.
+    virtual uint8_t grantsProbes(){
+      return 0;
+    }
+    // How long to wait for the answer to a PING, given the master's own
+    virtual unsigned long probeTimeout(unsigned long timeout){
+      return timeout;
+    }
+};
+
+/** @brief The default scheduler, polls busy clients more often.
+ *
+ *  A client that just moved data is due again straight away, every quiet
+ *  poll doubles the time until it is due again up to max_interval ms. Of the
+ *  clients that are due, the most overdue one goes first. A client that did
+ *  not answer is left for max_interval ms, writes waiting for it do not
+ *  bring that forward.
+ *
+ *  Use DSerialPriorityScheduler or DSerialPrioritySchedulerT, a master
+ *  takes one of its own size as its default.
+ */
+class DSerialPrioritySchedulerBase : public DSerialScheduler {
+  public:
+    void setMaxInterval(uint16_t max_interval);
+    void begin(uint8_t num_clients);
+    int nextClient(int write_to);
+    void wake(uint8_t index);
+    void polled(uint8_t index, uint8_t result);
+
+  protected:
+    DSerialPrioritySchedulerBase(uint8_t max_clients, uint8_t *failing,
+                                 uint16_t *interval, uint16_t *due,
+                                 uint16_t max_interval);
+
+  private:
+    uint8_t   _max_clients;
+    uint8_t   _num_clients;
+    uint8_t   _last;
+    uint8_t  *_failing;      // CLIENT_BITMAP_LEN(max_clients) bytes
+    uint16_t  _max_interval;
+    uint16_t *_interval;     // max_clients entries
+    uint16_t *_due;          // Low 16 bits of millis()
+};
+
+/** @brief Storage for a DSerialPrioritySchedulerT, see DSerialMasterStorage */
+template<uint8_t CLIENTS>
+class DSerialPrioritySchedulerStorage {
+  protected:
+    uint8_t   _failing[CLIENT_BITMAP_LEN(CLIENTS)];
+    uint16_t  _interval[CLIENTS];
+    uint16_t  _due[CLIENTS];
+};
+
+/** @brief A DSerialPrioritySchedulerBase for a master of CLIENTS
+ *  addresses.
+ */
+template<uint8_t CLIENTS>
+class DSerialPrioritySchedulerT :
+    private DSerialPrioritySchedulerStorage<CLIENTS>,
+    public DSerialPrioritySchedulerBase {
+  typedef DSerialPrioritySchedulerStorage<CLIENTS> Storage;
 
-class DSerialMaster {
   public:
-    DSerialMaster(Stream &port);
+    DSerialPrioritySchedulerT(uint16_t max_interval = DEFAULT_MAX_POLL_INTERVAL):
+      DSerialPrioritySchedulerBase(CLIENTS, Storage::_failing,
+                                   Storage::_interval, Storage::_due,
+                                   max_interval){}
+};
+
+typedef DSerialPrioritySchedulerT<MAX_CLIENTS> DSerialPriorityScheduler;
+
+/** @brief A fixed time-slotted cycle, for a bounded worst-case latency.
+ *
+ *  Every cycle has one slot per client followed by write_slots slots for
+ *  the master's own writes and broadcasts. Each client is polled once in
+ *  its slot, whatever happened before, and a lost exchange is not retried
+ *  until the client's slot comes up again. A write slot with nothing to
+ *  write goes to PINGing dropped and unknown addresses, so a bus whose
+ *  write slots are always busy finds no new clients. Nothing is dropped because of
+ *  it: both sides keep the data until the other acknowledges it.
+ *
+ *  Use slotLength to size slots for a baud rate, and worstCaseLatency to
+ *  know how long a client's message can take to reach the master.
+ */
+class DSerialTdmaScheduler : public DSerialScheduler {
+  public:
+    DSerialTdmaScheduler(unsigned long slot_us, uint8_t write_slots = 1);
+    void begin(uint8_t num_clients);
+    int nextClient(int write_to);
+    void wake(uint8_t index);
+    void polled(uint8_t index, uint8_t result);
+    unsigned long replyTimeout(uint8_t index, unsigned long rto);
+    uint8_t resendsPolls();
+    uint8_t replyWindow(uint8_t index);
+    uint8_t grantsProbes();
+    unsigned long probeTimeout(unsigned long timeout);
+    unsigned long cycleLength();
+
+    static unsigned long slotLength(unsigned long baud);
+    static unsigned long worstCaseLatency(uint8_t num_clients,
+                                          uint8_t write_slots,
+                                          unsigned long baud);
+
+  private:
+    unsigned long _slot_us;
+    unsigned long _cycle_us;
+    unsigned long _epoch;  // micros() at the start of the current cycle
+    uint8_t   _write_slots;
+    uint8_t   _num_clients;
+    uint8_t   _served;     // Slot of the current cycle already served
+};
+
+class DSerialParser {
+  public:
+    DSerialParser(char *rx_storage = NULL);
+    int readPacket(Stream &s, dserial_msg_t *msg);
+    unsigned long frameMicros();
+    void receiveByte(uint8_t c);
+    void reset();
+    int sawNoise();
+    void getCounts(dserial_stats_t *stats);
+    void resetCounts();
+
+  private:
+    int decodeByte(uint8_t c, dserial_msg_t *msg);
+    void addByte(uint8_t c);
+
+    uint8_t   _index;
+    uint8_t   _code;         // Bytes left in the current COBS block
+    uint8_t   _pending_zero; // A 0 goes in before the next block
+    uint8_t   _overflow;     // Packet too long, dropped at its end
+    uint8_t   _crc;
+    uint8_t   _noise;
+    unsigned long _frame_micros; // When the last packet read ended
+    uint8_t   _buf[MAX_MSG_LEN + 1]; // Message and CRC
+    uint32_t  _frames;       // Counted by readPacket, valid packets
+    uint16_t  _bad_frames;
+
+    // Packets decoded by receiveByte, a bad one is left in with length 0.
+    // The ring and _rx_lost are only written by receiveByte, apart from
+    // popping the ring. Without RX_RING_STORAGE bytes for it every packet
+    // receiveByte decodes is lost.
+    stringQueue_t _rx_ring;
+    uint8_t   _rx_has_ring;
+    uint8_t   _rx_isr;       // receiveByte is in use, the stream is not
+    uint8_t   _rx_lost;      // Packets dropped with the ring full
+    uint8_t   _rx_lost_seen;
+};
+
+/** @brief Storage for the receiveByte ring of a parser, when RX_ISR is
+ *  set. It is empty otherwise, so it takes no room as a base.
+ */
+template<bool RX_ISR>
+class DSerialRxRing {
+  protected:
+    char *rxStorage(){ return _rx_storage; }
+
+  private:
+    char      _rx_storage[RX_RING_STORAGE];
+};
+
+template<>
+class DSerialRxRing<false> {
+  protected:
+    char *rxStorage(){ return NULL; }
+};
+
+/** @brief A parser with a ring for receiveByte, for listening to a bus
+ *  from an interrupt without a master or client.
+ */
+class DSerialIsrParser : private DSerialRxRing<true>, public DSerialParser {
+  public:
+    DSerialIsrParser():DSerialParser(this->rxStorage()){}
+};
+
+/** @brief The DSerial master, use DSerialMaster or DSerialMasterT.
+ *
+ *  Code that takes a master of any size (like KTANEController) should take
+ *  a DSerialMasterBase.
+ */
+class DSerialMasterBase {
+  public:
+    int sendData(uint8_t client_id, const void *data, uint8_t len);
     int sendData(uint8_t client_id, char *data);
+    uint8_t sendBroadcast(uint8_t groups, const void *data, uint8_t len);
+    uint8_t sendBroadcast(uint8_t groups, char *data);
+    int broadcastDelivered(uint8_t seq);
+    void markBroadcastEpoch();
+    int getData(void *buffer, uint8_t maxlen, uint8_t *len);
     int getData(char *buffer);
+    const uint8_t *peekData(uint8_t *client_id, uint8_t *len);
+    void consumeData();
     int doSerial();
     int identifyClients();
     int getClients(uint8_t *clients);
+    void setScheduler(DSerialScheduler *scheduler);
+    void setHotplugInterval(uint16_t interval);
+    int getEvent(uint8_t *client_id);
+    void receiveByte(uint8_t c);
+    void setBaudControl(dserial_baud_fn set_baud, unsigned long max_baud);
+    unsigned long negotiateBaud();
+    unsigned long getBaud();
+    unsigned long getBaudStats(uint8_t index, dserial_baud_stats_t *stats);
+    void getStats(dserial_stats_t *stats);
+    int getClientRtt(uint8_t client_id, dserial_rtt_stats_t *rtt);
+    void resetStats();
+
+  protected:
+    DSerialMasterBase(Stream &port, const dserial_master_storage_t &storage);
 
   private:
+    void transmit(const uint8_t *message, uint8_t len);
+    int pingClient(uint8_t client_id);
+    int queryBaud(uint8_t client_id);
+    void startBaudSwitch(uint8_t index);
+    void switchBaud(uint8_t index);
+    void applyBaud(uint8_t index);
+    int checkErrorRate();
+    void countError();
+    int discoverRange(uint8_t first, uint8_t last, uint8_t *found);
+    void repairBroadcasts(uint8_t index, uint8_t reported);
+    int clientIndex(uint8_t client_id);
+    void sendPoll(uint8_t index);
+    int nextWrite();
+    void handleReply(dserial_msg_t *reply);
+    void acceptReplyData(dserial_msg_t *reply);
+    void endExchange();
+    void pollFailed();
+    void dropClient(uint8_t index);
+    void admitClient(uint8_t client_id);
+    void addEvent(uint8_t event, uint8_t client_id);
+    void sendProbe();
+    void sendHotplugProbe();
+    void probeAddress(uint8_t client_id, unsigned long timeout);
+    void sendBaudNudge(uint8_t addr);
+    void sampleRtt(uint8_t index, unsigned long rtt, unsigned long wire);
+    unsigned long wireTime(uint8_t len);
+    unsigned long retransmitTimeout(uint8_t index);
+
     Stream   &_stream;
+    DSerialParser _parser;
     uint8_t   _state;
+    uint8_t   _max_clients;
+    uint8_t   _queue_size;
     stringQueue_t _in_messages;
-    stringQueue_t _out_messages;
     uint8_t   _num_clients;
-    uint8_t   _clients[MAX_CLIENTS];
+    uint8_t  *_clients;
+    client_state_t *_client_state;
+
+    // SEQ expected next from each client address, kept while a client is
+    // dropped so nothing it resends on coming back is taken twice.
+    uint8_t  *_rx_next;
+    uint8_t  *_rx_valid;
+    DSerialScheduler *_default_scheduler;
+    DSerialScheduler *_scheduler;
+
+    // Outgoing messages, one list per client address sharing one pool of
+    // slots. List 0 (not a client address) holds broadcasts.
+    stringPool_t _out_pool;
+    stringList_t *_out_lists;
+    uint8_t   _write_index;
+
+    // Dropped clients, and the events about them
+    uint8_t  *_dead;
+    uint8_t   _probe_addr;
+    unsigned long _probe_millis;
+    uint8_t   _probe_target; // Address PINGed in the MASTER_PROBE state
+    uint8_t   _probe_nudged; // _probe_addr was nudged, its PING is next
+    uint8_t   _events[EVENT_QUEUE_SIZE][2];
+    uint8_t   _event_head;
+    uint8_t   _event_count;
+
+    // Hot-plug discovery of addresses that are not clients
+    uint16_t  _hotplug_interval;
+    uint8_t   _hotplug_addr;
+    unsigned long _hotplug_millis;
+    unsigned long _nudge_millis; // Last hot-plug pass begun with a nudge
+
+    // Current transaction
+    unsigned long _last_micros;
+    unsigned long _timeout;
+    uint8_t   _num_attempts;
+    uint8_t   _resent;
+    uint8_t   _client_index;
+    uint8_t   _poll_has_data;
+    uint8_t   _window;
+    uint8_t   _replied;     // A reply of the current burst has come in
+    uint8_t   _reply_data;  // One of them carried data
+    uint8_t   _attention;
+    uint8_t   _exchange_error; // Saw a bad packet or a timeout
+    dserial_msg_t _current_msg;
+
+    // Baud rate
+    dserial_baud_fn _set_baud;
+    uint8_t   _baud_index;
+    uint8_t   _baud_max;      // Fastest rate the master will switch to
+    uint8_t   _baud_pending;  // Rate being switched to
+    uint8_t   _sample_exchanges;
+    uint8_t   _sample_errors;
+    unsigned long _baud_millis; // millis() when the current rate started
+    dserial_baud_stats_t _baud_stats[NUM_BAUD_RATES];
+
+    dserial_stats_t _stats;  // frames_in and bad_frames are in _parser
+
+    // Broadcasts
+    uint8_t   _bcast_seq;
+    uint8_t   _bcast_epoch;
+    uint8_t   _bcast_count;
+    uint8_t   _bcast_head;
+    dserial_msg_t _bcast_history[BROADCAST_HISTORY];
 };
 
-class DSerialClient {
+/** @brief Storage for a DSerialMasterT, a base of its own so that it is
+ *  there before DSerialMasterBase is constructed.
+ */
+template<uint8_t CLIENTS, uint8_t QUEUE_SIZE, bool RX_ISR>
+class DSerialMasterStorage : private DSerialRxRing<RX_ISR> {
+  protected:
+    dserial_master_storage_t storage(){
+      dserial_master_storage_t s = {CLIENTS, QUEUE_SIZE, _clients,
+                                    _client_state, _rx_next, _rx_valid,
+                                    _dead, _out_lists, _in_storage,
+                                    _out_storage, _out_links,
+                                    &_default_scheduler, this->rxStorage()};
+      return s;
+    }
+
+  private:
+    uint8_t   _clients[CLIENTS];
+    client_state_t _client_state[CLIENTS];
+    uint8_t   _rx_next[CLIENTS];
+    uint8_t   _rx_valid[CLIENT_BITMAP_LEN(CLIENTS)];
+    uint8_t   _dead[CLIENT_BITMAP_LEN(CLIENTS)];
+    stringList_t _out_lists[CLIENTS];
+    char      _in_storage[MASTER_QUEUE_STORAGE(QUEUE_SIZE)];
+    char      _out_storage[MASTER_POOL_STORAGE(QUEUE_SIZE)];
+    uint8_t   _out_links[QUEUE_SIZE];
+    DSerialPrioritySchedulerT<CLIENTS> _default_scheduler;
+};
+
+/** @brief A DSerial master with its own number of clients and queue size.
+ *
+ *  Client addresses go from 1 to CLIENTS-1, CLIENTS can be at most
+ *  MAX_CLIENTS. QUEUE_SIZE is both the number of received messages held
+ *  for getData and the number of slots shared by everything waiting to be
+ *  sent. RX_ISR adds the ring receiveByte needs, only set it if the sketch
+ *  calls receiveByte. Everything lives inside the object, e.g. a master for
+ *  8 addresses:
+ *
+ *    DSerialMasterT<8, 8> master(serial_port);
+ */
+template<uint8_t CLIENTS, uint8_t QUEUE_SIZE, bool RX_ISR = false>
+class DSerialMasterT :
+    private DSerialMasterStorage<CLIENTS, QUEUE_SIZE, RX_ISR>,
+    public DSerialMasterBase {
+  static_assert(CLIENTS >= 2 && CLIENTS <= MAX_CLIENTS,
+                "CLIENTS must be between 2 and MAX_CLIENTS");
+  static_assert(QUEUE_SIZE > 0 && QUEUE_SIZE <= 128 &&
+                (QUEUE_SIZE & (QUEUE_SIZE - 1)) == 0,
+                "QUEUE_SIZE must be a power of two, at most 128");
+
   public:
-    DSerialClient(Stream &port, uint8_t client_number);
+    DSerialMasterT(Stream &port):DSerialMasterBase(port, this->storage()){}
+};
+
+typedef DSerialMasterT<MAX_CLIENTS, MAX_MASTER_QUEUE_SIZE> DSerialMaster;
+
+/** @brief The DSerial client, use DSerialClient or DSerialClientT.
+ *
+ *  Code that takes a client of any size (like KTANEModule) should take a
+ *  DSerialClientBase.
+ */
+class DSerialClientBase {
+  public:
+    int sendData(const void *data, uint8_t len);
     int sendData(char *data);
+    int getData(void *buffer, uint8_t maxlen);
     int getData(char *buffer);
+    const uint8_t *peekData(uint8_t *len);
+    void consumeData();
     int doSerial();
+    void setGroups(uint8_t groups);
+    void receiveByte(uint8_t c);
+    void setBaudControl(dserial_baud_fn set_baud, unsigned long max_baud);
+    unsigned long getBaud();
+    void getStats(dserial_stats_t *stats);
+    void resetStats();
+
+  protected:
+    DSerialClientBase(Stream &port, uint8_t client_number,
+                      char *in_storage, uint8_t in_size,
+                      char *out_storage, uint8_t out_size,
+                      char *rx_storage);
 
   private:
+    void applyBaud(uint8_t index);
+    void handleBaud(dserial_msg_t *msg);
+    void makeReply(uint8_t ctl, dserial_msg_t *data, uint8_t seq);
+    void sendReplies(uint8_t ctl, uint8_t window);
+    int acceptWrite(const uint8_t *payload, uint8_t len);
+    int acceptGroupWrite(const uint8_t *payload, uint8_t len);
+    void handlePoll(dserial_msg_t *poll);
+    void transmit(const uint8_t *message, uint8_t len);
+
     Stream   &_stream;
-    uint8_t   _state;
+    DSerialParser _parser;
+    uint8_t   _flags;
     stringQueue_t _in_messages;
     stringQueue_t _out_messages;
     uint8_t   _client_number;
+    dserial_msg_t _current_msg;
+
+    // Messages to the master, the oldest one in _out_messages is _tx_base
+    uint8_t   _tx_base;
+    uint8_t   _tx_sent;      // Sent at least once, from the oldest on
+    uint8_t   _reply_ctl;    // Extra CTL bits of the last burst, for a NAK
+    uint8_t   _reply_window;
+
+    // Pending reply to a discovery broadcast
+    uint8_t   _discovery_pending;
+    unsigned long _discovery_micros;
+    unsigned long _discovery_delay;
+
+    // Baud rate
+    dserial_baud_fn _set_baud;
+    uint8_t   _baud_index;
+    uint8_t   _baud_max;
+    uint8_t   _baud_pending;  // Rate to switch to once the delay is up
+    unsigned long _baud_switch_millis;
+    unsigned long _heard_millis; // millis() of the last valid packet
+
+    dserial_stats_t _stats;  // frames_in and bad_frames are in _parser
+
+    // Broadcasts
+    uint8_t   _bcast_seq;
+    uint8_t   _groups;
+};
+
+/** @brief Storage for a DSerialClientT, see DSerialMasterStorage */
+template<uint8_t IN_SIZE, uint8_t OUT_SIZE, bool RX_ISR>
+class DSerialClientStorage : protected DSerialRxRing<RX_ISR> {
+  protected:
+    char      _in_storage[CLIENT_QUEUE_STORAGE(IN_SIZE)];
+    char      _out_storage[CLIENT_QUEUE_STORAGE(OUT_SIZE)];
 };
+
+/** @brief A DSerial client with its own queue sizes.
+ *
+ *  IN_SIZE messages from the master can wait for getData, and OUT_SIZE
+ *  messages given to sendData can wait to be sent. A module that only
+ *  ever gets its config and a strike count, and sends a few messages of
+ *  its own, gets by with:
+ *
+ *    DSerialClientT<2> client(serial_port, MY_ADDRESS);
+ *
+ *  RX_ISR adds the ring receiveByte needs, only set it if the sketch calls
+ *  receiveByte.
+ */
+template<uint8_t IN_SIZE, uint8_t OUT_SIZE = IN_SIZE, bool RX_ISR = false>
+class DSerialClientT :
+    private DSerialClientStorage<IN_SIZE, OUT_SIZE, RX_ISR>,
+    public DSerialClientBase {
+  static_assert(IN_SIZE > 0 && IN_SIZE <= 128 &&
+                (IN_SIZE & (IN_SIZE - 1)) == 0,
+                "IN_SIZE must be a power of two, at most 128");
+  static_assert(OUT_SIZE > 0 && OUT_SIZE <= 128 &&
+                (OUT_SIZE & (OUT_SIZE - 1)) == 0,
+                "OUT_SIZE must be a power of two, at most 128");
+
+  public:
+    DSerialClientT(Stream &port, uint8_t client_number):
+      DSerialClientBase(port, client_number,
+                        this->_in_storage, IN_SIZE,
+                        this->_out_storage, OUT_SIZE,
+                        this->rxStorage()){}
+};
+
+typedef DSerialClientT<MAX_CLIENT_QUEUE_SIZE> DSerialClient;
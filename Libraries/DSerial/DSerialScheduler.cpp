@@ -0,0 +1,284 @@
+/** @file DSerialScheduler.cpp
+ *  @brief Poll schedulers for the DSerial master
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#include "DSerial.h"
+
+/** @brief Creates a new DSerialPrioritySchedulerBase object
+ *
+ *  @param max_clients   Number of entries in interval and due
+ *  @param failing       CLIENT_BITMAP_LEN(max_clients) bytes
+ *  @param interval      Each client's time between polls
+ *  @param due           When each client is due next
+ *  @param max_interval  Longest a quiet client goes between polls, in ms
+ *  @return A new initialized DSerialPrioritySchedulerBase object
+ */
+DSerialPrioritySchedulerBase::DSerialPrioritySchedulerBase(
+    uint8_t max_clients, uint8_t *failing, uint16_t *interval, uint16_t *due,
+    uint16_t max_interval){
+  _max_clients = max_clients;
+  _failing = failing;
+  _interval = interval;
+  _due = due;
+  begin(0);
+  setMaxInterval(max_interval);
+}
+
+/** @brief sets the longest a quiet client goes between polls
+ *
+ *  @param max_interval  The interval in ms, at most 32767
+ */
+void DSerialPrioritySchedulerBase::setMaxInterval(uint16_t max_interval){
+  if(max_interval > 0x7FFF){
+    max_interval = 0x7FFF;
+  }
+  _max_interval = max_interval;
+  for(int i = 0; i < _num_clients; i++){
+    if(_interval[i] > _max_interval){
+      _interval[i] = _max_interval;
+    }
+  }
+}
+
+/** @brief starts over with a new set of clients, all of them due now
+ *
+ *  @param num_clients  The number of clients the master knows about
+ */
+void DSerialPrioritySchedulerBase::begin(uint8_t num_clients){
+  uint16_t now = millis();
+  if(num_clients > _max_clients){
+    num_clients = _max_clients;
+  }
+  _num_clients = num_clients;
+  _last = 0;
+  memset(_failing, 0, CLIENT_BITMAP_LEN(_max_clients));
+  for(int i = 0; i < _max_clients; i++){
+    _interval[i] = 0;
+    _due[i] = now;
+  }
+}
+
+/** @brief picks the most overdue client
+ *
+ *  Broadcasts go out straight away, and a client with a write waiting is
+ *  made due now. Ties go to the first client after the last one polled, so
+ *  clients that are all due get polled round-robin.
+ *
+ *  @param write_to  Where the master's waiting message goes
+ *  @return The index of the client to poll, SCHEDULE_WRITE for a broadcast,
+ *            SCHEDULE_IDLE if no client is due yet
+ */
+int DSerialPrioritySchedulerBase::nextClient(int write_to){
+  uint16_t now = millis();
+  int best = SCHEDULE_IDLE;
+  int16_t best_late = -1;
+  int16_t late;
+  uint8_t index;
+
+  if(write_to == SCHEDULE_WRITE){
+    return SCHEDULE_WRITE;
+  } else if(write_to >= 0 && !(_failing[write_to / 8] & (1 << (write_to % 8)))){
+    wake(write_to);
+  }
+
+  for(int i = 1; i <= _num_clients; i++){
+    index = (_last + i) % _num_clients;
+    late = (int16_t)(now - _due[index]);
+    if(late > best_late){
+      best = index;
+      best_late = late;
+    }
+  }
+  return best;
+}
+
+/** @brief makes a client due now
+ *
+ *  @param index  The index of the client
+ */
+void DSerialPrioritySchedulerBase::wake(uint8_t index){
+  uint16_t now = millis();
+  if(index >= _num_clients){
+    return;
+  }
+  _interval[index] = 0;
+  if((int16_t)(now - _due[index]) < 0){
+    _due[index] = now;
+  }
+}
+
+/** @brief works out when a client is due again after a poll
+ *
+ *  @param index   The index of the client
+ *  @param result  How the poll went, one of POLL_*
+ */
+void DSerialPrioritySchedulerBase::polled(uint8_t index, uint8_t result){
+  if(index >= _num_clients){
+    return;
+  }
+  _last = index;
+  if(result == POLL_FAILED){
+    _failing[index / 8] |= 1 << (index % 8);
+    _interval[index] = _max_interval;
+  } else if(result == POLL_ACTIVE){
+    _failing[index / 8] &= ~(1 << (index % 8));
+    _interval[index] = 0;
+  } else {
+    _failing[index / 8] &= ~(1 << (index % 8));
+    _interval[index] = _interval[index] * 2 + 1;
+    if(_interval[index] > _max_interval){
+      _interval[index] = _max_interval;
+    }
+  }
+  _due[index] = (uint16_t)millis() + _interval[index];
+}
+
+/** @brief Creates a new DSerialTdmaScheduler object
+ *
+ *  @param slot_us      Length of every slot in us, see slotLength
+ *  @param write_slots  Number of slots per cycle for the master's writes
+ *  @return A new initialized DSerialTdmaScheduler object
+ */
+DSerialTdmaScheduler::DSerialTdmaScheduler(unsigned long slot_us,
+                                           uint8_t write_slots){
+  _slot_us = slot_us;
+  _write_slots = write_slots;
+  begin(0);
+}
+
+/** @brief starts a new cycle with a new set of clients
+ *
+ *  @param num_clients  The number of clients the master knows about
+ */
+void DSerialTdmaScheduler::begin(uint8_t num_clients){
+  _num_clients = num_clients;
+  _cycle_us = _slot_us * (num_clients + _write_slots);
+  _epoch = micros();
+  _served = 0xFF;
+}
+
+/** @brief serves the slot the cycle is currently in, once
+ *
+ *  @param write_to  Where the master's waiting message goes
+ *  @return The index of the client whose slot it is, SCHEDULE_WRITE in a
+ *            write slot with a message waiting, SCHEDULE_PROBE in one
+ *            without, SCHEDULE_IDLE once the slot has been served
+ */
+int DSerialTdmaScheduler::nextClient(int write_to){
+  unsigned long elapsed = micros() - _epoch;
+  uint8_t slot;
+
+  if(_cycle_us == 0){
+    return SCHEDULE_IDLE;
+  }
+  if(elapsed >= _cycle_us){ // Start of a new cycle, maybe missed a few
+    _epoch += (elapsed / _cycle_us) * _cycle_us;
+    elapsed %= _cycle_us;
+    _served = 0xFF;
+  }
+  slot = elapsed / _slot_us;
+  if(slot == _served){
+    return SCHEDULE_IDLE;
+  }
+  _served = slot;
+  if(slot < _num_clients){
+    return slot;
+  }
+  return (write_to == SCHEDULE_IDLE) ? SCHEDULE_PROBE : SCHEDULE_WRITE;
+}
+
+/** @brief does nothing, a client can not get polled outside of its slot */
+void DSerialTdmaScheduler::wake(uint8_t index){
+}
+
+/** @brief does nothing, every client gets the same slot every cycle */
+void DSerialTdmaScheduler::polled(uint8_t index, uint8_t result){
+}
+
+/** @brief keeps the wait for a reply inside of the current slot
+ *
+ *  @param index  The index of the client
+ *  @param rto    The client's retransmit timeout in us
+ *  @return The timeout in us
+ */
+unsigned long DSerialTdmaScheduler::replyTimeout(uint8_t index,
+                                                 unsigned long rto){
+  long left = (long)(_epoch + (_served + 1) * _slot_us - micros());
+  if(left <= 0){
+    return 0;
+  }
+  return ((unsigned long)left < rto) ? left : rto;
+}
+
+/** @brief PINGs only go in a write slot, not in whatever is left of a slot
+ *    once it has been served
+ */
+uint8_t DSerialTdmaScheduler::grantsProbes(){
+  return 1;
+}
+
+/** @brief keeps the wait for the answer to a PING inside of the current slot
+ *
+ *  @param timeout  How long the master would wait in us
+ *  @return The timeout in us
+ */
+unsigned long DSerialTdmaScheduler::probeTimeout(unsigned long timeout){
+  return replyTimeout(_served, timeout);
+}
+
+/** @brief lost polls are retried in the client's next slot */
+uint8_t DSerialTdmaScheduler::resendsPolls(){
+  return 0;
+}
+
+/** @brief one reply per poll, so that every exchange fits in its slot */
+uint8_t DSerialTdmaScheduler::replyWindow(uint8_t index){
+  return 1;
+}
+
+/** @brief gives the length of a whole cycle
+ *
+ *  @return The cycle length in us, 0 until the clients are known
+ */
+unsigned long DSerialTdmaScheduler::cycleLength(){
+  return _cycle_us;
+}
+
+/** @brief works out a slot length that fits any exchange at a baud rate
+ *
+ *  A slot holds the longest poll and the longest reply (a COBS code byte,
+ *  MAX_MSG_LEN message bytes, the CRC and the closing 0), at 10 bits per
+ *  byte, and a turnaround for each. That is more than a {BAUD}{INDEX} sent
+ *  at the safe rate takes at any of dserial_baud_rates, so a probe slot
+ *  also fits one.
+ *
+ *  @param baud  The bus baud rate
+ *  @return The slot length in us
+ */
+unsigned long DSerialTdmaScheduler::slotLength(unsigned long baud){
+  unsigned long packet_bytes = MAX_MSG_LEN + 3;
+  return (2 * packet_bytes * 10 * 1000000UL + baud - 1) / baud +
+         2 * TDMA_TURNAROUND_US;
+}
+
+/** @brief works out the longest a client's message takes to reach the master
+ *
+ *  This is for a message at the front of the client's queue, with slots of
+ *  slotLength(baud): in the worst case it is queued just as the client's
+ *  slot starts, and goes out at the end of its slot in the next cycle. Add
+ *  a cycle for every message queued ahead of it and for every lost
+ *  exchange.
+ *
+ *  @param num_clients  The number of clients on the bus
+ *  @param write_slots  Number of slots per cycle for the master's writes
+ *  @param baud         The bus baud rate
+ *  @return The worst-case latency in us
+ */
+unsigned long DSerialTdmaScheduler::worstCaseLatency(uint8_t num_clients,
+                                                     uint8_t write_slots,
+                                                     unsigned long baud){
+  unsigned long slot = slotLength(baud);
+  return slot * (num_clients + write_slots) + slot;
+}
@@ -0,0 +1,18 @@
+#include "crc8.h"
+
+#define CRC8_ROW4(i) crc8Entry(i), crc8Entry(i + 1), crc8Entry(i + 2), crc8Entry(i + 3)
+#define CRC8_ROW16(i) CRC8_ROW4(i), CRC8_ROW4(i + 4), CRC8_ROW4(i + 8), CRC8_ROW4(i + 12)
+#define CRC8_ROW64(i) CRC8_ROW16(i), CRC8_ROW16(i + 16), CRC8_ROW16(i + 32), CRC8_ROW16(i + 48)
+
+const uint8_t crc8_table[256] PROGMEM = {
+	CRC8_ROW64(0), CRC8_ROW64(64), CRC8_ROW64(128), CRC8_ROW64(192)
+};
+
+/** @brief Works out the CRC of a whole block of data. */
+uint8_t crc8(const uint8_t *data, uint8_t len) {
+	uint8_t crc = CRC8_INIT;
+	for(uint8_t i = 0; i < len; i++) {
+		crc = crc8Update(crc, data[i]);
+	}
+	return crc;
+}
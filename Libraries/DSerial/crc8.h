@@ -0,0 +1,39 @@
+/** @file crc8.h
+ *  @brief A table driven CRC-8 for checking DSerial packets.
+ *
+ *  The polynomial is 0x2F (as used by AUTOSAR), which catches every burst of
+ *  up to 8 bits and every error of up to 3 flipped bits in messages of up to
+ *  14 bytes. In the 15 and 16 byte ones two flips exactly 127 bits apart
+ *  cancel out, no 8 bit CRC does better at that length. host/crccheck.cpp
+ *  measures what it misses. The 256 byte lookup table is worked out by the
+ *  compiler and lives in flash.
+ *
+ *  The CRC is not reflected and has no final XOR, so running it over a
+ *  message followed by that message's CRC always gives 0. A receiver can
+ *  therefore update it byte by byte as they arrive without knowing where the
+ *  message ends, and check for 0 once it does.
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+#pragma once
+#include "Arduino.h"
+
+#define CRC8_POLY 0x2F
+#define CRC8_INIT 0xFF
+
+// One bit of a bitwise CRC, and the eight of them that make a table entry.
+constexpr uint8_t crc8Bit(uint8_t crc) {
+	return (crc & 0x80) ? (uint8_t)((crc << 1) ^ CRC8_POLY) : (uint8_t)(crc << 1);
+}
+
+constexpr uint8_t crc8Entry(uint8_t b) {
+	return crc8Bit(crc8Bit(crc8Bit(crc8Bit(crc8Bit(crc8Bit(crc8Bit(crc8Bit(b))))))));
+}
+
+extern const uint8_t crc8_table[256] PROGMEM;
+
+static inline uint8_t crc8Update(uint8_t crc, uint8_t data) {
+	return pgm_read_byte(&crc8_table[crc ^ data]);
+}
+
+uint8_t crc8(const uint8_t *data, uint8_t len);
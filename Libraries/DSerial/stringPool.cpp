@@ -0,0 +1,96 @@
+#include "stringPool.h"
+
+static char *slot(stringPool_t *p, uint8_t index) {
+	return p->data + (uint16_t)index * p->slot_len;
+}
+
+int stringPoolInit(stringPool_t *p, char *storage, uint8_t *links, uint8_t size, uint8_t slot_len) {
+	if(storage == NULL || links == NULL || slot_len == 0 || size >= STRING_POOL_NONE) {
+		return 0;
+	}
+	p->data = storage;
+	p->next = links;
+	p->slot_len = slot_len;
+	p->size = size;
+	// Every slot starts out on the free list
+	for(uint8_t i = 0; i < size; i++) {
+		p->next[i] = i + 1;
+	}
+	if(size > 0) {
+		p->next[size - 1] = STRING_POOL_NONE;
+	}
+	p->free = size > 0 ? 0 : STRING_POOL_NONE;
+	p->used = 0;
+	return 1;
+}
+
+int stringPoolIsFull(stringPool_t *p) {
+	return p->free == STRING_POOL_NONE;
+}
+
+/** @brief Returns how many slots are on a list, out of all of the lists. */
+uint8_t stringPoolCount(stringPool_t *p) {
+	return p->used;
+}
+
+void stringListInit(stringList_t *l) {
+	l->head = STRING_POOL_NONE;
+	l->tail = STRING_POOL_NONE;
+	l->count = 0;
+}
+
+/** @brief Returns the slot holding the oldest string of a list, NULL if empty. */
+char *stringListFront(stringPool_t *p, stringList_t *l) {
+	if(stringListIsEmpty(l)) {
+		return NULL;
+	}
+	return slot(p, l->head);
+}
+
+/** @brief Returns a free slot to be filled in place, NULL if the pool is full.
+ *
+ *  The slot only becomes part of the list once stringListPush is called.
+ */
+char *stringListBack(stringPool_t *p, stringList_t *l) {
+	if(stringPoolIsFull(p)) {
+		return NULL;
+	}
+	return slot(p, p->free);
+}
+
+void stringListPush(stringPool_t *p, stringList_t *l) {
+	uint8_t index = p->free;
+	if(index == STRING_POOL_NONE) {
+		return;
+	}
+	p->free = p->next[index];
+	p->next[index] = STRING_POOL_NONE;
+	if(l->tail == STRING_POOL_NONE) {
+		l->head = index;
+	} else {
+		p->next[l->tail] = index;
+	}
+	l->tail = index;
+	l->count++;
+	p->used++;
+}
+
+/** @brief Removes the oldest string of a list, its slot goes back to the pool. */
+void stringListPop(stringPool_t *p, stringList_t *l) {
+	uint8_t index = l->head;
+	if(index == STRING_POOL_NONE) {
+		return;
+	}
+	l->head = p->next[index];
+	if(l->head == STRING_POOL_NONE) {
+		l->tail = STRING_POOL_NONE;
+	}
+	l->count--;
+	p->used--;
+	p->next[index] = p->free;
+	p->free = index;
+}
+
+int stringListIsEmpty(stringList_t *l) {
+	return l->head == STRING_POOL_NONE;
+}
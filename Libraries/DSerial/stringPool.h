@@ -0,0 +1,44 @@
+/** @file stringPool.h
+ *  @brief Headers and definitions for FIFO lists of strings sharing a pool.
+ *
+ *  Like stringQueue, but any number of lists draw their slots from one
+ *  shared pool, so a list only takes up room while it holds something. The
+ *  pool never allocates, its slots and their links live in blocks of storage
+ *  owned by the caller. Use STRING_POOL_STORAGE to size the slot storage,
+ *  the links need one byte per slot.
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+#pragma once
+#include "Arduino.h"
+
+// Bytes of storage needed for a pool of "size" slots of "slot_len" bytes.
+#define STRING_POOL_STORAGE(size, slot_len) ((size) * (slot_len))
+
+// End of a list of slots
+#define STRING_POOL_NONE 0xFF
+
+typedef struct {
+	char *data;
+	uint8_t *next;
+	uint8_t slot_len;
+	uint8_t size;
+	uint8_t free;
+	uint8_t used;
+} stringPool_t;
+
+typedef struct {
+	uint8_t head;
+	uint8_t tail;
+	uint8_t count;
+} stringList_t;
+
+int stringPoolInit(stringPool_t *p, char *storage, uint8_t *links, uint8_t size, uint8_t slot_len);
+int stringPoolIsFull(stringPool_t *p);
+uint8_t stringPoolCount(stringPool_t *p);
+void stringListInit(stringList_t *l);
+char *stringListFront(stringPool_t *p, stringList_t *l);
+char *stringListBack(stringPool_t *p, stringList_t *l);
+void stringListPush(stringPool_t *p, stringList_t *l);
+void stringListPop(stringPool_t *p, stringList_t *l);
+int stringListIsEmpty(stringList_t *l);
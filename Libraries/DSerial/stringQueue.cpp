@@ -1,71 +1,133 @@
 #include "stringQueue.h"
 
-int stringQueueInit(stringQueue_t *q, uint8_t size) {
-	size = size + 1; // leave room for buffer NULL item
-	void *ptr = malloc(size * sizeof(char*));
-	if(ptr) {
-		q->data = (char **)ptr;
-		q->size = size;
-		q->head = 0;
-		q->tail = 0;
-		for (int i = 0; i < q->size; ++i) {
-			q->data[i] = NULL;
-		}
-		return 1;
+// The index written by the other side is read with acquire and our own is
+// published with release, so the slot is always filled before it is pushed
+// and emptied before it is popped. Single bytes, so this is just a compiler
+// barrier on AVR.
+#define LOAD_INDEX(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE_INDEX(x, v) __atomic_store_n(&(x), (uint8_t)(v), __ATOMIC_RELEASE)
+
+static char *slot(stringQueue_t *q, uint8_t index) {
+	return q->data + (uint16_t)(index & q->mask) * q->slot_len;
+}
+
+int stringQueueInit(stringQueue_t *q, char *storage, uint8_t size, uint8_t slot_len) {
+	if(storage == NULL || slot_len == 0 || size == 0 || size > 128 ||
+	   (size & (size - 1)) != 0) {
+		return 0;
+	}
+	q->data = storage;
+	q->slot_len = slot_len;
+	q->size = size;
+	q->mask = size - 1;
+	q->head = 0;
+	q->tail = 0;
+	return 1;
+}
+
+/** @brief Copies a string into the next free slot.
+ *
+ *  Fails if the queue is full or if the string does not fit in a slot.
+ */
+int stringQueueAdd(stringQueue_t *q, const char *s) {
+	char *back = stringQueueBack(q);
+	if(back == NULL || strlen(s) >= q->slot_len) {
+		return 0;
+	}
+	strcpy(back, s);
+	stringQueuePush(q);
+	return 1;
+}
+
+/** @brief Copies the oldest string into buffer and removes it.
+ *
+ *  buffer must be at least slot_len bytes long.
+ */
+int stringQueueRemove(stringQueue_t *q, char *buffer) {
+	char *front = stringQueueFront(q);
+	if(front == NULL) {
+		return 0;
 	}
-	return 0;
+	strcpy(buffer, front);
+	stringQueuePop(q);
+	return 1;
 }
 
-int stringQueueAdd(stringQueue_t *q, char* s) {
+/** @brief Returns the slot holding the oldest string, NULL if empty. */
+char *stringQueueFront(stringQueue_t *q) {
+	if(stringQueueIsEmpty(q)) {
+		return NULL;
+	}
+	return slot(q, q->tail);
+}
+
+/** @brief Returns the slot holding the index'th oldest string, NULL if
+ *  there are not that many.
+ */
+char *stringQueueAt(stringQueue_t *q, uint8_t index) {
+	if(index >= stringQueueCount(q)) {
+		return NULL;
+	}
+	return slot(q, q->tail + index);
+}
+
+/** @brief Returns the next free slot to be filled in place, NULL if full.
+ *
+ *  The slot only becomes part of the queue once stringQueuePush is called.
+ */
+char *stringQueueBack(stringQueue_t *q) {
+	if(stringQueueIsFull(q)) {
+		return NULL;
+	}
+	return slot(q, q->head);
+}
+
+void stringQueuePush(stringQueue_t *q) {
 	if(!stringQueueIsFull(q)) {
-		q->data[q->head] = s;
-		q->head = (q->head + 1) % q->size;
-		return 1;
+		STORE_INDEX(q->head, q->head + 1);
 	}
-	return 0;
 }
 
-char *stringQueueRemove(stringQueue_t *q) {
-	char *retval;
+void stringQueuePop(stringQueue_t *q) {
 	if(!stringQueueIsEmpty(q)) {
-		retval = q->data[q->tail];
-		q->data[q->tail] = NULL;
-		q->tail = (q->tail + 1) % q->size;
-		return retval;
+		STORE_INDEX(q->tail, q->tail + 1);
 	}
-	return NULL;
 }
 
 int stringQueueIsEmpty(stringQueue_t *q) {
-	return q->head == q->tail;
+	return LOAD_INDEX(q->head) == LOAD_INDEX(q->tail);
 }
 
 int stringQueueIsFull(stringQueue_t *q) {
-	return ((q->head + 1) % q->size) == q->tail;
+	return (uint8_t)(LOAD_INDEX(q->head) - LOAD_INDEX(q->tail)) >= q->size;
 }
 
-void stringQueueDestroy(stringQueue_t *q) {
-	free(q->data);
+/** @brief Returns the number of strings in the queue. */
+uint8_t stringQueueCount(stringQueue_t *q) {
+	return LOAD_INDEX(q->head) - LOAD_INDEX(q->tail);
 }
 
 void stringQueuePrint(stringQueue_t *q) {
-	printf("Size: %d, Head: %d, Tail: %d\n", q->size, q->head, q->tail);
+	uint8_t head = q->head & q->mask;
+	uint8_t tail = q->tail & q->mask;
+	uint8_t count = stringQueueCount(q);
+	printf("Size: %d, Head: %d, Tail: %d\n", q->size, head, tail);
 	for (int i = 0; i < q->size; ++i)
 	{
-		if(i == q->head && i == q->tail){
+		if(i == head && i == tail){
 			printf("B->");
-		} else if(i == q->head){
+		} else if(i == head){
 			printf("H->");
-		} else if (i == q->tail) {
+		} else if (i == tail) {
 			printf("T->");
 		} else {
 			printf("   ");
 		}
-		if(q->data[i] != NULL){
-			printf("%d: %s\n", i, q->data[i]);
+		if((uint8_t)((i - tail) & q->mask) < count){
+			printf("%d: %s\n", i, slot(q, i));
 		} else {
-			printf("%d: NULL\n", i);
+			printf("%d: EMPTY\n", i);
 		}
 	}
 	printf("\n");
-}
\ No newline at end of file
+}
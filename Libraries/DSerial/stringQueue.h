@@ -1,22 +1,44 @@
 /** @file stringQueue.h
  *  @brief Headers and definitions for a simple FIFO queue of strings.
  *
+ *  The queue never allocates. Strings are copied into fixed size slots that
+ *  live inline in a block of storage owned by the caller, so the capacity of
+ *  every queue is fixed at compile time. Use STRING_QUEUE_STORAGE to size the
+ *  storage block for a given number of slots.
+ *
+ *  The number of slots must be a power of two (at most 128), so that the
+ *  head and tail can run freely and be masked into slot indexes instead of
+ *  wrapped with a division. The head is only ever written by the producer
+ *  (Back/Push) and the tail by the consumer (Front/Pop), so one producer and
+ *  one consumer may use a queue at once without locking, e.g. an interrupt
+ *  handler filling it and the main loop emptying it.
+ *
  *  @author Dillon Lareau (dlareau)
  */
 #pragma once
 #include "Arduino.h"
 
+// Bytes of storage needed for a queue of "size" slots of "slot_len" bytes.
+#define STRING_QUEUE_STORAGE(size, slot_len) ((size) * (slot_len))
+
 typedef struct {
-	char **data;
-	uint8_t head;
-	uint8_t tail;
+	char *data;
+	uint8_t slot_len;
+	uint8_t head;  // Free running, slot is head & mask
+	uint8_t tail;  // Free running, slot is tail & mask
 	uint8_t size;
+	uint8_t mask;
 } stringQueue_t;
 
-int stringQueueInit(stringQueue_t *q, uint8_t size);
-int stringQueueAdd(stringQueue_t *q, char* s);
-char *stringQueueRemove(stringQueue_t *q);
+int stringQueueInit(stringQueue_t *q, char *storage, uint8_t size, uint8_t slot_len);
+int stringQueueAdd(stringQueue_t *q, const char *s);
+int stringQueueRemove(stringQueue_t *q, char *buffer);
+char *stringQueueFront(stringQueue_t *q);
+char *stringQueueBack(stringQueue_t *q);
+char *stringQueueAt(stringQueue_t *q, uint8_t index);
+void stringQueuePush(stringQueue_t *q);
+void stringQueuePop(stringQueue_t *q);
 int stringQueueIsEmpty(stringQueue_t *q);
 int stringQueueIsFull(stringQueue_t *q);
-void stringQueueDestroy(stringQueue_t *q);
+uint8_t stringQueueCount(stringQueue_t *q);
 void stringQueuePrint(stringQueue_t *q);
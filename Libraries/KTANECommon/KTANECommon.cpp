@@ -29,6 +29,86 @@ void raw_to_config(raw_config_t *raw_config, config_t *config) {
   config->serial[6] = '\0';
 }
 
+static uint8_t saturate(uint16_t count){
+  return (count > 0xFF) ? 0xFF : count;
+}
+
+void stats_to_raw(dserial_stats_t *stats, uint8_t *raw_stats) {
+  raw_stats[0] = stats->frames_in & 0xFF;
+  raw_stats[1] = (stats->frames_in >> 8) & 0xFF;
+  raw_stats[2] = stats->frames_out & 0xFF;
+  raw_stats[3] = (stats->frames_out >> 8) & 0xFF;
+  raw_stats[4] = saturate(stats->bad_frames);
+  raw_stats[5] = saturate(stats->timeouts);
+  raw_stats[6] = saturate(stats->retries);
+  raw_stats[7] = saturate(stats->naks);
+  raw_stats[8] = stats->in_high;
+  raw_stats[9] = stats->out_high;
+}
+
+void raw_to_stats(uint8_t *raw_stats, dserial_stats_t *stats) {
+  stats->frames_in = raw_stats[0] | ((uint16_t)raw_stats[1] << 8);
+  stats->frames_out = raw_stats[2] | ((uint16_t)raw_stats[3] << 8);
+  stats->bad_frames = raw_stats[4];
+  stats->timeouts = raw_stats[5];
+  stats->retries = raw_stats[6];
+  stats->naks = raw_stats[7];
+  stats->in_high = raw_stats[8];
+  stats->out_high = raw_stats[9];
+}
+
+// Gives the length of a message of a type, 0 if the type is not known
+uint8_t ktane_msg_len(char type) {
+  switch(type) {
+    case STRIKE: return STRIKE_MSG_LEN;
+    case SOLVE: return SOLVE_MSG_LEN;
+    case CONFIG: return CONFIG_MSG_LEN;
+    case READY: return READY_MSG_LEN;
+    case RESET: return RESET_MSG_LEN;
+    case NUM_STRIKES: return NUM_STRIKES_MSG_LEN;
+    case STATS: return STATS_MSG_LEN;
+  }
+  return 0;
+}
+
+// Puts a message in data as it is sent, ktane_msg_len(msg->type) bytes
+// (KTANE_MAX_MSG_LEN fits any). Returns that length, 0 if the type is not
+// known.
+uint8_t ktane_encode(ktane_msg_t *msg, uint8_t *data) {
+  raw_config_t raw_config;
+
+  data[0] = msg->type;
+  if(msg->type == CONFIG) {
+    config_to_raw(&msg->config, &raw_config);
+    memcpy(data + 1, &raw_config, RAW_CONFIG_LEN);
+  } else if(msg->type == NUM_STRIKES) {
+    data[1] = msg->num_strikes;
+  } else if(msg->type == STATS) {
+    stats_to_raw(&msg->stats, data + 1);
+  }
+  return ktane_msg_len(msg->type);
+}
+
+// Decodes a received message. Returns 1 if it is a known type of the right
+// length, 0 otherwise (msg is then left with only the type set).
+int ktane_decode(const uint8_t *data, uint8_t len, ktane_msg_t *msg) {
+  raw_config_t raw_config;
+
+  msg->type = (len > 0) ? data[0] : 0;
+  if(len == 0 || len != ktane_msg_len(msg->type)) {
+    return 0;
+  }
+  if(msg->type == CONFIG) {
+    memcpy(&raw_config, data + 1, RAW_CONFIG_LEN);
+    raw_to_config(&raw_config, &msg->config);
+  } else if(msg->type == NUM_STRIKES) {
+    msg->num_strikes = data[1];
+  } else if(msg->type == STATS) {
+    raw_to_stats((uint8_t *)(data + 1), &msg->stats);
+  }
+  return 1;
+}
+
 unsigned long config_to_seed(config_t *config){
   unsigned long retval = 0;
   int i;
@@ -49,13 +129,193 @@ void delayWithUpdates(KTANEModule &module, unsigned int length) {
   }
 }
 
-void delayWithUpdates(KTANEController &controller, unsigned int length) {
+void delayWithUpdates(KTANEControllerBase &controller, unsigned int length) {
   unsigned long start_millis = millis();
   while(millis() - start_millis < length){
     controller.interpretData();
   }
 }
 
+KTANEScheduler::KTANEScheduler() {
+  memset(_fn, 0, sizeof(_fn));
+  _count = 0;
+  _next_due = 0;
+}
+
+// Schedules fn(arg) delay_ms from now, and every period_ms after that if
+// period_ms is not 0. If fn(arg) is already scheduled it is moved. Returns
+// 0 if all KTANE_MAX_TIMERS are taken, 1 otherwise.
+int KTANEScheduler::schedule(ktane_timer_fn fn, void *arg,
+                             unsigned long delay_ms, unsigned long period_ms) {
+  int i = find(fn, arg);
+
+  if(i < 0) {
+    i = find(NULL, NULL);
+    if(i < 0) {
+      return 0;
+    }
+    _count++;
+  }
+  _fn[i] = fn;
+  _arg[i] = arg;
+  _due[i] = millis() + delay_ms;
+  _period[i] = period_ms;
+  findNextDue();
+  return 1;
+}
+
+void KTANEScheduler::cancel(ktane_timer_fn fn, void *arg) {
+  int i = find(fn, arg);
+
+  if(i >= 0) {
+    _fn[i] = NULL;
+    _count--;
+    findNextDue();
+  }
+}
+
+int KTANEScheduler::isScheduled(ktane_timer_fn fn, void *arg) {
+  return find(fn, arg) >= 0;
+}
+
+// Calls every callback that is due. A periodic one that fell more than a
+// period behind skips the runs it missed rather than catching up.
+void KTANEScheduler::run() {
+  unsigned long now;
+  ktane_timer_fn fn;
+
+  if(_count == 0) {
+    return;
+  }
+  now = millis();
+  if((long)(now - _next_due) < 0) {
+    return;
+  }
+  for(int i = 0; i < KTANE_MAX_TIMERS; i++) {
+    if(_fn[i] == NULL || (long)(now - _due[i]) < 0) {
+      continue;
+    }
+    fn = _fn[i];
+    if(_period[i] == 0) {
+      _fn[i] = NULL;
+      _count--;
+    } else {
+      _due[i] += _period[i];
+      if((long)(now - _due[i]) >= 0) {
+        _due[i] = now + _period[i];
+      }
+    }
+    fn(_arg[i]);
+  }
+  findNextDue();
+}
+
+// Slot holding fn(arg), or a free slot for fn NULL. -1 if there is none.
+int KTANEScheduler::find(ktane_timer_fn fn, void *arg) {
+  for(int i = 0; i < KTANE_MAX_TIMERS; i++) {
+    if(_fn[i] == fn && (fn == NULL || _arg[i] == arg)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void KTANEScheduler::findNextDue() {
+  uint8_t first = 1;
+
+  for(int i = 0; i < KTANE_MAX_TIMERS; i++) {
+    if(_fn[i] != NULL && (first || (long)(_due[i] - _next_due) < 0)) {
+      _next_due = _due[i];
+      first = 0;
+    }
+  }
+}
+
+KTANETonePlayer::KTANETonePlayer(KTANEScheduler &scheduler, uint8_t pin)
+                                 :_scheduler(scheduler) {
+  _pin = pin;
+  _playing.len = 0;
+  _note = 0;
+  _queue_head = 0;
+  _queue_count = 0;
+}
+
+// Plays len notes, see KTANE_TONE_* for mode. The first note starts right
+// away unless the melody is queued behind another. Returns 0 if the
+// melody is empty or the queue is full.
+int KTANETonePlayer::play(const int *notes, const int *durations,
+                          uint8_t len, uint8_t mode) {
+  ktane_melody_t melody = {notes, durations, len};
+
+  if(len == 0) {
+    return 0;
+  }
+  if(mode == KTANE_TONE_REPLACE) {
+    _queue_count = 0;
+  }
+  if(mode != KTANE_TONE_QUEUE || _playing.len == 0) {
+    start(&melody);
+    return 1;
+  }
+  if(_queue_count == KTANE_MELODY_QUEUE) {
+    return 0;
+  }
+  _queue[(_queue_head + _queue_count) % KTANE_MELODY_QUEUE] = melody;
+  _queue_count++;
+  return 1;
+}
+
+// Stops the melody playing and drops the queued ones
+void KTANETonePlayer::stop() {
+  _scheduler.cancel(nextNote, this);
+  _playing.len = 0;
+  _queue_count = 0;
+  noTone(_pin);
+}
+
+int KTANETonePlayer::isPlaying() {
+  return _playing.len != 0;
+}
+
+void KTANETonePlayer::start(const ktane_melody_t *melody) {
+  _playing = *melody;
+  _note = 0;
+  nextNote(this);
+}
+
+// Plays the next note, or starts the next melody once one is done
+void KTANETonePlayer::nextNote(void *arg) {
+  KTANETonePlayer *player = (KTANETonePlayer *)arg;
+  int duration;
+
+  if(player->_note == player->_playing.len) {
+    noTone(player->_pin);
+    player->_playing.len = 0;
+    if(player->_queue_count > 0) {
+      player->_queue_count--;
+      player->_playing = player->_queue[player->_queue_head];
+      player->_queue_head = (player->_queue_head + 1) % KTANE_MELODY_QUEUE;
+      player->_note = 0;
+    } else {
+      return;
+    }
+  }
+  duration = player->_playing.durations[player->_note];
+  if(player->_playing.notes[player->_note] != 0) {
+    tone(player->_pin, player->_playing.notes[player->_note], duration);
+  } else {
+    noTone(player->_pin);
+  }
+  player->_note++;
+  player->_scheduler.schedule(nextNote, player,
+                              (unsigned long)duration * KTANE_NOTE_SPACING / 100);
+}
+
+// Turns off the LED on the pin arg points to
+static void ledOff(void *arg) {
+  digitalWrite(*(int *)arg, LOW);
+}
+
 void putByte(byte data, int clock_pin, int data_pin) {
   byte i = 8;
   byte mask;
@@ -83,7 +343,7 @@ void maxSingle(byte reg, byte col, int load_pin, int clock_pin, int data_pin) {
 
 void(* softwareReset) (void) = 0;
 
-KTANEModule::KTANEModule(DSerialClient &dserial, int green_led_pin, 
+KTANEModule::KTANEModule(DSerialClientBase &dserial, int green_led_pin, 
                          int red_led_pin):_dserial(dserial) {
   memset(&_config, 0, sizeof(config_t));
   _red_led_pin = red_led_pin;
@@ -97,15 +357,30 @@ KTANEModule::KTANEModule(DSerialClient &dserial, int green_led_pin,
 }
 
 void KTANEModule::interpretData(){
-  char out_message[MAX_MSG_LEN];
+  const uint8_t *data;
+  ktane_msg_t msg;
   unsigned long start_millis;
+  uint8_t len;
+  int valid;
   
   _dserial.doSerial();
-  if(_dserial.getData(out_message)) {
-    if(out_message[0] == CONFIG && strlen(out_message) == 8) {
+  _scheduler.run();
+  // Decoded where it is queued, then let go of
+  data = _dserial.peekData(&len);
+  if(data == NULL) {
+    return;
+  }
+  valid = ktane_decode(data, len, &msg);
+  _dserial.consumeData();
+  if(!valid) {
+    return;
+  }
+  switch(msg.type) {
+    case CONFIG:
       _got_config = 1;
-      raw_to_config((raw_config_t *)(out_message + 1), &_config);
-    } else if(out_message[0] == RESET) {
+      _config = msg.config;
+      break;
+    case RESET:
       // All of the stuff before softwareReset() is currently useless
       //  but is kept in case the hard-reset call is removed.
       is_solved = 0;
@@ -121,47 +396,46 @@ void KTANEModule::interpretData(){
         _dserial.doSerial();
       }
       softwareReset();
-    } else if(out_message[0] == NUM_STRIKES) {
-      _num_strikes = out_message[1];
-    }
+      break;
+    case NUM_STRIKES:
+      _num_strikes = msg.num_strikes;
+      break;
   }
 }
 
-// TODO: make non-blocking
-// currently will block non-communication code for 500ms
+// Lights the red LED for STRIKE_LED_MS, without waiting for it to go out
 int KTANEModule::strike() {
   int result = sendStrike();
   digitalWrite(_red_led_pin, HIGH);
-  delayWithUpdates(*this, 500);
-  digitalWrite(_red_led_pin, LOW);
+  _scheduler.schedule(ledOff, &_red_led_pin, STRIKE_LED_MS);
   return result;
 }
 
 int KTANEModule::sendStrike() {
-  char str[2] = {STRIKE, '\0'};
-  return _dserial.sendData(str);
+  char msg = STRIKE;
+  return _dserial.sendData(&msg, 1);
 }
 
 int KTANEModule::win() {
+  _scheduler.cancel(ledOff, &_green_led_pin); // Left over from sendReady
   digitalWrite(_green_led_pin, HIGH);
   return sendSolve();
 }
 
 int KTANEModule::sendSolve() {
-  char str[2] = {SOLVE, '\0'};
+  char msg = SOLVE;
   is_solved = 1;
-  return _dserial.sendData(str);
+  return _dserial.sendData(&msg, 1);
 }
 
-// TODO: maybe make non-blocking
+// Flashes the green LED for READY_LED_MS, without waiting for it to go out
 int KTANEModule::sendReady() {
-  char str[2] = {READY, '\0'};
-  int result = _dserial.sendData(str);
+  char msg = READY;
+  int result = _dserial.sendData(&msg, 1);
   if(result){
     digitalWrite(_red_led_pin, LOW);
     digitalWrite(_green_led_pin, HIGH);
-    delayWithUpdates(*this, 300);
-    digitalWrite(_green_led_pin, LOW);
+    _scheduler.schedule(ledOff, &_green_led_pin, READY_LED_MS);
   }
   return result;
 }
@@ -170,6 +444,29 @@ int KTANEModule::sendDebugMsg(char *msg) {
   return _dserial.sendData(msg);
 }
 
+// Sends the controller the client's DSerial stats and starts them over, so
+// that every report covers the time since the last one. Call it every so
+// often (say every few seconds) on a module worth keeping an eye on.
+int KTANEModule::sendStats() {
+  uint8_t data[KTANE_MAX_MSG_LEN];
+  ktane_msg_t msg;
+  uint8_t len;
+
+  msg.type = STATS;
+  _dserial.getStats(&msg.stats);
+  len = ktane_encode(&msg, data);
+  if(!_dserial.sendData(data, len)) {
+    return 0;
+  }
+  _dserial.resetStats();
+  return 1;
+}
+
+// The module's scheduler, run by interpretData
+KTANEScheduler &KTANEModule::getScheduler() {
+  return _scheduler;
+}
+
 config_t *KTANEModule::getConfig() {
   if(_got_config){
     return &_config;
@@ -210,7 +507,7 @@ char KTANEModule::getSerialDigit(int index) {
 }
 
 int KTANEModule::serialContains(char c) {
-  return !!((int)strchr(_config.serial, c));
+  return strchr(_config.serial, c) != NULL;
 }
 
 int KTANEModule::serialContainsVowel() {
@@ -237,106 +534,161 @@ int KTANEModule::getReset() {
   return 0;
 }
 
-KTANEController::KTANEController(DSerialMaster &dserial):_dserial(dserial) {
-  memset(_strikes, 0, MAX_CLIENTS);
-  memset(_solves, 0, MAX_CLIENTS);
-  memset(_readies, 0, MAX_CLIENTS);
-}
-
-void KTANEController::interpretData() {
-  char out_message[MAX_MSG_LEN];
+KTANEControllerBase::KTANEControllerBase(DSerialMasterBase &dserial,
+                                         uint8_t max_clients,
+                                         uint8_t *strikes, uint8_t *solves,
+                                         uint8_t *readies):_dserial(dserial) {
+  _max_clients = max_clients;
+  _strikes = strikes;
+  _solves = solves;
+  _readies = readies;
+  memset(_strikes, 0, _max_clients);
+  memset(_solves, 0, _max_clients);
+  memset(_readies, 0, _max_clients);
+  _have_config = 0;
+  _stats_client = 0;
+  _event_handler = NULL;
+}
+
+void KTANEControllerBase::interpretData() {
+  const uint8_t *data;
+  ktane_msg_t msg;
+  uint8_t client_id;
+  uint8_t len;
+  int event;
+  int valid;
   _dserial.doSerial();
-  int client_id = _dserial.getData(out_message);
-  if(client_id) {
-    if(out_message[0] == STRIKE) {
+  _scheduler.run();
+  while((event = _dserial.getEvent(&client_id)) != EVENT_NONE) {
+    // A module that was plugged in late or restarted missed the config and
+    // strikes broadcasts
+    if(event == EVENT_CLIENT_JOINED) {
+      updateClient(client_id);
+    }
+    if(_event_handler != NULL) {
+      _event_handler(event, client_id);
+    }
+  }
+  data = _dserial.peekData(&client_id, &len);
+  if(data == NULL) {
+    return;
+  }
+  valid = ktane_decode(data, len, &msg);
+  _dserial.consumeData();
+  if(!valid || client_id >= _max_clients) {
+    return;
+  }
+  switch(msg.type) {
+    case STRIKE:
       _strikes[client_id] = _strikes[client_id] + 1;
       sendStrikes();
-    } else if(out_message[0] == SOLVE) {
+      break;
+    case SOLVE:
       _solves[client_id] = 1;
-    } else if(out_message[0] == READY) {
+      break;
+    case READY:
       _readies[client_id] = 1;
-    }
+      break;
+    case STATS:
+      _stats = msg.stats;
+      _stats_client = client_id;
+      break;
   }
 }
 
-int KTANEController::sendConfig(config_t *config) {
-  char msg[9];
-  int err = 0;
-  uint8_t clients[MAX_CLIENTS];
-  int num_clients = 0;
-  num_clients = _dserial.getClients(clients);
+int KTANEControllerBase::sendConfig(config_t *config) {
+  ktane_msg_t msg;
+  int seq;
 
-  msg[0] = CONFIG;
-  config_to_raw(config, (raw_config_t *)(msg+1));
-  msg[8] = '\0';
+  msg.type = CONFIG;
+  msg.config = *config;
+  ktane_encode(&msg, _config_msg);
+  _have_config = 1;
 
-  for(int i = 0; i < num_clients; i++) {
-    if(!_dserial.sendData(clients[i], msg)) {
-      err++;
-    }
-    _dserial.doSerial();
-  }
-  return (err == 0);
+  seq = _dserial.sendBroadcast(ALL_GROUPS, _config_msg, sizeof(_config_msg));
+  _dserial.doSerial();
+  return (seq != 0);
+}
+
+// The controller's scheduler, run by interpretData
+KTANEScheduler &KTANEControllerBase::getScheduler() {
+  return _scheduler;
 }
 
-int KTANEController::getStrikes() {
+// interpretData takes every DSerial client event (see
+// DSerialMasterBase::getEvent) to bring modules that join up to date, then
+// passes each one to handler, if there is one. NULL for none.
+void KTANEControllerBase::setEventHandler(ktane_event_fn handler) {
+  _event_handler = handler;
+}
+
+int KTANEControllerBase::getStrikes() {
   int num_strikes = 0;
-  for(int i = 0; i < MAX_CLIENTS; i++) {
+  for(int i = 0; i < _max_clients; i++) {
     num_strikes += _strikes[i];
   }
   return num_strikes;
 }
 
-int KTANEController::getSolves() {
+int KTANEControllerBase::getSolves() {
   int num_solves = 0;
-  for(int i = 0; i < MAX_CLIENTS; i++) {
+  for(int i = 0; i < _max_clients; i++) {
     num_solves += _solves[i];
   }
   return num_solves;
 }
 
-int KTANEController::clientsAreReady() {
+int KTANEControllerBase::clientsAreReady() {
   int num_readies = 0;
-  for(int i = 0; i < MAX_CLIENTS; i++) {
+  for(int i = 0; i < _max_clients; i++) {
     num_readies += _readies[i];
   }
   return num_readies >= _dserial.getClients(NULL);
 }
 
-int KTANEController::sendReset() {
-  char msg[2] = {RESET, '\0'};
-  int err = 0;
-  uint8_t clients[MAX_CLIENTS];
-  int num_clients = 0;
-  num_clients = _dserial.getClients(clients);
+int KTANEControllerBase::sendReset() {
+  char msg = RESET;
+  int seq;
 
-  for(int i = 0; i < num_clients; i++) {
-    if(!_dserial.sendData(clients[i], msg)) {
-      err++;
-    }
-    _dserial.doSerial();
-  }
-  return (err == 0);
+  seq = _dserial.sendBroadcast(ALL_GROUPS, &msg, 1);
+  // Modules restart on reset, don't resend it to them once they are back.
+  _dserial.markBroadcastEpoch();
+  _dserial.doSerial();
+  return (seq != 0);
 }
 
-int KTANEController::sendStrikes() {
-  int num_strikes = getStrikes();
-  char msg[3] = {NUM_STRIKES, (char)num_strikes, '\0'};
-  int err = 0;
-  uint8_t clients[MAX_CLIENTS];
-  int num_clients = 0;
+int KTANEControllerBase::sendStrikes() {
+  uint8_t msg[NUM_STRIKES_MSG_LEN] = {(uint8_t)NUM_STRIKES,
+                                      (uint8_t)getStrikes()};
+  int seq;
 
-  if(num_strikes > 0){
-    num_clients = _dserial.getClients(clients);
+  seq = _dserial.sendBroadcast(ALL_GROUPS, msg, sizeof(msg));
+  _dserial.doSerial();
+  return (seq != 0);
+}
 
-    for(int i = 0; i < num_clients; i++) {
-      if(!_dserial.sendData(clients[i], msg)) {
-        err++;
-      }
-      _dserial.doSerial();
-    }
-    return (err == 0);
+// Gives the last stats report a module sent (see KTANEModule::sendStats),
+// once. Returns the module's address, 0 if no report came in since the
+// last call. Only the newest report is kept.
+int KTANEControllerBase::getClientStats(dserial_stats_t *stats) {
+  int client_id = _stats_client;
+
+  if(client_id) {
+    *stats = _stats;
+    _stats_client = 0;
   }
-  return 0;
+  return client_id;
+}
+
+// Sends the config (once there is one) and strike count to a single client
+int KTANEControllerBase::updateClient(uint8_t client_id) {
+  uint8_t msg[NUM_STRIKES_MSG_LEN] = {(uint8_t)NUM_STRIKES,
+                                      (uint8_t)getStrikes()};
+  int result = 1;
+
+  if(_have_config) {
+    result = _dserial.sendData(client_id, _config_msg, sizeof(_config_msg));
+  }
+  return _dserial.sendData(client_id, msg, sizeof(msg)) && result;
 }
 
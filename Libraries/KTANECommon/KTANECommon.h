@@ -22,22 +22,32 @@
 #define READY (char)0xC3
 #define RESET (char)0xC4
 #define NUM_STRIKES (char)0xC5
+#define STATS (char)0xC6
 
+// A config as it is sent in a CONFIG message (and kept by the config
+// module). The bitfields are uint8_t so that none of them, or the struct,
+// grows to the size of an int.
 typedef struct raw_config_st {
   // Byte 0
-  unsigned int spacer1: 2;
-  unsigned int ports : 3;
-  unsigned int batteries: 3;
+  uint8_t spacer1: 2;
+  uint8_t ports : 3;
+  uint8_t batteries: 3;
 
   // Bytes 1-5
   char serial[5];
   
   // Byte 6
-  unsigned int spacer2: 3;
-  unsigned int serial6: 3;
-  unsigned int indicators : 2;
+  uint8_t spacer2: 3;
+  uint8_t serial6: 3;
+  uint8_t indicators : 2;
 }raw_config_t;
 
+// Bytes of a raw_config_t as sent in a CONFIG message
+#define RAW_CONFIG_LEN 7
+
+static_assert(sizeof(raw_config_t) == RAW_CONFIG_LEN,
+              "raw_config_t is sent as RAW_CONFIG_LEN bytes");
+
 typedef struct config_st {
   unsigned int ports : 3;
   unsigned int batteries: 3;
@@ -48,14 +58,141 @@ typedef struct config_st {
 void config_to_raw(config_t *config, raw_config_t *raw_config_t);
 void raw_to_config(raw_config_t *raw_config, config_t *config_t);
 
+// Bytes of a module's DSerial stats as sent in a STATS message: frames in
+// and out (16 bits each, low byte first), then bad frames, timeouts,
+// retries, NAKs and the two queue high water marks (a byte each, stuck at
+// 255 rather than wrapping)
+#define RAW_STATS_LEN 10
+
+void stats_to_raw(dserial_stats_t *stats, uint8_t *raw_stats);
+void raw_to_stats(uint8_t *raw_stats, dserial_stats_t *stats);
+
+// Length of each message, its prefix code included. Every message of a
+// type has the same length, anything else is not that message.
+#define STRIKE_MSG_LEN 1
+#define SOLVE_MSG_LEN 1
+#define CONFIG_MSG_LEN (1 + RAW_CONFIG_LEN)
+#define READY_MSG_LEN 1
+#define RESET_MSG_LEN 1
+#define NUM_STRIKES_MSG_LEN 2
+#define STATS_MSG_LEN (1 + RAW_STATS_LEN)
+#define KTANE_MAX_MSG_LEN STATS_MSG_LEN
+
+static_assert(KTANE_MAX_MSG_LEN <= MAX_DATA_LEN,
+              "KTANE messages must fit in a DSerial message");
+static_assert(CONFIG_MSG_LEN <= MAX_BROADCAST_LEN,
+              "The controller broadcasts CONFIG");
+
+// A message between the controller and a module, decoded. Only the member
+// of the union for the type is used.
+typedef struct ktane_msg_st {
+  char type; // One of the prefix codes
+  union {
+    config_t config;         // CONFIG
+    uint8_t num_strikes;     // NUM_STRIKES
+    dserial_stats_t stats;   // STATS
+  };
+} ktane_msg_t;
+
+uint8_t ktane_msg_len(char type);
+uint8_t ktane_encode(ktane_msg_t *msg, uint8_t *data);
+int ktane_decode(const uint8_t *data, uint8_t len, ktane_msg_t *msg);
+
 unsigned long config_to_seed(config_t *config);
 
+// Most callbacks a KTANEScheduler holds at once
+#define KTANE_MAX_TIMERS 8
+
+// How long the LEDs stay lit after a strike and on getting ready
+#define STRIKE_LED_MS 500
+#define READY_LED_MS 300
+
+typedef void (*ktane_timer_fn)(void *arg);
+// Told about each DSerial client event (EVENT_*) interpretData sees
+typedef void (*ktane_event_fn)(uint8_t event, uint8_t client_id);
+
+/** @brief Runs callbacks at set times, from the loop that calls run().
+ *
+ *  Each module and the controller has one, run by interpretData, so a
+ *  sketch that calls interpretData every pass of its loop can turn a
+ *  delay() into a callback and keep reading its inputs in the meantime.
+ *  A callback is known by its function and argument: scheduling the same
+ *  pair again moves it rather than adding a second one. Callbacks may
+ *  schedule and cancel (themselves included), but must not call
+ *  interpretData.
+ */
+class KTANEScheduler {
+  public:
+    KTANEScheduler();
+    int schedule(ktane_timer_fn fn, void *arg, unsigned long delay_ms,
+                 unsigned long period_ms = 0);
+    void cancel(ktane_timer_fn fn, void *arg);
+    int isScheduled(ktane_timer_fn fn, void *arg);
+    void run();
+
+  private:
+    int find(ktane_timer_fn fn, void *arg);
+    void findNextDue();
+
+    ktane_timer_fn _fn[KTANE_MAX_TIMERS]; // NULL for a free slot
+    void     *_arg[KTANE_MAX_TIMERS];
+    unsigned long _due[KTANE_MAX_TIMERS];
+    unsigned long _period[KTANE_MAX_TIMERS]; // 0 to run once
+    uint8_t   _count;
+    unsigned long _next_due;  // Earliest _due, good while _count > 0
+};
+
+// Melodies a KTANETonePlayer holds on top of the one playing
+#define KTANE_MELODY_QUEUE 4
+// Each note starts this many percent of the last one's duration after it
+#define KTANE_NOTE_SPACING 130
+
+// How KTANETonePlayer::play fits a melody in with what is already playing
+#define KTANE_TONE_QUEUE 0    // After everything already queued
+#define KTANE_TONE_PREEMPT 1  // Now, cutting off the one playing. Queued
+                              // ones still play after it.
+#define KTANE_TONE_REPLACE 2  // Now, and nothing else after it
+
+typedef struct ktane_melody_st {
+  const int *notes;      // Frequencies in Hz, 0 for a rest
+  const int *durations;  // In ms
+  uint8_t len;
+} ktane_melody_t;
+
+/** @brief Plays melodies on a speaker in the background.
+ *
+ *  Notes are played with tone(), and the player moves on to the next one
+ *  from a scheduler callback, so the loop that runs the scheduler (through
+ *  interpretData) carries on while a melody plays. The note and duration
+ *  arrays are not copied and must stay around until the melody is done.
+ */
+class KTANETonePlayer {
+  public:
+    KTANETonePlayer(KTANEScheduler &scheduler, uint8_t pin);
+    int play(const int *notes, const int *durations, uint8_t len,
+             uint8_t mode = KTANE_TONE_QUEUE);
+    void stop();
+    int isPlaying();
+
+  private:
+    static void nextNote(void *arg);
+    void start(const ktane_melody_t *melody);
+
+    KTANEScheduler &_scheduler;
+    uint8_t   _pin;
+    ktane_melody_t _playing;  // len 0 when nothing is
+    uint8_t   _note;          // Next note of _playing
+    ktane_melody_t _queue[KTANE_MELODY_QUEUE];
+    uint8_t   _queue_head;
+    uint8_t   _queue_count;
+};
+
 void putByte(byte data, int clock_pin, int data_in_pin);
-void maxSingle(byte reg, byte col, int load_pin, int data_pin, int clock_pin);
+void maxSingle(byte reg, byte col, int load_pin, int clock_pin, int data_pin);
 
 class KTANEModule {
   public:
-    KTANEModule(DSerialClient &dserial, int green_led_pin, int red_led_pin);
+    KTANEModule(DSerialClientBase &dserial, int green_led_pin, int red_led_pin);
     void interpretData();
     config_t *getConfig();
     int strike();
@@ -64,6 +201,8 @@ class KTANEModule {
     int getNumStrikes();
     int is_solved;
     int sendDebugMsg(char *msg);
+    int sendStats();
+    KTANEScheduler &getScheduler();
     
     // Helper functions for strike() and win()
     int sendSolve();
@@ -83,7 +222,8 @@ class KTANEModule {
     // currently useless because of hard reset
     int getReset();
   private:
-    DSerialClient &_dserial;
+    DSerialClientBase &_dserial;
+    KTANEScheduler _scheduler;
     config_t _config;
     int _green_led_pin;
     int _red_led_pin;
@@ -92,9 +232,11 @@ class KTANEModule {
     int _got_reset;
 };
 
-class KTANEController {
+/** @brief The controller's side of a game, use KTANEController or
+ *  KTANEControllerT.
+ */
+class KTANEControllerBase {
   public:
-    KTANEController(DSerialMaster &dserial);
     void interpretData();
     int sendConfig(config_t *config);
     int getStrikes();
@@ -102,13 +244,57 @@ class KTANEController {
     int clientsAreReady();
     int sendReset();
     int sendStrikes();
+    int getClientStats(dserial_stats_t *stats);
+    KTANEScheduler &getScheduler();
+    void setEventHandler(ktane_event_fn handler);
+
+  protected:
+    KTANEControllerBase(DSerialMasterBase &dserial, uint8_t max_clients,
+                        uint8_t *strikes, uint8_t *solves, uint8_t *readies);
 
   private:
-    DSerialMaster &_dserial;
-    uint8_t _strikes[MAX_CLIENTS];
-    uint8_t _solves[MAX_CLIENTS];
-    uint8_t _readies[MAX_CLIENTS];
+    int updateClient(uint8_t client_id);
+
+    DSerialMasterBase &_dserial;
+    KTANEScheduler _scheduler;
+    ktane_event_fn _event_handler;
+    uint8_t _config_msg[CONFIG_MSG_LEN]; // Last config sent, encoded
+    int _have_config;
+    uint8_t _max_clients;
+    uint8_t *_strikes;     // Each max_clients entries, by client address
+    uint8_t *_solves;
+    uint8_t *_readies;
+    uint8_t _stats_client; // Sender of _stats, 0 once it has been read
+    dserial_stats_t _stats;
+};
+
+// Storage for a KTANEControllerT, see DSerialMasterStorage
+template<uint8_t CLIENTS>
+class KTANEControllerStorage {
+  protected:
+    uint8_t _strikes[CLIENTS];
+    uint8_t _solves[CLIENTS];
+    uint8_t _readies[CLIENTS];
 };
 
+/** @brief A controller for a master of CLIENTS addresses, the same CLIENTS
+ *  as its DSerialMasterT, e.g.
+ *
+ *    DSerialMasterT<8, 8> master(serial_port);
+ *    KTANEControllerT<8> controller(master);
+ */
+template<uint8_t CLIENTS>
+class KTANEControllerT : private KTANEControllerStorage<CLIENTS>,
+                         public KTANEControllerBase {
+  typedef KTANEControllerStorage<CLIENTS> Storage;
+
+  public:
+    KTANEControllerT(DSerialMasterBase &dserial):
+      KTANEControllerBase(dserial, CLIENTS, Storage::_strikes,
+                          Storage::_solves, Storage::_readies){}
+};
+
+typedef KTANEControllerT<MAX_CLIENTS> KTANEController;
+
 void delayWithUpdates(KTANEModule &module, unsigned int length);
-void delayWithUpdates(KTANEController &controller, unsigned int length);
+void delayWithUpdates(KTANEControllerBase &controller, unsigned int length);
@@ -0,0 +1,176 @@
+/** @file KTANEDisplay.h
+ *  @brief Displays that only send what changed since the last frame
+ *
+ *  Sending a frame to a display takes far longer than drawing it: an
+ *  HT16K33 backpack takes about 1.6 ms of I2C at 100 kHz for all 8 rows,
+ *  and an ST7920 about 25 ms of SPI for the whole screen. These keep what
+ *  was last sent, so a frame that is the same as the last one costs
+ *  nothing to send and one that is a little different costs a little.
+ *  Sketches should still only draw when what they show changes.
+ *
+ *  KTANEHT16K33Cache works on the displaybuffer of an Adafruit backpack
+ *  (Adafruit_7segment, Adafruit_AlphaNum4, ...). Draw into it as before and
+ *  call flush() in place of writeDisplay():
+ *
+ *    Adafruit_7segment matrix = Adafruit_7segment();
+ *    KTANEHT16K33Cache matrix_cache(matrix.displaybuffer, 0x70);
+ *    ...
+ *    matrix.writeDigitNum(0, 3);
+ *    matrix_cache.flush();
+ *
+ *  KTANEPageCache works on a U8g2 display in page mode (the _1 and _2
+ *  constructors), which does not have the RAM for a whole frame to compare
+ *  against. It draws each page, and only sends the pages whose CRC changed
+ *  (see ktanePageSum). It takes the function that draws a frame in place of
+ *  the firstPage()/nextPage() loop:
+ *
+ *    void drawFrame(U8G2 &u8g2, void *arg){ ... }
+ *    KTANEPageCache<U8G2> screen(u8g2);
+ *    ...
+ *    screen.render(drawFrame, NULL);
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#pragma once
+#include "Arduino.h"
+#include <Wire.h>
+
+#define HT16K33_ROWS 8
+#define KTANE_MAX_PAGES 16
+
+/** @brief CRC-16 (CCITT, reflected) of a page, to tell whether it changed
+ *
+ *  Worked out a byte at a time without a table, as avr-libc's
+ *  _crc_ccitt_update does. Any change of up to 3 bits, or within 16 bits in
+ *  a row, always changes it on a page of up to 4000 bytes (so does lighting
+ *  or clearing a whole page). A bigger change leaves it the same about once
+ *  in 65536 frames, and that page is then not sent until it changes again,
+ *  so a sketch that can't have that can call invalidate() now and then.
+ */
+static inline uint16_t ktanePageSum(const uint8_t *data, uint16_t len){
+  uint16_t crc = 0xFFFF;
+  while(len--){
+    uint8_t c = *data++ ^ (uint8_t)crc;
+    c ^= c << 4;
+    crc = (((uint16_t)c << 8) | (crc >> 8)) ^ (uint8_t)(c >> 4) ^
+          ((uint16_t)c << 3);
+  }
+  return crc;
+}
+
+class KTANEHT16K33Cache {
+  public:
+    /** @brief wraps the frame of an HT16K33
+     *
+     *  @param buffer  The HT16K33_ROWS rows of the frame
+     *  @param addr    I2C address of the HT16K33, as passed to begin()
+     */
+    KTANEHT16K33Cache(uint16_t *buffer, uint8_t addr){
+      _buffer = buffer;
+      _addr = addr;
+      invalidate();
+    }
+
+    /** @brief sends the rows that changed since the last flush
+     *
+     *  Rows next to each other go in one I2C transfer.
+     *
+     *  @return The number of rows sent
+     */
+    uint8_t flush(){
+      uint8_t sent = 0;
+      uint8_t i = 0;
+      while(i < HT16K33_ROWS){
+        if(!isDirty(i)){
+          i++;
+          continue;
+        }
+        Wire.beginTransmission(_addr);
+        Wire.write((uint8_t)(i * 2)); // Display RAM address of row i
+        while(i < HT16K33_ROWS && isDirty(i)){
+          Wire.write(_buffer[i] & 0xFF);
+          Wire.write(_buffer[i] >> 8);
+          _sent[i] = _buffer[i];
+          i++;
+          sent++;
+        }
+        Wire.endTransmission();
+      }
+      _stale = 0;
+      return sent;
+    }
+
+    /** @brief makes the next flush send every row
+     *
+     *  For when the display has been written some other way, or has just
+     *  been begin()'d.
+     */
+    void invalidate(){
+      _stale = 1;
+    }
+
+  private:
+    uint8_t isDirty(uint8_t i){
+      return _stale || _buffer[i] != _sent[i];
+    }
+
+    uint16_t *_buffer;
+    uint8_t   _addr;
+    uint16_t  _sent[HT16K33_ROWS];
+    uint8_t   _stale;  // Set when _sent can not be trusted
+};
+
+template<class U8G2_T>
+class KTANEPageCache {
+  public:
+    KTANEPageCache(U8G2_T &u8g2) : _u8g2(u8g2){
+      invalidate();
+    }
+
+    /** @brief draws a frame, sending the pages that changed
+     *
+     *  @param draw  Draws the frame, it is called once for each page and
+     *               anything off the page is clipped
+     *  @param arg   Passed to draw
+     *
+     *  @return The number of pages sent
+     */
+    uint8_t render(void (*draw)(U8G2_T &u8g2, void *arg), void *arg){
+      uint8_t sent = 0;
+      uint8_t page_rows = _u8g2.getBufferTileHeight();
+      uint8_t rows = _u8g2.getDisplayHeight() / 8;
+      uint16_t len = 8 * page_rows * _u8g2.getBufferTileWidth();
+
+      for(uint8_t page = 0, row = 0; row < rows; page++, row += page_rows){
+        _u8g2.setBufferCurrTileRow(row);
+        _u8g2.clearBuffer();
+        draw(_u8g2, arg);
+        // Pages past KTANE_MAX_PAGES are always sent
+        if(page >= KTANE_MAX_PAGES){
+          _u8g2.sendBuffer();
+          sent++;
+          continue;
+        }
+        uint16_t sum = ktanePageSum(_u8g2.getBufferPtr(), len);
+        if((_stale & (1 << page)) || sum != _sums[page]){
+          _u8g2.sendBuffer();
+          _sums[page] = sum;
+          sent++;
+        }
+      }
+      _stale = 0;
+      return sent;
+    }
+
+    /** @brief makes the next render send every page
+     */
+    void invalidate(){
+      _stale = 0xFFFF;
+    }
+
+  private:
+    U8G2_T   &_u8g2;
+    uint16_t  _sums[KTANE_MAX_PAGES];
+    uint16_t  _stale;  // Bit n set when page n has to be sent
+};
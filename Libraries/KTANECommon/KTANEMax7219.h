@@ -0,0 +1,183 @@
+/** @file KTANEMax7219.h
+ *  @brief A MAX7219 driver that only sends the digits that changed
+ *
+ *  The driver keeps a copy of the 8 digit registers, so a sketch can set
+ *  every digit on every pass of its loop and only the ones that changed
+ *  go out, all at once, when update() is called. The pins are template
+ *  parameters, which lets the fastest way of driving them be picked at
+ *  compile time:
+ *    - On an ATmega328P/168 with CLOCK on SCK (13) and DATA on MOSI (11),
+ *      the hardware SPI at 8 MHz (pin 10, SS, becomes an output). Not with
+ *      LOAD on MISO (12) though, the SPI makes that pin an input.
+ *    - On an ATmega328P/168 with other pins, direct port writes, a single
+ *      instruction per pin change instead of a digitalWrite() call.
+ *    - Anywhere else, digitalWrite().
+ *
+ *  For example, for the controller's clock:
+ *
+ *    KTANEMax7219<LOAD_PIN, CLOCK_PIN, DATA_PIN> clock_display;
+ *    ...
+ *    clock_display.begin();
+ *    ...
+ *    clock_display.setDigit(1, digits[minutes / 10]);
+ *    ...
+ *    clock_display.update();
+ *
+ *  maxSingle() in KTANECommon.h still writes a single register with
+ *  digitalWrite() on any pins.
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#pragma once
+#include "Arduino.h"
+
+// MAX7219 registers, digits are 1 to 8
+#define MAX7219_NOOP 0x00
+#define MAX7219_DIGIT(n) (n)
+#define MAX7219_DECODE_MODE 0x09
+#define MAX7219_INTENSITY 0x0A
+#define MAX7219_SCAN_LIMIT 0x0B
+#define MAX7219_SHUTDOWN 0x0C
+#define MAX7219_DISPLAY_TEST 0x0F
+
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega168__)
+#define KTANE_FAST_PINS
+#endif
+
+/** @brief Sets an output pin known at compile time
+ *
+ *  With KTANE_FAST_PINS this is a single sbi/cbi, which can not be cut in
+ *  half by an interrupt writing another pin of the same port.
+ */
+template<uint8_t PIN>
+inline void ktaneFastWrite(uint8_t value){
+#ifdef KTANE_FAST_PINS
+  static_assert(PIN < 20, "Pins 0 to 19 only");
+  volatile uint8_t *port = (PIN < 8) ? &PORTD : (PIN < 14) ? &PORTB : &PORTC;
+  const uint8_t mask = 1 << ((PIN < 8) ? PIN : (PIN < 14) ? PIN - 8 :
+                             PIN - 14);
+  if(value){
+    *port |= mask;
+  } else {
+    *port &= ~mask;
+  }
+#else
+  digitalWrite(PIN, value);
+#endif
+}
+
+template<uint8_t LOAD, uint8_t CLOCK, uint8_t DATA>
+class KTANEMax7219 {
+  public:
+    // Whether the pins are driven by the hardware SPI on an ATmega328P/168
+    static const uint8_t USE_SPI = (CLOCK == 13 && DATA == 11 && LOAD != 12);
+
+    KTANEMax7219(){
+      memset(_shadow, 0, sizeof(_shadow));
+      _dirty = 0xFF;
+    }
+
+    /** @brief sets the pins up and the chip to show the digit registers
+     *
+     *  Every digit is cleared.
+     *
+     *  @param intensity  Brightness, 0 to 15
+     *  @param scan_limit Number of digits wired up, minus one
+     */
+    void begin(uint8_t intensity = 0x0F, uint8_t scan_limit = 7){
+      pinMode(LOAD, OUTPUT);
+      pinMode(CLOCK, OUTPUT);
+      pinMode(DATA, OUTPUT);
+      ktaneFastWrite<LOAD>(HIGH);
+#ifdef KTANE_FAST_PINS
+      if(USE_SPI){
+        pinMode(10, OUTPUT); // SS, or the SPI drops out of master mode
+        SPCR = _BV(SPE) | _BV(MSTR); // Mode 0, MSB first
+        SPSR = _BV(SPI2X);           // F_CPU / 2
+      }
+#endif
+      writeRegister(MAX7219_SCAN_LIMIT, scan_limit);
+      writeRegister(MAX7219_DECODE_MODE, 0x00);
+      writeRegister(MAX7219_SHUTDOWN, 0x01);
+      writeRegister(MAX7219_DISPLAY_TEST, 0x00);
+      writeRegister(MAX7219_INTENSITY, intensity & 0x0F);
+      memset(_shadow, 0, sizeof(_shadow));
+      refresh();
+    }
+
+    /** @brief sets what a digit shows, from the next update()
+     *
+     *  @param digit  1 to 8
+     *  @param value  Segments (bit 7 is DP, bits 6 to 0 segments A to G)
+     */
+    void setDigit(uint8_t digit, uint8_t value){
+      uint8_t i = (digit - 1) & 7;
+      if(_shadow[i] != value){
+        _shadow[i] = value;
+        _dirty |= 1 << i;
+      }
+    }
+
+    uint8_t getDigit(uint8_t digit){
+      return _shadow[(digit - 1) & 7];
+    }
+
+    /** @brief sends every digit that changed since the last update
+     *
+     *  @return The number of digits sent
+     */
+    uint8_t update(){
+      uint8_t sent = 0;
+      for(uint8_t i = 0; _dirty != 0; i++){
+        if(_dirty & (1 << i)){
+          send(MAX7219_DIGIT(i + 1), _shadow[i]);
+          _dirty &= ~(1 << i);
+          sent++;
+        }
+      }
+      return sent;
+    }
+
+    /** @brief sends every digit, in case the chip lost them (a brown out)
+     */
+    void refresh(){
+      _dirty = 0xFF;
+      update();
+    }
+
+    /** @brief writes a control register straight away
+     *
+     *  @param reg    One of MAX7219_*, digits should go through setDigit
+     *  @param value  The value
+     */
+    void writeRegister(uint8_t reg, uint8_t value){
+      send(reg, value);
+    }
+
+  private:
+    void send(uint8_t reg, uint8_t value){
+      ktaneFastWrite<LOAD>(LOW);
+      sendByte(reg);
+      sendByte(value);
+      ktaneFastWrite<LOAD>(HIGH); // The chip latches on the rising edge
+    }
+
+    void sendByte(uint8_t b){
+#ifdef KTANE_FAST_PINS
+      if(USE_SPI){
+        SPDR = b;
+        while(!(SPSR & _BV(SPIF)));
+        return;
+      }
+#endif
+      for(uint8_t mask = 0x80; mask != 0; mask >>= 1){
+        ktaneFastWrite<CLOCK>(LOW);
+        ktaneFastWrite<DATA>(b & mask);
+        ktaneFastWrite<CLOCK>(HIGH);
+      }
+    }
+
+    uint8_t   _shadow[8];
+    uint8_t   _dirty;     // Bit n set when digit n+1 has to be sent
+};
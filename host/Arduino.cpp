@@ -0,0 +1,66 @@
+/** @file Arduino.cpp
+ *  @brief The simulated clock and pins behind the host Arduino.h
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#include "Arduino.h"
+
+static unsigned long now_us = 0;
+static void (*sleep_hook)(unsigned long us) = NULL;
+
+/** @brief takes up simulated time
+ *
+ *  @param us  Microseconds to sleep for
+ */
+void hostSleep(unsigned long us){
+  if(sleep_hook != NULL){
+    sleep_hook(us);
+  } else {
+    now_us += us;
+  }
+}
+
+/** @brief hands sleeping over to a simulator
+ *
+ *  @param hook  Called with the time to sleep for, NULL for none
+ */
+void hostSetSleepHook(void (*hook)(unsigned long us)){
+  sleep_hook = hook;
+}
+
+/** @brief sets the simulated clock
+ *
+ *  @param us  The new time in us
+ */
+void hostSetTime(unsigned long us){
+  now_us = us;
+}
+
+unsigned long millis(){
+  hostSleep(HOST_CALL_US);
+  return now_us / 1000;
+}
+
+unsigned long micros(){
+  hostSleep(HOST_CALL_US);
+  return now_us;
+}
+
+void delay(unsigned long ms){
+  hostSleep(ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us){
+  hostSleep(us);
+}
+
+// There is nothing behind the pins, but writing them takes time so that
+// drivers that bit-bang them cost what they would
+void pinMode(uint8_t pin, uint8_t mode){}
+void digitalWrite(uint8_t pin, uint8_t value){
+  hostSleep(HOST_PIN_US);
+}
+int digitalRead(uint8_t pin){ return LOW; }
+void tone(uint8_t pin, unsigned int frequency, unsigned long duration){}
+void noTone(uint8_t pin){}
@@ -0,0 +1,72 @@
+/** @file Arduino.h
+ *  @brief Just enough of the Arduino core to build the libraries on a PC
+ *
+ *  Time is simulated. Every call to millis() or micros() takes HOST_CALL_US
+ *  so that busy loops get somewhere, delay() and delayMicroseconds() take
+ *  as long as asked. SimBus takes over the clock to run many nodes at once.
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+void tone(uint8_t pin, unsigned int frequency, unsigned long duration = 0);
+void noTone(uint8_t pin);
+
+// Simulated time taken by a call to millis() or micros()
+#define HOST_CALL_US 10
+// Simulated time taken by digitalWrite(), about what it takes on a 16 MHz AVR
+#define HOST_PIN_US 4
+
+// Takes us microseconds of simulated time, see hostSetSleepHook
+void hostSleep(unsigned long us);
+// Lets a simulator (SimBus) decide what happens while a node sleeps, the
+// hook is passed the time to sleep for. NULL just moves the clock on.
+void hostSetSleepHook(void (*hook)(unsigned long us));
+// Sets the simulated clock, for the sleep hook
+void hostSetTime(unsigned long us);
+
+class Print {
+  public:
+    virtual ~Print(){}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size){
+      size_t n = 0;
+      while(size--){
+        n += write(*buffer++);
+      }
+      return n;
+    }
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
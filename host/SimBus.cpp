@@ -0,0 +1,424 @@
+/** @file SimBus.cpp
+ *  @brief A simulated multi-drop serial bus to run DSerial nodes on a PC
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#include "SimBus.h"
+
+SimBus *SimBus::_running = NULL;
+
+/** @brief Creates a new SimPort object on a bus
+ *
+ *  @param bus  The bus the port is wired to
+ *  @return A new SimPort at SIM_DEFAULT_BAUD
+ */
+SimPort::SimPort(SimBus &bus):_bus(bus){
+  _baud = SIM_DEFAULT_BAUD;
+  _tx_free = 0;
+  _isr = NULL;
+  _rx_head = 0;
+  _rx_count = 0;
+  _bus.attach(this);
+}
+
+/** @brief changes the baud rate
+ *
+ *  Bytes still being sent go out at the old rate, call flushOutput first
+ *  to be sure they are done.
+ *
+ *  @param baud  The new baud rate
+ */
+void SimPort::begin(unsigned long baud){
+  _baud = baud;
+}
+
+/** @brief waits for everything written to go out */
+void SimPort::flushOutput(){
+  unsigned long now = _bus.now();
+  if((long)(_tx_free - now) > 0){
+    hostSleep(_tx_free - now);
+  }
+}
+
+/** @brief hands each received byte to isr instead of buffering it
+ *
+ *  @param isr  Called with each byte as it arrives, NULL to buffer again
+ */
+void SimPort::attachInterrupt(sim_isr_fn isr){
+  _isr = isr;
+}
+
+unsigned long SimPort::getBaud(){
+  return _baud;
+}
+
+size_t SimPort::write(uint8_t c){
+  _bus.transmit(this, c);
+  return 1;
+}
+
+/** @brief tells how many received bytes are waiting
+ *
+ *  Takes HOST_CALL_US like millis(), so that a loop that only polls the
+ *  port lets the rest of the bus run.
+ */
+int SimPort::available(){
+  hostSleep(HOST_CALL_US);
+  return _rx_count;
+}
+
+int SimPort::read(){
+  uint8_t c;
+  if(_rx_count == 0){
+    return -1;
+  }
+  c = _rx[_rx_head];
+  _rx_head = (_rx_head + 1) % SIM_RX_BUFFER;
+  _rx_count--;
+  return c;
+}
+
+int SimPort::peek(){
+  return (_rx_count == 0) ? -1 : _rx[_rx_head];
+}
+
+void SimPort::receive(uint8_t c){
+  if(_isr != NULL){
+    _isr(c);
+  } else if(_rx_count == SIM_RX_BUFFER){
+    _bus._stats.overflows++;
+  } else {
+    _rx[(_rx_head + _rx_count) % SIM_RX_BUFFER] = c;
+    _rx_count++;
+  }
+}
+
+/** @brief Creates a new SimBus object
+ *
+ *  @param seed  Seed for the bit errors, drops and garbage, the same seed
+ *               and tasks give the same run
+ *  @return A new error free bus with no ports or tasks
+ */
+SimBus::SimBus(uint32_t seed){
+  _now = 0;
+  _seed = seed ? seed : 1;
+  _bit_error_rate = 0;
+  _drop_rate = 0;
+  _num_ports = 0;
+  _num_in_flight = 0;
+  _num_tasks = 0;
+  _current = -1;
+  _queue_len = 0;
+  _order = 0;
+  resetStats();
+}
+
+SimBus::~SimBus(){
+  for(int i = 0; i < _num_tasks; i++){
+    free(_tasks[i].stack);
+  }
+}
+
+/** @brief adds a task, which starts at the next run()
+ *
+ *  A task that returns is done, most never do.
+ *
+ *  @param fn   The task
+ *  @param arg  Passed to fn
+ *  @return 1 on success, 0 if there are already SIM_MAX_TASKS
+ */
+int SimBus::addTask(sim_task_fn fn, void *arg){
+  sim_task_t *task;
+
+  if(_num_tasks == SIM_MAX_TASKS){
+    return 0;
+  }
+  task = &_tasks[_num_tasks++];
+  task->fn = fn;
+  task->arg = arg;
+  task->wake = _now;
+  task->done = 0;
+  task->stack = (char *)malloc(SIM_STACK_SIZE);
+  getcontext(&task->ctx);
+  task->ctx.uc_stack.ss_sp = task->stack;
+  task->ctx.uc_stack.ss_size = SIM_STACK_SIZE;
+  task->ctx.uc_link = &_scheduler;
+  makecontext(&task->ctx, startTask, 0);
+  pushTask(_num_tasks - 1);
+  return 1;
+}
+
+/** @brief tells which task is running, for callbacks without an argument
+ *
+ *  @return The task's index in the order they were added, -1 outside of
+ *            a task
+ */
+int SimBus::currentTask(){
+  return _current;
+}
+
+/** @brief runs the tasks and the bus
+ *
+ *  Tasks are run in order of when they next want to wake up (in turn if
+ *  at the same time), bytes are delivered as they finish.
+ *
+ *  @param us  How long to run for, in simulated us
+ */
+void SimBus::run(unsigned long us){
+  unsigned long end = _now + us;
+  sim_task_t *task;
+  int next;
+
+  _running = this;
+  hostSetSleepHook(sleep);
+  while(_queue_len > 0 && (long)(_tasks[_queue[0]].wake - end) <= 0){
+    next = popTask();
+    task = &_tasks[next];
+    deliverUntil(task->wake);
+    _now = task->wake;
+    hostSetTime(_now);
+    _current = next;
+    swapcontext(&_scheduler, &task->ctx);
+    _current = -1;
+    if(!task->done){
+      pushTask(next);
+    }
+  }
+  deliverUntil(end);
+  _now = end;
+  hostSetTime(_now);
+  hostSetSleepHook(NULL);
+  _running = NULL;
+}
+
+/** @brief gives the simulated time
+ *
+ *  @return The time in us, without taking any
+ */
+unsigned long SimBus::now(){
+  return _now;
+}
+
+/** @brief sets how often a received bit is flipped
+ *
+ *  A flipped start or stop bit loses the byte, a flipped data bit changes
+ *  it. Each receiver gets its own errors.
+ *
+ *  @param rate  Chance of each bit being flipped, 0 to 1
+ */
+void SimBus::setBitErrorRate(double rate){
+  _bit_error_rate = rate;
+}
+
+/** @brief sets how often a received byte is lost outright
+ *
+ *  @param rate  Chance of each byte being lost at each receiver, 0 to 1
+ */
+void SimBus::setDropRate(double rate){
+  _drop_rate = rate;
+}
+
+/** @brief copies out the counts since the last resetStats
+ *
+ *  @param stats  Where the counts go
+ */
+void SimBus::getStats(sim_bus_stats_t *stats){
+  *stats = _stats;
+}
+
+void SimBus::resetStats(){
+  memset(&_stats, 0, sizeof(_stats));
+}
+
+/** @brief gives the next number from the bus's generator (xorshift32)
+ *
+ *  Tasks can use it too, to stay repeatable for a seed.
+ */
+uint32_t SimBus::random(){
+  _seed ^= _seed << 13;
+  _seed ^= _seed >> 17;
+  _seed ^= _seed << 5;
+  return _seed;
+}
+
+double SimBus::uniform(){
+  return random() / 4294967296.0;
+}
+
+void SimBus::attach(SimPort *port){
+  if(_num_ports == SIM_MAX_PORTS){
+    fprintf(stderr, "SimBus: more than %d ports\n", SIM_MAX_PORTS);
+    abort();
+  }
+  _ports[_num_ports++] = port;
+}
+
+// Whether task a wakes up before task b
+int SimBus::before(int a, int b){
+  long diff = (long)(_tasks[a].wake - _tasks[b].wake);
+  return diff < 0 || (diff == 0 && _tasks[a].order < _tasks[b].order);
+}
+
+void SimBus::pushTask(int index){
+  int i = _queue_len++;
+
+  _tasks[index].order = _order++;
+  while(i > 0 && before(index, _queue[(i - 1) / 2])){
+    _queue[i] = _queue[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  _queue[i] = index;
+}
+
+int SimBus::popTask(){
+  int top = _queue[0];
+  int last = _queue[--_queue_len];
+  int i = 0;
+  int child;
+
+  for(;;){
+    child = 2 * i + 1;
+    if(child >= _queue_len){
+      break;
+    }
+    if(child + 1 < _queue_len && before(_queue[child + 1], _queue[child])){
+      child++;
+    }
+    if(!before(_queue[child], last)){
+      break;
+    }
+    _queue[i] = _queue[child];
+    i = child;
+  }
+  _queue[i] = last;
+  return top;
+}
+
+// Puts a byte on the bus after whatever the port is still sending, waits
+// for room like a full transmit buffer would
+void SimBus::transmit(SimPort *from, uint8_t c){
+  unsigned long byte_us = (10 * 1000000UL + from->_baud / 2) / from->_baud;
+  sim_byte_t *b;
+
+  if((long)(from->_tx_free - _now) > (long)(SIM_TX_BUFFER * byte_us)){
+    hostSleep(from->_tx_free - _now - SIM_TX_BUFFER * byte_us);
+  }
+  if(_num_in_flight == SIM_MAX_PORTS * SIM_TX_BUFFER){
+    deliverUntil(_now); // Can not happen with the wait above
+  }
+
+  b = &_in_flight[_num_in_flight++];
+  b->from = from;
+  b->baud = from->_baud;
+  b->start = ((long)(from->_tx_free - _now) > 0) ? from->_tx_free : _now;
+  b->end = b->start + byte_us;
+  b->value = c;
+  b->collided = 0;
+  from->_tx_free = b->end;
+  _stats.bytes++;
+
+  for(int i = 0; i < _num_in_flight - 1; i++){
+    sim_byte_t *other = &_in_flight[i];
+    if(other->from != from && (long)(other->start - b->end) < 0 &&
+       (long)(b->start - other->end) < 0){
+      if(!other->collided){
+        other->collided = 1;
+        _stats.collisions++;
+      }
+      if(!b->collided){
+        b->collided = 1;
+        _stats.collisions++;
+      }
+    }
+  }
+}
+
+// Delivers every byte done by time t, in the order they finish
+void SimBus::deliverUntil(unsigned long t){
+  int first;
+
+  for(;;){
+    first = -1;
+    for(int i = 0; i < _num_in_flight; i++){
+      if((long)(_in_flight[i].end - t) <= 0 &&
+         (first == -1 ||
+          (long)(_in_flight[i].end - _in_flight[first].end) < 0)){
+        first = i;
+      }
+    }
+    if(first == -1){
+      return;
+    }
+    sim_byte_t b = _in_flight[first];
+    _in_flight[first] = _in_flight[--_num_in_flight];
+    hostSetTime(b.end);
+    deliver(&b);
+  }
+}
+
+// Hands a byte to every port but the one that sent it
+void SimBus::deliver(sim_byte_t *b){
+  uint8_t value;
+  int lost;
+
+  for(int i = 0; i < _num_ports; i++){
+    SimPort *port = _ports[i];
+    if(port == b->from){
+      continue;
+    }
+    value = b->value;
+    lost = 0;
+    if(b->collided || port->_baud != b->baud){
+      // Garbage, or nothing if the receiver never saw a good stop bit
+      _stats.garbled++;
+      if(random() & 1){
+        continue;
+      }
+      value = random();
+    } else if(_drop_rate > 0 && uniform() < _drop_rate){
+      _stats.dropped++;
+      continue;
+    } else if(_bit_error_rate > 0){
+      uint8_t flipped = 0;
+      for(int bit = 0; bit < 10; bit++){
+        if(uniform() < _bit_error_rate){
+          if(bit == 0 || bit == 9){
+            lost = 1;
+          } else {
+            value ^= 1 << (bit - 1);
+            flipped = 1;
+          }
+        }
+      }
+      if(lost){
+        _stats.framing_errors++;
+        continue;
+      }
+      if(flipped){
+        _stats.bit_errors++;
+      }
+    }
+    port->receive(value);
+  }
+}
+
+// The sleep hook, hands control back to run() until the task's wake time
+void SimBus::sleep(unsigned long us){
+  SimBus *bus = _running;
+  sim_task_t *task;
+
+  if(bus == NULL || bus->_current < 0){
+    return;
+  }
+  task = &bus->_tasks[bus->_current];
+  task->wake = bus->_now + us;
+  swapcontext(&task->ctx, &bus->_scheduler);
+}
+
+void SimBus::startTask(){
+  SimBus *bus = _running;
+  sim_task_t *task = &bus->_tasks[bus->_current];
+  task->fn(task->arg);
+  task->done = 1;
+}
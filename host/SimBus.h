@@ -0,0 +1,151 @@
+/** @file SimBus.h
+ *  @brief A simulated multi-drop serial bus to run DSerial nodes on a PC
+ *
+ *  Every node (the master and each client) is a task with its own stack,
+ *  run one at a time in simulated time order, so sketch code that blocks in
+ *  delay() or spins on millis() works as it would on a board. A task runs
+ *  until it asks for the time or sleeps, see HOST_CALL_US in Arduino.h.
+ *
+ *  The bus is a single half-duplex medium: every byte a SimPort writes
+ *  takes 10 bit times at that port's baud rate and is heard by every other
+ *  port once it has been sent. Bytes from two ports that overlap in time
+ *  collide, and a port listening at another baud rate hears garbage. On top
+ *  of that each receiver can lose bytes and get bit errors at set rates.
+ *
+ *  Usage:
+ *    SimBus bus;
+ *    SimPort master_port(bus), client_port(bus);
+ *    ...
+ *    bus.addTask(masterTask, &master);
+ *    bus.addTask(clientTask, &client);
+ *    bus.run(1000000UL); // One simulated second
+ *
+ *  Only code run from a task sees simulated time move, so set everything
+ *  up before run() and do the rest from tasks.
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#pragma once
+#include "Arduino.h"
+#include <ucontext.h>
+
+#define SIM_MAX_PORTS 128    // A master, 126 clients and a listener
+#define SIM_MAX_TASKS 128
+#define SIM_RX_BUFFER 64     // As in the Arduino core serial ports
+#define SIM_TX_BUFFER 64
+#define SIM_STACK_SIZE (64 * 1024)
+#define SIM_DEFAULT_BAUD 19200
+
+typedef void (*sim_task_fn)(void *arg);
+typedef void (*sim_isr_fn)(uint8_t c);
+
+typedef struct sim_bus_stats_st {
+  unsigned long bytes;          // Bytes put on the bus
+  unsigned long collisions;     // Bytes that overlapped another port's byte
+  unsigned long garbled;        // Received bytes lost to a collision or the
+                                // wrong baud rate
+  unsigned long bit_errors;     // Received bytes with flipped data bits
+  unsigned long framing_errors; // Received bytes lost to a bad start/stop bit
+  unsigned long dropped;        // Received bytes lost at the drop rate
+  unsigned long overflows;      // Received bytes lost to a full buffer
+} sim_bus_stats_t;
+
+// A byte on its way across the bus
+typedef struct sim_byte_st {
+  class SimPort *from;
+  unsigned long baud;
+  unsigned long start;
+  unsigned long end;
+  uint8_t value;
+  uint8_t collided;
+} sim_byte_t;
+
+typedef struct sim_task_st {
+  ucontext_t ctx;
+  char *stack;
+  sim_task_fn fn;
+  void *arg;
+  unsigned long wake;
+  unsigned long order;  // Ties on wake go in the order tasks went to sleep
+  uint8_t done;
+} sim_task_t;
+
+class SimBus;
+
+/** @brief A serial port on a SimBus, with NeoICSerial's interface */
+class SimPort : public Stream {
+  public:
+    SimPort(SimBus &bus);
+    void begin(unsigned long baud);
+    void flushOutput();
+    void attachInterrupt(sim_isr_fn isr);
+    unsigned long getBaud();
+
+    size_t write(uint8_t c);
+    int available();
+    int read();
+    int peek();
+
+  private:
+    friend class SimBus;
+    void receive(uint8_t c);
+
+    SimBus   &_bus;
+    unsigned long _baud;
+    unsigned long _tx_free;  // When everything written so far is sent
+    sim_isr_fn _isr;
+    uint8_t   _rx[SIM_RX_BUFFER];
+    uint8_t   _rx_head;
+    uint8_t   _rx_count;
+};
+
+class SimBus {
+  public:
+    SimBus(uint32_t seed = 1);
+    ~SimBus();
+    int addTask(sim_task_fn fn, void *arg);
+    int currentTask();
+    void run(unsigned long us);
+    unsigned long now();
+
+    void setBitErrorRate(double rate);
+    void setDropRate(double rate);
+    void getStats(sim_bus_stats_t *stats);
+    void resetStats();
+    uint32_t random();
+
+  private:
+    friend class SimPort;
+    void attach(SimPort *port);
+    void transmit(SimPort *from, uint8_t c);
+    void deliverUntil(unsigned long t);
+    void deliver(sim_byte_t *b);
+    double uniform();
+    int before(int a, int b);
+    void pushTask(int index);
+    int popTask();
+
+    static void sleep(unsigned long us);
+    static void startTask();
+    static SimBus *_running;
+
+    unsigned long _now;
+    uint32_t  _seed;
+    double    _bit_error_rate;
+    double    _drop_rate;
+    sim_bus_stats_t _stats;
+
+    SimPort  *_ports[SIM_MAX_PORTS];
+    int       _num_ports;
+    sim_byte_t _in_flight[SIM_MAX_PORTS * SIM_TX_BUFFER];
+    int       _num_in_flight;
+
+    sim_task_t _tasks[SIM_MAX_TASKS];
+    int       _num_tasks;
+    int       _current;      // Task running, -1 for none
+    int       _queue[SIM_MAX_TASKS]; // Tasks not running or done, a heap
+    int       _queue_len;    // ordered by when they wake up
+    unsigned long _order;
+    ucontext_t _scheduler;
+};
@@ -0,0 +1,60 @@
+/** @file Wire.cpp
+ *  @brief The transfer log behind the host Wire.h
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#include "Wire.h"
+
+TwoWire Wire;
+
+TwoWire::TwoWire(){
+  memset(&_current, 0, sizeof(_current));
+  clearLog();
+}
+
+void TwoWire::begin(){
+}
+
+/** @brief starts a transfer to a device
+ *
+ *  @param addr  The 7 bit address of the device
+ */
+void TwoWire::beginTransmission(uint8_t addr){
+  _current.addr = addr;
+  _current.len = 0;
+}
+
+/** @brief adds a byte to the transfer
+ *
+ *  @param c  The byte
+ *  @return 1, or 0 once WIRE_BUFFER_LENGTH bytes are in
+ */
+size_t TwoWire::write(uint8_t c){
+  if(_current.len >= WIRE_BUFFER_LENGTH){
+    return 0;
+  }
+  _current.data[_current.len++] = c;
+  return 1;
+}
+
+/** @brief ends the transfer, and keeps it in the log
+ *
+ *  @return 0, the device always ACKs
+ */
+uint8_t TwoWire::endTransmission(){
+  if(transfers < WIRE_LOG_SIZE){
+    log[transfers] = _current;
+  }
+  if(transfers < 0xFF){
+    transfers++;
+  }
+  return 0;
+}
+
+/** @brief forgets every transfer so far
+ */
+void TwoWire::clearLog(){
+  memset(log, 0, sizeof(log));
+  transfers = 0;
+}
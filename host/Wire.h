@@ -0,0 +1,38 @@
+/** @file Wire.h
+ *  @brief Just enough of the Wire library to build the displays on a PC
+ *
+ *  Nothing is on the other end. Every transfer is kept in Wire.log, as far
+ *  as there is room, for a test to check what went out.
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#pragma once
+#include "Arduino.h"
+
+#define WIRE_BUFFER_LENGTH 32 // Most bytes in one transfer, as on an AVR
+#define WIRE_LOG_SIZE 16
+
+typedef struct {
+  uint8_t addr;
+  uint8_t len;
+  uint8_t data[WIRE_BUFFER_LENGTH];
+} wire_transfer_t;
+
+class TwoWire {
+  public:
+    TwoWire();
+    void begin();
+    void beginTransmission(uint8_t addr);
+    size_t write(uint8_t c);
+    uint8_t endTransmission();
+    void clearLog();
+
+    wire_transfer_t log[WIRE_LOG_SIZE];
+    uint8_t transfers; // Ended since clearLog, more than the log can hold
+
+  private:
+    wire_transfer_t _current;
+};
+
+extern TwoWire Wire;
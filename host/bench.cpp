@@ -0,0 +1,373 @@
+/** @file bench.cpp
+ *  @brief DSerial throughput and latency benchmarks on a SimBus
+ *
+ *  Runs a master and clients for every combination of the baud rates,
+ *  client counts, error rates and loads given, and prints one CSV line per
+ *  run (with a header first) so runs before and after a protocol change
+ *  can be compared. Progress goes to stderr.
+ *
+ *  Every client sends the master a message every interval and the master
+ *  sends every client one at the same rate, an interval of 0 keeps every
+ *  queue full to find the most the bus can carry. Messages carry the time
+ *  they were queued: "up" is clients to master (a strike reaching the
+ *  controller), "down" is master to clients. Only messages queued during
+ *  the measured time count. A sniffer on the bus counts frames, resent
+ *  polls and NAKs, and the time between polls of each client.
+ *
+ *  usage: bench [-b bauds] [-c client counts] [-e bit error rates]
+ *               [-d drop rates] [-i intervals ms] [-t seconds] [-w warmup ms]
+ *               [-s seed]
+ *  Lists are comma separated, e.g. bench -b 19200,115200 -c 1,8,126 -i 0
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#include "Arduino.h"
+#include "DSerial.h"
+#include "SimBus.h"
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#define MAX_LIST 16
+
+typedef struct scenario_st {
+  unsigned long baud;
+  int clients;
+  double bit_error_rate;
+  double drop_rate;
+  unsigned long interval_ms;
+} scenario_t;
+
+typedef struct sniffer_st {
+  unsigned long frames;
+  unsigned long bad_frames;
+  unsigned long retries;
+  unsigned long naks;
+  unsigned long polls;
+  unsigned long cycle_total_us;
+  unsigned long cycle_max_us;
+  unsigned long cycle_samples;
+  unsigned long last_poll[SIM_MAX_PORTS];
+  uint8_t awaiting[SIM_MAX_PORTS];      // Polled, no reply seen yet
+  dserial_msg_t poll[SIM_MAX_PORTS];    // Last poll to each address
+} sniffer_t;
+
+static scenario_t scenario;
+static SimBus *bus;
+static SimPort *ports[SIM_MAX_PORTS];
+static SimPort *sniff_port;
+static DSerialIsrParser *sniff_parser;
+static DSerialMaster *master;
+static DSerialClient *clients[SIM_MAX_PORTS];
+static sniffer_t sniffer;
+static int ready;
+static int found;
+static int measuring;
+static unsigned long measure_start;
+static std::vector<unsigned long> up, down;
+static unsigned long refused;
+
+// Tasks are added master first, so the running task is the port's index
+static void setBaud(unsigned long baud){
+  SimPort *port = ports[bus->currentTask()];
+  port->flushOutput();
+  port->begin(baud);
+}
+
+static void stamp(uint8_t *msg){
+  unsigned long now = micros();
+  memcpy(msg, &now, sizeof(now));
+}
+
+static void measure(std::vector<unsigned long> *latencies, const uint8_t *msg){
+  unsigned long sent;
+  memcpy(&sent, msg, sizeof(sent));
+  if(measuring && (long)(sent - measure_start) >= 0){
+    latencies->push_back(micros() - sent);
+  }
+}
+
+static int isDue(unsigned long *last_send, unsigned long now){
+  if(scenario.interval_ms == 0){
+    return 1;
+  }
+  if(now - *last_send >= scenario.interval_ms){
+    *last_send = now;
+    return 1;
+  }
+  return 0;
+}
+
+static void masterTask(void *arg){
+  uint8_t msg[MAX_DATA_LEN];
+  uint8_t len;
+  unsigned long last_send[SIM_MAX_PORTS];
+  unsigned long now;
+
+  delay(100); // Let the clients start
+  found = master->identifyClients();
+  master->negotiateBaud();
+  for(int i = 1; i <= scenario.clients; i++){
+    last_send[i] = millis();
+  }
+  ready = 1;
+  for(;;){
+    master->doSerial();
+    while(master->getData(msg, sizeof(msg), &len)){
+      measure(&up, msg);
+    }
+    now = millis();
+    for(int i = 1; i <= scenario.clients; i++){
+      if(isDue(&last_send[i], now)){
+        stamp(msg);
+        if(!master->sendData(i, msg, sizeof(unsigned long))){
+          refused++;
+        }
+      }
+    }
+  }
+}
+
+static void clientTask(void *arg){
+  DSerialClient *client = (DSerialClient *)arg;
+  uint8_t msg[MAX_DATA_LEN];
+  unsigned long last_send = millis();
+
+  for(;;){
+    client->doSerial();
+    while(client->getData(msg, sizeof(msg))){
+      measure(&down, msg);
+    }
+    if(isDue(&last_send, millis())){
+      stamp(msg);
+      if(!client->sendData(msg, sizeof(unsigned long))){
+        refused++;
+      }
+    }
+  }
+}
+
+static void snifferIsr(uint8_t c){
+  sniff_parser->receiveByte(c);
+}
+
+// Decodes everything on the bus, listening at the master's rate
+static void snifferTask(void *arg){
+  dserial_msg_t msg;
+  uint8_t addr;
+  int result;
+
+  for(;;){
+    sniff_port->begin(ports[0]->getBaud());
+    while((result = sniff_parser->readPacket(*sniff_port, &msg)) != 0){
+      if(result == -1 || msg.len < 2){
+        sniffer.bad_frames++;
+        continue;
+      }
+      sniffer.frames++;
+      addr = msg.data[0];
+      if(msg.data[1] == READ && addr < SIM_MAX_PORTS){
+        if(sniffer.awaiting[addr] && msg.len == sniffer.poll[addr].len &&
+           !memcmp(msg.data, sniffer.poll[addr].data, msg.len)){
+          sniffer.retries++;
+          continue;
+        }
+        if(sniffer.last_poll[addr] != 0){
+          unsigned long cycle = bus->now() - sniffer.last_poll[addr];
+          sniffer.cycle_total_us += cycle;
+          sniffer.cycle_samples++;
+          if(cycle > sniffer.cycle_max_us){
+            sniffer.cycle_max_us = cycle;
+          }
+        }
+        sniffer.polls++;
+        sniffer.last_poll[addr] = bus->now();
+        sniffer.awaiting[addr] = 1;
+        sniffer.poll[addr] = msg;
+      } else if(msg.data[1] == NAK){
+        sniffer.naks++;
+      } else if(msg.data[1] == ACK && addr < SIM_MAX_PORTS){
+        sniffer.awaiting[addr] = 0;
+      }
+    }
+    delayMicroseconds(HOST_CALL_US);
+  }
+}
+
+// Nearest rank percentile, in ms
+static double percentile(std::vector<unsigned long> &v, double p){
+  size_t rank;
+  if(v.empty()){
+    return 0;
+  }
+  rank = (size_t)(p * v.size() + 0.999999);
+  if(rank < 1){
+    rank = 1;
+  }
+  if(rank > v.size()){
+    rank = v.size();
+  }
+  return v[rank - 1] / 1000.0;
+}
+
+static void runScenario(double seconds, unsigned long warmup_ms,
+                        uint32_t seed){
+  sim_bus_stats_t stats;
+  unsigned long waited = 0;
+  double frames_per_msg;
+  size_t delivered;
+
+  bus = new SimBus(seed);
+  bus->setBitErrorRate(scenario.bit_error_rate);
+  bus->setDropRate(scenario.drop_rate);
+  for(int i = 0; i <= scenario.clients; i++){
+    ports[i] = new SimPort(*bus);
+  }
+  sniff_port = new SimPort(*bus);
+  sniff_parser = new DSerialIsrParser();
+  sniff_port->attachInterrupt(snifferIsr);
+
+  master = new DSerialMaster(*ports[0]);
+  master->setBaudControl(setBaud, scenario.baud);
+  bus->addTask(masterTask, NULL);
+  for(int i = 1; i <= scenario.clients; i++){
+    clients[i] = new DSerialClient(*ports[i], i);
+    clients[i]->setBaudControl(setBaud, scenario.baud);
+    bus->addTask(clientTask, clients[i]);
+  }
+  bus->addTask(snifferTask, NULL);
+
+  ready = 0;
+  measuring = 0;
+  while(!ready && waited < 60000){
+    bus->run(10000);
+    waited += 10;
+  }
+  bus->run(warmup_ms * 1000);
+
+  memset(&sniffer, 0, sizeof(sniffer));
+  bus->resetStats();
+  up.clear();
+  down.clear();
+  refused = 0;
+  measuring = 1;
+  measure_start = bus->now();
+  bus->run((unsigned long)(seconds * 1000000));
+  measuring = 0;
+
+  bus->getStats(&stats);
+  std::sort(up.begin(), up.end());
+  std::sort(down.begin(), down.end());
+  delivered = up.size() + down.size();
+  frames_per_msg = delivered ? (double)sniffer.frames / delivered : 0;
+
+  printf("%lu,%d,%d,%g,%g,%lu,%g,"
+         "%.1f,%.2f,%.2f,%.2f,%.1f,%.2f,%.2f,%.2f,"
+         "%.2f,%.2f,%lu,%.2f,%lu,%lu,%lu,%lu,%lu,%lu\n",
+         master->getBaud(), scenario.clients, found,
+         scenario.bit_error_rate, scenario.drop_rate, scenario.interval_ms,
+         seconds,
+         up.size() / seconds, percentile(up, 0.5), percentile(up, 0.99),
+         percentile(up, 1),
+         down.size() / seconds, percentile(down, 0.5), percentile(down, 0.99),
+         percentile(down, 1),
+         sniffer.cycle_samples ?
+           sniffer.cycle_total_us / 1000.0 / sniffer.cycle_samples : 0,
+         sniffer.cycle_max_us / 1000.0,
+         sniffer.frames, frames_per_msg, sniffer.retries, sniffer.naks,
+         sniffer.bad_frames, refused, stats.bytes, stats.collisions);
+  fflush(stdout);
+
+  for(int i = 1; i <= scenario.clients; i++){
+    delete clients[i];
+  }
+  delete master;
+  delete sniff_parser;
+  for(int i = 0; i <= scenario.clients; i++){
+    delete ports[i];
+  }
+  delete sniff_port;
+  delete bus;
+}
+
+// Parses a comma separated list, returns how many numbers were in it
+static int parseList(const char *list, double *values){
+  int n = 0;
+  char *end;
+
+  while(*list && n < MAX_LIST){
+    values[n++] = strtod(list, &end);
+    if(end == list){
+      return 0;
+    }
+    list = (*end == ',') ? end + 1 : end;
+  }
+  return n;
+}
+
+int main(int argc, char **argv){
+  double bauds[MAX_LIST] = {19200, 57600, 115200};
+  double counts[MAX_LIST] = {1, 4, 15, 126};
+  double bit_errors[MAX_LIST] = {0, 0.0001};
+  double drops[MAX_LIST] = {0};
+  double intervals[MAX_LIST] = {100};
+  int num_bauds = 3, num_counts = 4, num_bit_errors = 2, num_drops = 1;
+  int num_intervals = 1;
+  double seconds = 2;
+  unsigned long warmup_ms = 200;
+  uint32_t seed = 1;
+  int opt;
+
+  while((opt = getopt(argc, argv, "b:c:e:d:i:t:w:s:")) != -1){
+    switch(opt){
+      case 'b': num_bauds = parseList(optarg, bauds); break;
+      case 'c': num_counts = parseList(optarg, counts); break;
+      case 'e': num_bit_errors = parseList(optarg, bit_errors); break;
+      case 'd': num_drops = parseList(optarg, drops); break;
+      case 'i': num_intervals = parseList(optarg, intervals); break;
+      case 't': seconds = atof(optarg); break;
+      case 'w': warmup_ms = strtoul(optarg, NULL, 10); break;
+      case 's': seed = strtoul(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "usage: %s [-b bauds] [-c client counts] "
+                "[-e bit error rates] [-d drop rates] [-i intervals ms] "
+                "[-t seconds] [-w warmup ms] [-s seed]\n", argv[0]);
+        return 1;
+    }
+  }
+  for(int i = 0; i < num_counts; i++){
+    if(counts[i] < 1 || counts[i] > MAX_CLIENTS - 1){
+      fprintf(stderr, "client counts must be between 1 and %d\n",
+              MAX_CLIENTS - 1);
+      return 1;
+    }
+  }
+
+  printf("baud,clients,found,bit_error_rate,drop_rate,interval_ms,seconds,"
+         "up_msgs_per_s,up_p50_ms,up_p99_ms,up_max_ms,"
+         "down_msgs_per_s,down_p50_ms,down_p99_ms,down_max_ms,"
+         "poll_cycle_avg_ms,poll_cycle_max_ms,frames,frames_per_msg,"
+         "retries,naks,bad_frames,refused,bus_bytes,collisions\n");
+  for(int b = 0; b < num_bauds; b++){
+    for(int c = 0; c < num_counts; c++){
+      for(int e = 0; e < num_bit_errors; e++){
+        for(int d = 0; d < num_drops; d++){
+          for(int i = 0; i < num_intervals; i++){
+            scenario.baud = bauds[b];
+            scenario.clients = counts[c];
+            scenario.bit_error_rate = bit_errors[e];
+            scenario.drop_rate = drops[d];
+            scenario.interval_ms = intervals[i];
+            fprintf(stderr, "%lu baud, %d clients, bit errors %g, "
+                    "drops %g, interval %lu ms\n", scenario.baud,
+                    scenario.clients, scenario.bit_error_rate,
+                    scenario.drop_rate, scenario.interval_ms);
+            runScenario(seconds, warmup_ms, seed);
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
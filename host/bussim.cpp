@@ -0,0 +1,333 @@
+/** @file bussim.cpp
+ *  @brief Runs a DSerial master and clients on a SimBus and reports traffic
+ *
+ *  Every client sends the master a message every interval, and the master
+ *  sends one to each client in turn at the same rate. Messages carry the
+ *  time they were queued, so each side measures the latency. At the end
+ *  the master's and first client's DSerial stats are printed, and the
+ *  round trip times the master measured for each client.
+ *
+ *  With -l each pass of a client's loop also takes a random time up to the
+ *  given ms, as a module that updates a display between calls to doSerial
+ *  would.
+ *
+ *  With -k client 1 stops answering for the given ms, STALL_AT_MS into the
+ *  run, just as the master queues a message for it. It should be dropped
+ *  and taken back once it answers a probe again. From then on the master
+ *  queues nothing more for it, and every message it queued for client 1
+ *  has to arrive by the end of the run, or the exit status is 1. Messages
+ *  taken twice (a write the client got, and then got again with a fresh
+ *  SEQ after the resync) are counted, but do not fail the run.
+ *
+ *  With -w the master polls with a DSerialTdmaScheduler that has the given
+ *  number of write slots per cycle, and slots of slotLength for the rate
+ *  negotiated. The clients only start sending a cycle after it took over,
+ *  once the first poll in each slot has synced the client's link. If
+ *  nothing is lost or slowed down on the way, and a client sends at most
+ *  one message per cycle, the longest a message takes to reach the master
+ *  must be within worstCaseLatency, or the exit status is 1.
+ *
+ *  usage: bussim [-c clients] [-b max baud] [-e bit error rate]
+ *                [-d drop rate] [-i interval ms] [-l client loop ms]
+ *                [-k client 1 stall ms] [-w TDMA write slots]
+ *                [-t seconds] [-s seed]
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#include "Arduino.h"
+#include "DSerial.h"
+#include "SimBus.h"
+#include <unistd.h>
+
+#define STALL_AT_MS 1000
+#define MAX_TO_1 4096 // Messages to client 1 that are told apart
+
+typedef struct latency_st {
+  unsigned long count;
+  unsigned long total_us;
+  unsigned long max_us;
+} latency_t;
+
+static SimBus *bus;
+static SimPort *ports[SIM_MAX_PORTS];
+static DSerialMaster *master;
+static DSerialClient *clients[SIM_MAX_PORTS];
+static int num_clients = 4;
+static unsigned long max_baud = 19200;
+static unsigned long interval_ms = 50;
+static unsigned long loop_us = 0; // Most a client's loop takes, besides DSerial
+static latency_t to_master, to_clients;
+static unsigned long found_clients;
+static int write_slots;            // TDMA write slots, 0 for the default
+static int tdma_started;           // Clients only send once it has
+static unsigned long tdma_micros;  // When TDMA took over
+static unsigned long stall_ms;     // How long client 1 stops for, 0 never
+static unsigned long stall_millis; // When it stopped, 0 until then
+static uint16_t sent_to_1, got_by_1, twice_by_1;
+static uint8_t got_1[MAX_TO_1 / 8];
+static int known_1;               // Client 1 was in the list at the stall
+static int lost_1, joined_1;      // Events about client 1
+
+// Tasks are added master first, so the running task is the port's index
+static void setBaud(unsigned long baud){
+  SimPort *port = ports[bus->currentTask()];
+  port->flushOutput();
+  port->begin(baud);
+}
+
+static void stamp(uint8_t *msg){
+  unsigned long now = micros();
+  memcpy(msg, &now, sizeof(now));
+}
+
+// Queues a stamped message for client 1, numbered so it can tell them apart
+static int sendTo1(uint8_t *msg){
+  stamp(msg);
+  memcpy(msg + sizeof(unsigned long), &sent_to_1, sizeof(sent_to_1));
+  if(sent_to_1 >= MAX_TO_1 ||
+     !master->sendData(1, msg, sizeof(unsigned long) + sizeof(sent_to_1))){
+    return 0;
+  }
+  sent_to_1++;
+  return 1;
+}
+
+// Client 1 took a message from sendTo1
+static void gotBy1(const uint8_t *msg){
+  uint16_t n;
+  memcpy(&n, msg + sizeof(unsigned long), sizeof(n));
+  if(n >= MAX_TO_1){
+    return;
+  }
+  if(got_1[n / 8] & (1 << (n % 8))){
+    twice_by_1++;
+  } else {
+    got_1[n / 8] |= 1 << (n % 8);
+    got_by_1++;
+  }
+}
+
+static void measure(latency_t *latency, const uint8_t *msg){
+  unsigned long sent;
+  unsigned long took;
+  memcpy(&sent, msg, sizeof(sent));
+  took = micros() - sent;
+  latency->count++;
+  latency->total_us += took;
+  if(took > latency->max_us){
+    latency->max_us = took;
+  }
+}
+
+static void masterTask(void *arg){
+  uint8_t msg[MAX_DATA_LEN];
+  uint8_t len;
+  uint8_t client_id;
+  unsigned long start;
+  unsigned long last_send;
+  int event;
+  int next = 0;
+  DSerialTdmaScheduler *tdma = NULL;
+
+  delay(100); // Let the clients start
+  found_clients = master->identifyClients();
+  master->negotiateBaud();
+  if(write_slots > 0){
+    unsigned long slot = DSerialTdmaScheduler::slotLength(master->getBaud());
+    tdma = new DSerialTdmaScheduler(slot, write_slots);
+    master->setScheduler(tdma);
+    tdma_micros = micros();
+  }
+  start = millis();
+  last_send = start;
+  for(;;){
+    master->doSerial();
+    // Every client's first slot goes on the SYN for its link
+    if(tdma != NULL && !tdma_started &&
+       micros() - tdma_micros >= tdma->cycleLength()){
+      tdma_started = 1;
+    }
+    while(master->getData(msg, sizeof(msg), &len)){
+      measure(&to_master, msg);
+    }
+    while((event = master->getEvent(&client_id)) != EVENT_NONE){
+      lost_1 += (client_id == 1 && event == EVENT_CLIENT_LOST);
+      joined_1 += (client_id == 1 && event == EVENT_CLIENT_JOINED);
+    }
+    // Client 1 stops with a message waiting for it
+    if(stall_ms > 0 && stall_millis == 0 &&
+       millis() - start >= STALL_AT_MS && sendTo1(msg)){
+      known_1 = master->getClients(NULL) == (int)found_clients &&
+                found_clients == (unsigned long)num_clients;
+      stall_millis = millis();
+    }
+    if(millis() - last_send >= interval_ms / num_clients + 1){
+      last_send = millis();
+      if(next == 0){
+        if(stall_millis == 0){ // Nothing more for client 1 after the stall
+          sendTo1(msg);
+        }
+      } else {
+        stamp(msg);
+        master->sendData(next + 1, msg, sizeof(unsigned long));
+      }
+      next = (next + 1) % num_clients;
+    }
+  }
+}
+
+static void clientTask(void *arg){
+  DSerialClient *client = (DSerialClient *)arg;
+  uint8_t msg[MAX_DATA_LEN];
+  unsigned long last_send = millis();
+
+  for(;;){
+    if(client == clients[1] && stall_millis != 0 &&
+       millis() - stall_millis < stall_ms){
+      delay(1);
+      continue;
+    }
+    client->doSerial();
+    while(client->getData(msg, sizeof(msg))){
+      measure(&to_clients, msg);
+      if(client == clients[1]){
+        gotBy1(msg);
+      }
+    }
+    if(millis() - last_send >= interval_ms){
+      last_send = millis();
+      stamp(msg);
+      if(write_slots == 0 || tdma_started){
+        client->sendData(msg, sizeof(unsigned long));
+      }
+    }
+    if(loop_us > 0){
+      delayMicroseconds(bus->random() % loop_us);
+    }
+  }
+}
+
+static void reportStats(const char *name, dserial_stats_t *stats){
+  printf("%-10s %lu frames in, %lu out, %u bad, %u timeouts, %u retries, "
+         "%u NAKs, queues up to %u in %u out\n", name,
+         (unsigned long)stats->frames_in, (unsigned long)stats->frames_out,
+         stats->bad_frames, stats->timeouts, stats->retries, stats->naks,
+         stats->in_high, stats->out_high);
+}
+
+static void report(const char *name, latency_t *latency, double seconds){
+  printf("%-10s %8lu msgs %8.1f msgs/s  latency avg %7.2f ms max %7.2f ms\n",
+         name, latency->count, latency->count / seconds,
+         latency->count ? latency->total_us / 1000.0 / latency->count : 0,
+         latency->max_us / 1000.0);
+}
+
+int main(int argc, char **argv){
+  double bit_error_rate = 0;
+  double drop_rate = 0;
+  double seconds = 5;
+  uint32_t seed = 1;
+  sim_bus_stats_t stats;
+  dserial_stats_t dserial_stats;
+  dserial_rtt_stats_t rtt;
+  int opt;
+
+  while((opt = getopt(argc, argv, "c:b:e:d:i:l:k:w:t:s:")) != -1){
+    switch(opt){
+      case 'c': num_clients = atoi(optarg); break;
+      case 'b': max_baud = strtoul(optarg, NULL, 10); break;
+      case 'e': bit_error_rate = atof(optarg); break;
+      case 'd': drop_rate = atof(optarg); break;
+      case 'i': interval_ms = strtoul(optarg, NULL, 10); break;
+      case 'l': loop_us = atof(optarg) * 1000; break;
+      case 'k': stall_ms = strtoul(optarg, NULL, 10); break;
+      case 'w': write_slots = atoi(optarg); break;
+      case 't': seconds = atof(optarg); break;
+      case 's': seed = strtoul(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "usage: %s [-c clients] [-b max baud] "
+                "[-e bit error rate] [-d drop rate] [-i interval ms] "
+                "[-l client loop ms] [-k client 1 stall ms] "
+                "[-w TDMA write slots] [-t seconds] [-s seed]\n", argv[0]);
+        return 1;
+    }
+  }
+  if(num_clients < 1 || num_clients > MAX_CLIENTS - 1){
+    fprintf(stderr, "clients must be between 1 and %d\n", MAX_CLIENTS - 1);
+    return 1;
+  }
+
+  bus = new SimBus(seed);
+  bus->setBitErrorRate(bit_error_rate);
+  bus->setDropRate(drop_rate);
+  for(int i = 0; i <= num_clients; i++){
+    ports[i] = new SimPort(*bus);
+  }
+  master = new DSerialMaster(*ports[0]);
+  master->setBaudControl(setBaud, max_baud);
+  bus->addTask(masterTask, NULL);
+  for(int i = 1; i <= num_clients; i++){
+    clients[i] = new DSerialClient(*ports[i], i);
+    clients[i]->setBaudControl(setBaud, max_baud);
+    bus->addTask(clientTask, clients[i]);
+  }
+
+  bus->run((unsigned long)(seconds * 1000000));
+
+  bus->getStats(&stats);
+  printf("%d clients, %lu found, %lu baud, %.1f s\n", num_clients,
+         found_clients, master->getBaud(), seconds);
+  report("to master", &to_master, seconds);
+  report("to clients", &to_clients, seconds);
+  master->getStats(&dserial_stats);
+  reportStats("master", &dserial_stats);
+  clients[1]->getStats(&dserial_stats);
+  reportStats("client 1", &dserial_stats);
+  printf("rtt (us)   ");
+  for(int i = 1; i <= num_clients; i++){
+    if(master->getClientRtt(i, &rtt)){
+      printf(" %d: %u/%u/%u", i, rtt.min_us, rtt.avg_us, rtt.max_us);
+    }
+  }
+  printf("  (min/avg/max)\n");
+  printf("bus: %lu bytes, %lu collisions, %lu garbled, %lu bit errors, "
+         "%lu framing errors, %lu dropped, %lu overflows\n",
+         stats.bytes, stats.collisions, stats.garbled, stats.bit_errors,
+         stats.framing_errors, stats.dropped, stats.overflows);
+  if(write_slots > 0){
+    unsigned long baud = master->getBaud();
+    unsigned long cycle = DSerialTdmaScheduler::slotLength(baud) *
+                          (num_clients + write_slots);
+    unsigned long bound = DSerialTdmaScheduler::worstCaseLatency(num_clients,
+                            write_slots, baud);
+    printf("TDMA: %d write slots, cycle %.2f ms, worst case to master "
+           "%.2f ms, measured %.2f ms\n", write_slots, cycle / 1000.0,
+           bound / 1000.0, to_master.max_us / 1000.0);
+    if(bit_error_rate > 0 || drop_rate > 0 || loop_us > 0 || stall_ms > 0 ||
+       interval_ms * 1000 < cycle){
+      printf("(not checked, messages can be lost, late or queued behind "
+             "others)\n");
+    } else if(to_master.count == 0 || to_master.max_us > bound){
+      printf("FAIL\n");
+      return 1;
+    } else {
+      printf("PASS\n");
+    }
+  }
+  if(stall_ms > 0){
+    printf("client 1 stalled for %lu ms: dropped %d times, taken back %d "
+           "times, got %u of the %u messages queued for it (%u twice)\n",
+           stall_ms, lost_1, joined_1, got_by_1, sent_to_1, twice_by_1);
+    if(!known_1){
+      printf("FAIL: not every client was found before the stall\n");
+      return 1;
+    }
+    if(lost_1 == 0 || joined_1 == 0 || got_by_1 != sent_to_1){
+      printf("FAIL\n");
+      return 1;
+    }
+    printf("PASS\n");
+  }
+  return 0;
+}
@@ -0,0 +1,230 @@
+/** @file cost.cpp
+ *  @brief Measures what a call to doSerial costs: heap allocations and time
+ *
+ *  A master and clients are wired together with a loopback bus that hands
+ *  every byte written straight to every other node, so nothing but DSerial
+ *  runs inside a call and everything counted is its own. Allocations are
+ *  counted by a malloc/calloc/realloc hook (operator new goes through
+ *  malloc), while a doSerial call is running. Time is the host's monotonic
+ *  clock, so only compare runs made on the same machine.
+ *
+ *  Calls are measured with the bus idle (polls with nothing to carry) and
+ *  busy (every client and the master queueing a message whenever there is
+ *  room), and doSerial should never allocate in either.
+ *
+ *  usage: cost [-c clients] [-n calls per phase]
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#include "Arduino.h"
+#include "DSerial.h"
+#include <time.h>
+#include <unistd.h>
+
+#define LOOP_MAX_PORTS 16
+#define LOOP_RX_BUFFER 1024
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static int counting;
+static unsigned long allocations;
+
+extern "C" void *malloc(size_t size){
+  allocations += counting;
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size){
+  allocations += counting;
+  return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size){
+  allocations += counting;
+  return __libc_realloc(ptr, size);
+}
+
+/** @brief A port on a bus with no wire, bytes arrive as they are written */
+class LoopPort : public Stream {
+  public:
+    LoopPort(){
+      _head = 0;
+      _count = 0;
+      ports[num_ports++] = this;
+    }
+
+    size_t write(uint8_t c){
+      for(int i = 0; i < num_ports; i++){
+        if(ports[i] != this){
+          ports[i]->receive(c);
+        }
+      }
+      return 1;
+    }
+
+    int available(){ return _count; }
+
+    int read(){
+      int c = peek();
+      if(_count > 0){
+        _head = (_head + 1) % LOOP_RX_BUFFER;
+        _count--;
+      }
+      return c;
+    }
+
+    int peek(){
+      return _count > 0 ? _rx[_head] : -1;
+    }
+
+    static LoopPort *ports[LOOP_MAX_PORTS];
+    static int num_ports;
+
+  private:
+    void receive(uint8_t c){
+      if(_count < LOOP_RX_BUFFER){
+        _rx[(_head + _count) % LOOP_RX_BUFFER] = c;
+        _count++;
+      }
+    }
+
+    uint8_t   _rx[LOOP_RX_BUFFER];
+    int       _head;
+    int       _count;
+};
+
+LoopPort *LoopPort::ports[LOOP_MAX_PORTS];
+int LoopPort::num_ports = 0;
+
+typedef struct cost_st {
+  unsigned long calls;
+  unsigned long allocations;
+  unsigned long long total_ns;
+  unsigned long max_ns;
+} cost_t;
+
+static DSerialMaster *master;
+static DSerialClient *clients[LOOP_MAX_PORTS];
+static int num_clients = 4;
+static unsigned long sim_us;
+static int in_hook;
+
+static unsigned long long nowNs(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// While the master discovers clients, they run whenever it sleeps
+static void runClients(unsigned long us){
+  sim_us += us;
+  hostSetTime(sim_us);
+  if(in_hook){
+    return;
+  }
+  in_hook = 1;
+  for(int i = 1; i <= num_clients; i++){
+    clients[i]->doSerial();
+  }
+  in_hook = 0;
+}
+
+// Times one doSerial, counting what it allocates
+template<class NODE>
+static void timedCall(NODE *node, cost_t *cost){
+  unsigned long long start;
+  unsigned long ns;
+
+  allocations = 0;
+  counting = 1;
+  start = nowNs();
+  node->doSerial();
+  ns = nowNs() - start;
+  counting = 0;
+  cost->calls++;
+  cost->allocations += allocations;
+  cost->total_ns += ns;
+  if(ns > cost->max_ns){
+    cost->max_ns = ns;
+  }
+}
+
+static void report(const char *phase, const char *node, cost_t *cost){
+  printf("%-6s %-8s %9lu %12.3f %9.0f %9lu\n", phase, node, cost->calls,
+         (double)cost->allocations / cost->calls,
+         (double)cost->total_ns / cost->calls, cost->max_ns);
+}
+
+static void runPhase(const char *phase, unsigned long calls, int busy){
+  cost_t master_cost, client_cost;
+  uint8_t msg[MAX_DATA_LEN];
+  uint8_t len;
+
+  memset(&master_cost, 0, sizeof(master_cost));
+  memset(&client_cost, 0, sizeof(client_cost));
+  memset(msg, 0x5A, sizeof(msg));
+  for(unsigned long n = 0; n < calls; n++){
+    if(busy){
+      master->sendData(n % num_clients + 1, msg, 4);
+      for(int i = 1; i <= num_clients; i++){
+        clients[i]->sendData(msg, 4);
+      }
+    }
+    timedCall(master, &master_cost);
+    for(int i = 1; i <= num_clients; i++){
+      timedCall(clients[i], &client_cost);
+    }
+    while(master->getData(msg, sizeof(msg), &len));
+    for(int i = 1; i <= num_clients; i++){
+      while(clients[i]->getData(msg, sizeof(msg)));
+    }
+  }
+  report(phase, "master", &master_cost);
+  report(phase, "client", &client_cost);
+}
+
+int main(int argc, char **argv){
+  unsigned long calls = 200000;
+  int found;
+  int opt;
+
+  while((opt = getopt(argc, argv, "c:n:")) != -1){
+    switch(opt){
+      case 'c': num_clients = atoi(optarg); break;
+      case 'n': calls = strtoul(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "usage: %s [-c clients] [-n calls per phase]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if(num_clients < 1 || num_clients > LOOP_MAX_PORTS - 1){
+    fprintf(stderr, "clients must be between 1 and %d\n",
+            LOOP_MAX_PORTS - 1);
+    return 1;
+  }
+
+  LoopPort *master_port = new LoopPort();
+  master = new DSerialMaster(*master_port);
+  for(int i = 1; i <= num_clients; i++){
+    clients[i] = new DSerialClient(*new LoopPort(), i);
+  }
+  hostSetSleepHook(runClients);
+  found = master->identifyClients();
+  hostSetSleepHook(NULL);
+  if(found != num_clients){
+    fprintf(stderr, "found %d of %d clients\n", found, num_clients);
+    return 1;
+  }
+
+  printf("%d clients, %lu calls of each node per phase\n\n", num_clients,
+         calls);
+  printf("%-6s %-8s %9s %12s %9s %9s\n", "phase", "node", "calls",
+         "allocs/call", "ns/call", "max ns");
+  runPhase("idle", calls, 0);
+  runPhase("busy", calls, 1);
+  return 0;
+}
@@ -0,0 +1,211 @@
+/** @file crccheck.cpp
+ *  @brief Compares the CRC-8 DSerial checks packets with to the old parity
+ *
+ *  Random messages of 2 to MAX_MSG_LEN bytes get their check byte and then
+ *  errors, and each check is asked whether the damaged message is still
+ *  good. A yes is a miss. The errors are a number of bits flipped anywhere
+ *  in the message and check byte, and bursts: a run of bits whose first
+ *  and last are flipped and the ones between at random.
+ *
+ *  The old check (before the COBS framing) XORed the bytes of a message
+ *  and only compared the low 7 bits, so it misses any error that flips the
+ *  same bit position an even number of times, and every error in bit 7.
+ *
+ *  Each check is also timed over a buffer of messages, in ns per byte of
+ *  the PC, so only compare runs made on the same machine.
+ *
+ *  The CRC should miss no burst of up to 8 bits, and nothing of up to 3
+ *  bits in a message of up to CRC8_FULL_LEN bytes (the "short" column). In
+ *  longer messages two flips 127 bits apart cancel out. If it misses one of
+ *  these the exit status is 1.
+ *
+ *  usage: crccheck [-n messages per error] [-s seed]
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#include "Arduino.h"
+#include "DSerial.h"
+#include "crc8.h"
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_FLIPS 4
+#define CRC8_FULL_LEN 14 // Longest message the CRC has distance 4 over
+#define TIMING_BYTES 65536
+#define TIMING_PASSES 200
+
+// Burst lengths tried, in bits
+static const int bursts[] = {2, 4, 8, 9, 12, 16};
+
+typedef uint8_t (*check_fn)(const uint8_t *data, uint8_t len);
+
+static uint32_t seed = 1;
+
+static uint32_t nextRandom(){
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static unsigned long long nowNs(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The old check byte, XOR of the message in 7 bits
+static uint8_t parity(const uint8_t *data, uint8_t len){
+  uint8_t p = 0;
+  while(len--){
+    p ^= *data++;
+  }
+  return p & 0x7F;
+}
+
+static int parityGood(const uint8_t *data, uint8_t len){
+  return ((parity(data, len) ^ data[len]) & 0x7F) == 0;
+}
+
+static int crcGood(const uint8_t *data, uint8_t len){
+  return crc8(data, len + 1) == 0;
+}
+
+static void flipBit(uint8_t *data, unsigned bit){
+  data[bit / 8] ^= 0x80 >> (bit % 8);
+}
+
+// A message of len bytes followed by its check byte
+static uint8_t makeMessage(uint8_t *data, check_fn check){
+  uint8_t len = 2 + nextRandom() % (MAX_MSG_LEN - 1);
+  for(uint8_t i = 0; i < len; i++){
+    data[i] = nextRandom();
+  }
+  data[len] = check(data, len);
+  return len;
+}
+
+static void flipRandom(uint8_t *data, uint8_t len, int flips){
+  unsigned bits = (len + 1) * 8;
+  unsigned picked[MAX_FLIPS];
+  for(int i = 0; i < flips; i++){
+    unsigned bit;
+    int again;
+    do {
+      bit = nextRandom() % bits;
+      again = 0;
+      for(int j = 0; j < i; j++){
+        again |= picked[j] == bit;
+      }
+    } while(again);
+    picked[i] = bit;
+    flipBit(data, bit);
+  }
+}
+
+static void flipBurst(uint8_t *data, uint8_t len, int burst){
+  unsigned start = nextRandom() % ((len + 1) * 8 - burst + 1);
+  flipBit(data, start);
+  flipBit(data, start + burst - 1);
+  for(int i = 1; i < burst - 1; i++){
+    if(nextRandom() & 1){
+      flipBit(data, start + i);
+    }
+  }
+}
+
+// Fraction of damaged messages a check calls good, and of the ones of up
+// to CRC8_FULL_LEN bytes if short_rate is not NULL
+static double missRate(check_fn check, int (*good)(const uint8_t *, uint8_t),
+                       int flips, int burst, unsigned long messages,
+                       double *short_rate){
+  uint8_t data[MAX_MSG_LEN + 1];
+  unsigned long missed = 0;
+  unsigned long short_messages = 0;
+  unsigned long short_missed = 0;
+  for(unsigned long n = 0; n < messages; n++){
+    uint8_t len = makeMessage(data, check);
+    if(burst){
+      flipBurst(data, len, burst);
+    } else {
+      flipRandom(data, len, flips);
+    }
+    int miss = good(data, len);
+    missed += miss;
+    if(len <= CRC8_FULL_LEN){
+      short_messages++;
+      short_missed += miss;
+    }
+  }
+  if(short_rate != NULL){
+    *short_rate = short_messages ? (double)short_missed / short_messages : 0;
+  }
+  return (double)missed / messages;
+}
+
+static double nsPerByte(check_fn check){
+  static uint8_t data[TIMING_BYTES];
+  volatile uint8_t sink = 0;
+  unsigned long long start;
+
+  for(unsigned i = 0; i < sizeof(data); i++){
+    data[i] = nextRandom();
+  }
+  start = nowNs();
+  for(int pass = 0; pass < TIMING_PASSES; pass++){
+    for(unsigned i = 0; i + MAX_MSG_LEN <= sizeof(data); i += MAX_MSG_LEN){
+      sink = sink + check(data + i, MAX_MSG_LEN);
+    }
+  }
+  return (double)(nowNs() - start) / ((double)TIMING_PASSES * sizeof(data));
+}
+
+int main(int argc, char **argv){
+  unsigned long messages = 1000000;
+  int failed = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:s:")) != -1){
+    switch(opt){
+      case 'n': messages = strtoul(optarg, NULL, 10); break;
+      case 's': seed = strtoul(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "usage: %s [-n messages per error] [-s seed]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if(messages == 0 || seed == 0){
+    fprintf(stderr, "messages and seed must not be 0\n");
+    return 1;
+  }
+
+  printf("%lu messages of 2 to %d bytes per error\n\n", messages,
+         MAX_MSG_LEN);
+  printf("%-12s %12s %12s %12s\n", "error", "parity miss", "crc8 miss",
+         "crc8 short");
+  for(int flips = 1; flips <= MAX_FLIPS; flips++){
+    double c_short;
+    double p = missRate(parity, parityGood, flips, 0, messages, NULL);
+    double c = missRate(crc8, crcGood, flips, 0, messages, &c_short);
+    printf("%d bit%-7s %12.6f %12.6f %12.6f\n", flips, flips > 1 ? "s" : "",
+           p, c, c_short);
+    failed |= flips <= 3 && c_short > 0;
+  }
+  for(unsigned i = 0; i < sizeof(bursts) / sizeof(bursts[0]); i++){
+    int burst = bursts[i];
+    double c_short;
+    double p = missRate(parity, parityGood, 0, burst, messages, NULL);
+    double c = missRate(crc8, crcGood, 0, burst, messages, &c_short);
+    printf("burst %-6d %12.6f %12.6f %12.6f\n", burst, p, c, c_short);
+    failed |= burst <= 8 && c > 0;
+  }
+
+  printf("\n%-12s %12.2f %12.2f\n", "ns/byte", nsPerByte(parity),
+         nsPerByte(crc8));
+  if(failed){
+    printf("FAIL: the CRC missed an error it should always catch\n");
+  }
+  return failed;
+}
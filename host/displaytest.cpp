@@ -0,0 +1,286 @@
+/** @file displaytest.cpp
+ *  @brief Checks that the display caches send what changed, and only that
+ *
+ *  KTANEHT16K33Cache is flushed into the host Wire.h, and the I2C
+ *  transfers are played into a copy of the HT16K33's display RAM.
+ *  KTANEPageCache renders into a stand-in for a U8g2 display in page mode,
+ *  which keeps what each sendBuffer() put on its screen. After every frame
+ *  the screen has to match the frame, and exactly the rows or pages that
+ *  changed have to have been sent. A frame that clears or lights the whole
+ *  screen has to send every page that was different, and invalidate()
+ *  every page.
+ *
+ *  usage: displaytest
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#include "Arduino.h"
+#include "KTANEDisplay.h"
+
+#define WIDTH 128
+#define MAX_HEIGHT 160
+
+static int failures;
+static const char *testing; // The display being tested, for the failures
+
+static void check(int ok, const char *what){
+  if(!ok){
+    printf("FAIL: %s: %s\n", testing, what);
+    failures++;
+  }
+}
+
+/** @brief The part of a U8G2 that KTANEPageCache uses, in page mode
+ *
+ *  Pages are tile_height rows of 8 pixels, a byte per column of 8 pixels
+ *  as the SSD1306 and ST7920 buffers have them.
+ */
+class PageScreen {
+  public:
+    PageScreen(uint8_t tile_height, uint8_t height){
+      _tile_height = tile_height;
+      _height = height;
+      _row = 0;
+      memset(_buffer, 0, sizeof(_buffer));
+      memset(_screen, 0xAA, sizeof(_screen)); // Whatever it powered up with
+      sent = 0;
+      sends = 0;
+    }
+
+    uint8_t getBufferTileHeight(){ return _tile_height; }
+    uint8_t getBufferTileWidth(){ return WIDTH / 8; }
+    uint8_t getDisplayHeight(){ return _height; }
+    uint8_t *getBufferPtr(){ return _buffer; }
+
+    void setBufferCurrTileRow(uint8_t row){
+      _row = row;
+    }
+
+    void clearBuffer(){
+      memset(_buffer, 0, sizeof(_buffer));
+    }
+
+    void sendBuffer(){
+      for(uint8_t i = 0; i < _tile_height && _row + i < _height / 8; i++){
+        memcpy(_screen[_row + i], &_buffer[i * WIDTH], WIDTH);
+      }
+      sent |= 1UL << (_row / _tile_height);
+      sends++;
+    }
+
+    // Lights a pixel if it is on the current page
+    void drawPixel(uint8_t x, uint8_t y){
+      int tile = y / 8 - _row;
+      if(tile >= 0 && tile < _tile_height){
+        _buffer[tile * WIDTH + x] |= 1 << (y % 8);
+      }
+    }
+
+    int screenPixel(uint8_t x, uint8_t y){
+      return (_screen[y / 8][x] >> (y % 8)) & 1;
+    }
+
+    uint32_t sent;  // Bit n set when page n was sent
+    uint8_t  sends;
+
+  private:
+    uint8_t   _tile_height;
+    uint8_t   _height;
+    uint8_t   _row;
+    uint8_t   _buffer[2 * WIDTH];
+    uint8_t   _screen[MAX_HEIGHT / 8][WIDTH];
+};
+
+typedef struct {
+  uint8_t height;
+  uint8_t pixels[MAX_HEIGHT][WIDTH];
+} frame_t;
+
+static void drawFrame(PageScreen &screen, void *arg){
+  frame_t *frame = (frame_t *)arg;
+  for(uint8_t y = 0; y < frame->height; y++){
+    for(uint8_t x = 0; x < WIDTH; x++){
+      if(frame->pixels[y][x]){
+        screen.drawPixel(x, y);
+      }
+    }
+  }
+}
+
+static int screenMatches(PageScreen &screen, frame_t *frame){
+  for(uint8_t y = 0; y < frame->height; y++){
+    for(uint8_t x = 0; x < WIDTH; x++){
+      if(screen.screenPixel(x, y) != frame->pixels[y][x]){
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// Renders a frame and checks the screen shows it, returns the pages sent
+static uint32_t renderFrame(KTANEPageCache<PageScreen> &cache,
+                            PageScreen &screen, frame_t *frame){
+  uint8_t sent;
+
+  screen.sent = 0;
+  screen.sends = 0;
+  sent = cache.render(drawFrame, frame);
+  check(sent == screen.sends, "render() counts the pages it sent");
+  check(screenMatches(screen, frame), "the screen shows the frame");
+  return screen.sent;
+}
+
+static void testPages(uint8_t tile_height){
+  static frame_t frame;
+  PageScreen screen(tile_height, 64);
+  KTANEPageCache<PageScreen> cache(screen);
+  uint8_t pages = 64 / 8 / tile_height;
+  uint32_t all = (1UL << pages) - 1;
+  uint32_t page_of_y[64];
+  uint32_t sent;
+
+  testing = (tile_height == 1) ? "U8g2, 1 tile row per page" :
+                                  "U8g2, 2 tile rows per page";
+  for(uint8_t y = 0; y < 64; y++){
+    page_of_y[y] = 1UL << (y / 8 / tile_height);
+  }
+  memset(&frame, 0, sizeof(frame));
+  frame.height = 64;
+  frame.pixels[3][10] = 1;
+  frame.pixels[20][100] = 1;
+
+  sent = renderFrame(cache, screen, &frame);
+  check(sent == all, "the first frame sends every page");
+  sent = renderFrame(cache, screen, &frame);
+  check(sent == 0, "the same frame again sends nothing");
+
+  frame.pixels[45][7] = 1;
+  sent = renderFrame(cache, screen, &frame);
+  check(sent == page_of_y[45], "a pixel sends only its page");
+
+  frame.pixels[20][100] = 0; // Moves to another page
+  frame.pixels[60][100] = 1;
+  sent = renderFrame(cache, screen, &frame);
+  check(sent == (page_of_y[20] | page_of_y[60]),
+        "a pixel that moved sends the page it left and the one it is on");
+
+  memset(frame.pixels, 0, sizeof(frame.pixels));
+  sent = renderFrame(cache, screen, &frame);
+  check(sent == (page_of_y[3] | page_of_y[45] | page_of_y[60]),
+        "a clear frame sends the pages that had anything on");
+
+  memset(frame.pixels, 1, sizeof(frame.pixels));
+  sent = renderFrame(cache, screen, &frame);
+  check(sent == all, "a lit frame after a clear one sends every page");
+
+  memset(frame.pixels, 0, sizeof(frame.pixels));
+  sent = renderFrame(cache, screen, &frame);
+  check(sent == all, "a clear frame after a lit one sends every page");
+
+  cache.invalidate();
+  sent = renderFrame(cache, screen, &frame);
+  check(sent == all, "invalidate() sends every page");
+}
+
+// Pages past KTANE_MAX_PAGES have no CRC kept, they always go
+static void testTallScreen(){
+  static frame_t frame;
+  PageScreen screen(1, MAX_HEIGHT);
+  KTANEPageCache<PageScreen> cache(screen);
+  uint8_t pages = MAX_HEIGHT / 8;
+  uint32_t past = ((1UL << pages) - 1) & ~((1UL << KTANE_MAX_PAGES) - 1);
+  uint32_t sent;
+
+  testing = "U8g2, 20 pages";
+  memset(&frame, 0, sizeof(frame));
+  frame.height = MAX_HEIGHT;
+  frame.pixels[5][5] = 1;
+  frame.pixels[MAX_HEIGHT - 1][5] = 1;
+  renderFrame(cache, screen, &frame);
+  sent = renderFrame(cache, screen, &frame);
+  check(sent == past, "pages past KTANE_MAX_PAGES are always sent");
+}
+
+// Plays the logged transfers into a copy of the HT16K33 display RAM
+static void playTransfers(uint8_t addr, uint8_t *ram){
+  for(uint8_t i = 0; i < Wire.transfers && i < WIRE_LOG_SIZE; i++){
+    wire_transfer_t *transfer = &Wire.log[i];
+    check(transfer->addr == addr && transfer->len >= 1,
+          "every transfer goes to the display with a RAM address");
+    for(uint8_t j = 1; j < transfer->len && transfer->addr == addr; j++){
+      ram[(transfer->data[0] + j - 1) % (2 * HT16K33_ROWS)] =
+        transfer->data[j];
+    }
+  }
+}
+
+// Flushes, checks the display RAM matches the buffer, returns rows sent
+static uint8_t flushRows(KTANEHT16K33Cache &cache, uint16_t *buffer,
+                         uint8_t *ram){
+  uint8_t sent;
+  int matches = 1;
+
+  Wire.clearLog();
+  sent = cache.flush();
+  playTransfers(0x70, ram);
+  for(uint8_t i = 0; i < HT16K33_ROWS; i++){
+    matches &= ram[2 * i] == (buffer[i] & 0xFF) &&
+               ram[2 * i + 1] == buffer[i] >> 8;
+  }
+  check(matches, "the display shows the frame");
+  return sent;
+}
+
+static void testRows(){
+  uint16_t buffer[HT16K33_ROWS];
+  uint8_t ram[2 * HT16K33_ROWS];
+  KTANEHT16K33Cache cache(buffer, 0x70);
+  uint8_t sent;
+
+  testing = "HT16K33";
+  memset(buffer, 0, sizeof(buffer));
+  memset(ram, 0xAA, sizeof(ram)); // Whatever it powered up with
+  buffer[1] = 0x1234;
+  sent = flushRows(cache, buffer, ram);
+  check(sent == HT16K33_ROWS && Wire.transfers == 1,
+        "the first flush sends every row in one transfer");
+  sent = flushRows(cache, buffer, ram);
+  check(sent == 0 && Wire.transfers == 0, "the same frame sends nothing");
+
+  buffer[2] = 0x00FF;
+  buffer[6] = 0xFF00;
+  sent = flushRows(cache, buffer, ram);
+  check(sent == 2 && Wire.transfers == 2,
+        "two rows apart go in a transfer each");
+  buffer[3] = 0x0101;
+  buffer[4] = 0x0202;
+  sent = flushRows(cache, buffer, ram);
+  check(sent == 2 && Wire.transfers == 1,
+        "two rows next to each other go in one transfer");
+
+  memset(buffer, 0, sizeof(buffer));
+  sent = flushRows(cache, buffer, ram);
+  check(sent == 5 && Wire.transfers == 2,
+        "a clear frame sends the rows that were lit");
+
+  memset(ram, 0xAA, sizeof(ram)); // As if it had been begin()'d again
+  cache.invalidate();
+  sent = flushRows(cache, buffer, ram);
+  check(sent == HT16K33_ROWS && Wire.transfers == 1,
+        "invalidate() sends every row");
+}
+
+int main(){
+  testRows();
+  testPages(1);
+  testPages(2);
+  testTallScreen();
+  if(failures){
+    printf("FAIL: %d checks\n", failures);
+    return 1;
+  }
+  printf("PASS\n");
+  return 0;
+}
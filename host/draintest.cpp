@@ -0,0 +1,208 @@
+/** @file draintest.cpp
+ *  @brief Counts the polls it takes the master to drain a client's queue
+ *
+ *  A client queues a few messages at once, and the master polls until it
+ *  has them all, over and over. With reply bursts every poll should bring
+ *  in the whole queue, up to MAX_WINDOW messages, where one reply per poll
+ *  takes a poll for each. The same runs are made with the master's
+ *  default scheduler and with one that only allows a single reply, and
+ *  the average polls per drain of each is printed. The burst runs have to
+ *  average at most 1.5 polls, or the exit status is 1.
+ *
+ *  The nodes share a loopback bus that hands each packet to the other node
+ *  as soon as its closing 0 is written, nothing is lost on the way.
+ *
+ *  usage: draintest [-q messages queued at once] [-r rounds]
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#include "Arduino.h"
+#include "DSerial.h"
+#include <unistd.h>
+
+#define LOOP_RX_BUFFER 1024
+#define CLIENT_ID 1
+#define MAX_CALLS 100000
+#define MAX_BURST_POLLS 1.5
+
+/** @brief A port on a two node bus with no wire, packets arrive as they end
+ */
+class LoopPort : public Stream {
+  public:
+    LoopPort(){
+      _head = 0;
+      _count = 0;
+      _packet_len = 0;
+      other = NULL;
+    }
+
+    size_t write(uint8_t c){
+      if(_packet_len < sizeof(_packet)){
+        _packet[_packet_len++] = c;
+      }
+      if(c == 0){
+        if(other != NULL){
+          other->receive(_packet, _packet_len);
+        }
+        _packet_len = 0;
+      }
+      return 1;
+    }
+
+    int available(){ return _count; }
+
+    int read(){
+      int c = peek();
+      if(_count > 0){
+        _head = (_head + 1) % LOOP_RX_BUFFER;
+        _count--;
+      }
+      return c;
+    }
+
+    int peek(){
+      return _count > 0 ? _rx[_head] : -1;
+    }
+
+    LoopPort *other;
+
+  private:
+    void receive(const uint8_t *packet, size_t len){
+      for(size_t i = 0; i < len && _count < LOOP_RX_BUFFER; i++){
+        _rx[(_head + _count) % LOOP_RX_BUFFER] = packet[i];
+        _count++;
+      }
+    }
+
+    uint8_t   _rx[LOOP_RX_BUFFER];
+    int       _head;
+    int       _count;
+    uint8_t   _packet[2 * MAX_MSG_LEN + 4];
+    size_t    _packet_len;
+};
+
+/** @brief The default scheduler, but one reply per poll */
+class OneReplyScheduler : public DSerialPriorityScheduler {
+  public:
+    uint8_t replyWindow(uint8_t index){
+      return 1;
+    }
+};
+
+static DSerialMaster *master;
+static DSerialClient *client;
+static unsigned long sim_us;
+static int in_hook;
+
+// While the master discovers the client, it runs whenever the master sleeps
+static void runClient(unsigned long us){
+  sim_us += us;
+  hostSetTime(sim_us);
+  if(in_hook){
+    return;
+  }
+  in_hook = 1;
+  client->doSerial();
+  in_hook = 0;
+}
+
+// Queues count messages on the client and runs both nodes until the master
+// has them all. Returns the polls it took, or -1 if they never came.
+static long drain(int count){
+  uint8_t data[MAX_DATA_LEN];
+  uint8_t len;
+  uint8_t next = 0;
+  int got = 0;
+  dserial_stats_t before, after;
+
+  for(int i = 0; i < count; i++){
+    next = i;
+    if(!client->sendData(&next, 1)){
+      return -1;
+    }
+  }
+  master->getStats(&before);
+  for(int n = 0; n < MAX_CALLS && got < count; n++){
+    master->doSerial();
+    client->doSerial();
+    while(master->getData(data, sizeof(data), &len) == CLIENT_ID){
+      got++;
+    }
+  }
+  if(got < count){
+    return -1;
+  }
+  master->getStats(&after);
+  return after.frames_out - before.frames_out;
+}
+
+// Average polls per drain over rounds, with the given scheduler, or a
+// negative number if one of the drains failed
+static double run(DSerialScheduler *scheduler, int count, int rounds){
+  long polls = 0;
+  long took;
+
+  master->setScheduler(scheduler);
+  drain(1); // The poll that syncs the link, and the first ACK
+  for(int i = 0; i < rounds; i++){
+    took = drain(count);
+    if(took < 0){
+      return -1;
+    }
+    polls += took;
+  }
+  return (double)polls / rounds;
+}
+
+int main(int argc, char **argv){
+  int count = MAX_WINDOW;
+  int rounds = 100;
+  int opt;
+  double burst, single;
+  LoopPort *master_port = new LoopPort();
+  LoopPort *client_port = new LoopPort();
+
+  while((opt = getopt(argc, argv, "q:r:")) != -1){
+    switch(opt){
+      case 'q': count = atoi(optarg); break;
+      case 'r': rounds = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-q messages queued at once] "
+                "[-r rounds]\n", argv[0]);
+        return 1;
+    }
+  }
+  if(count < 1 || count > MAX_WINDOW || rounds < 1){
+    fprintf(stderr, "need 1 to %d messages queued and 1 or more rounds\n",
+            MAX_WINDOW);
+    return 1;
+  }
+
+  master_port->other = client_port;
+  client_port->other = master_port;
+  master = new DSerialMaster(*master_port);
+  client = new DSerialClient(*client_port, CLIENT_ID);
+  hostSetSleepHook(runClient);
+  if(master->identifyClients() != 1){
+    fprintf(stderr, "the client was not found\n");
+    return 1;
+  }
+  hostSetSleepHook(NULL);
+
+  burst = run(NULL, count, rounds);
+  single = run(new OneReplyScheduler(), count, rounds);
+  if(burst < 0 || single < 0){
+    printf("FAIL: messages were lost\n");
+    return 1;
+  }
+  printf("%d messages queued at once, %d rounds: %.2f polls per drain with "
+         "bursts, %.2f with one reply per poll\n", count, rounds, burst,
+         single);
+  if(burst > MAX_BURST_POLLS){
+    printf("FAIL: more than %.1f polls per drain\n", MAX_BURST_POLLS);
+    return 1;
+  }
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,83 @@
+/** @file footprint.cpp
+ *  @brief Reports the RAM taken by DSerial masters and clients of a few sizes
+ *
+ *  "object" is sizeof on this machine, which has wider pointers and longs
+ *  than an ATmega328p, so it reads high. "queues" is the message storage
+ *  inside of the object, which is the same on every machine and is most of
+ *  what the template sizes change. "ring" is the receiveByte ring a master
+ *  or client only has with RX_ISR set.
+ *
+ *  It also checks which KTANEMax7219 pin sets use the hardware SPI, the
+ *  build fails if a sketch's pins would get the wrong one.
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#include "Arduino.h"
+#include "DSerial.h"
+#include "KTANEMax7219.h"
+
+// The memory module's LOAD is on MISO, which the SPI would make an input
+static_assert(!KTANEMax7219<12, 13, 11>::USE_SPI, "memory.ino pins");
+static_assert(!KTANEMax7219<2, 3, 4>::USE_SPI, "controller.ino pins");
+static_assert(KTANEMax7219<10, 13, 11>::USE_SPI, "SCK, MOSI and SS");
+
+class NullStream : public Stream {
+  public:
+    size_t write(uint8_t c){ return 1; }
+    int available(){ return 0; }
+    int read(){ return -1; }
+    int peek(){ return -1; }
+};
+
+template<uint8_t CLIENTS, uint8_t QUEUE_SIZE, bool RX_ISR>
+static void reportMaster(const char *name){
+  NullStream port;
+  DSerialMasterT<CLIENTS, QUEUE_SIZE, RX_ISR> master(port);
+  unsigned queues = MASTER_QUEUE_STORAGE(QUEUE_SIZE) +
+                    MASTER_POOL_STORAGE(QUEUE_SIZE) + QUEUE_SIZE;
+  printf("%-28s clients %3d queue %3d   object %5u  queues %5u\n",
+         name, CLIENTS - 1, QUEUE_SIZE,
+         (unsigned)sizeof(master), queues);
+}
+
+template<uint8_t LOAD, uint8_t CLOCK, uint8_t DATA>
+static void reportMax7219(const char *name){
+  printf("%-28s %s, object %u\n", name,
+         KTANEMax7219<LOAD, CLOCK, DATA>::USE_SPI ? "SPI" : "port writes",
+         (unsigned)sizeof(KTANEMax7219<LOAD, CLOCK, DATA>));
+}
+
+template<uint8_t IN_SIZE, uint8_t OUT_SIZE, bool RX_ISR>
+static void reportClient(const char *name){
+  NullStream port;
+  DSerialClientT<IN_SIZE, OUT_SIZE, RX_ISR> client(port, 1);
+  unsigned queues = CLIENT_QUEUE_STORAGE(IN_SIZE) +
+                    CLIENT_QUEUE_STORAGE(OUT_SIZE);
+  printf("%-28s in %6d out %4d   object %5u  queues %5u\n",
+         name, IN_SIZE, OUT_SIZE, (unsigned)sizeof(client), queues);
+}
+
+int main(){
+  printf("MAX_MSG_LEN %d, MSG_SLOT_LEN %d\n\n", MAX_MSG_LEN, MSG_SLOT_LEN);
+
+  reportMaster<MAX_CLIENTS, MAX_MASTER_QUEUE_SIZE, false>("DSerialMaster");
+  reportMaster<8, 8, false>("DSerialMasterT<8, 8>");
+  reportMaster<8, 8, true>("DSerialMasterT<8, 8, true>");
+  reportMaster<6, 4, false>("DSerialMasterT<6, 4>");
+  printf("\n");
+  reportClient<MAX_CLIENT_QUEUE_SIZE, MAX_CLIENT_QUEUE_SIZE, false>(
+    "DSerialClient");
+  reportClient<4, 4, false>("DSerialClientT<4>");
+  reportClient<2, 2, false>("DSerialClientT<2>");
+  reportClient<2, 2, true>("DSerialClientT<2, 2, true>");
+  reportClient<2, 4, false>("DSerialClientT<2, 4>");
+  reportClient<1, 1, false>("DSerialClientT<1>");
+  printf("\nring %u, DSerialPrioritySchedulerT<8> object %u\n",
+         (unsigned)RX_RING_STORAGE, (unsigned)sizeof(DSerialPrioritySchedulerT<8>));
+  printf("\n");
+  reportMax7219<12, 13, 11>("KTANEMax7219<12, 13, 11>");
+  reportMax7219<2, 3, 4>("KTANEMax7219<2, 3, 4>");
+  reportMax7219<10, 13, 11>("KTANEMax7219<10, 13, 11>");
+  return 0;
+}
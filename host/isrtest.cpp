@@ -0,0 +1,192 @@
+/** @file isrtest.cpp
+ *  @brief Races DSerialParser::receiveByte against readPacket on two threads
+ *
+ *  On a board receiveByte runs in the UART interrupt and readPacket in the
+ *  sketch's loop, and the ring between them only has the stringQueue's
+ *  atomics to keep them apart. Here a producer thread stands in for the
+ *  interrupt and feeds the bytes of COBS encoded packets into
+ *  receiveByte as fast as it can, while the main thread takes packets out
+ *  with readPacket. Built with -fsanitize=thread (make isrtest), any race
+ *  between the two is reported.
+ *
+ *  Each packet carries its number and bytes worked out from it (0x00 and
+ *  0xFF included). The producer mostly waits for the reader to keep up, as
+ *  a bus at a sensible baud rate would, but every BURST_EVERY packets it
+ *  sends BURST_LEN without waiting and overruns the ring, which drops some.
+ *  Every packet read has to be whole, come after the one read before it,
+ *  and have ended no earlier than it, and the parser's counts have to add
+ *  up to what was sent.
+ *
+ *  The sanitizer makes it slow, the default 200000 packets take a couple
+ *  of minutes.
+ *
+ *  usage: isrtest [-n packets]
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#include "Arduino.h"
+#include "DSerial.h"
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define BURST_EVERY 256
+#define BURST_LEN 16
+
+/** @brief A stream that keeps what is written to it, and never has input */
+class BufferStream : public Stream {
+  public:
+    BufferStream(size_t size){
+      _data = new uint8_t[size];
+      _size = size;
+      _len = 0;
+    }
+
+    size_t write(uint8_t c){
+      if(_len == _size){
+        return 0;
+      }
+      _data[_len++] = c;
+      return 1;
+    }
+
+    int available(){ return 0; }
+    int read(){ return -1; }
+    int peek(){ return -1; }
+
+    const uint8_t *data(){ return _data; }
+    size_t length(){ return _len; }
+
+  private:
+    uint8_t  *_data;
+    size_t    _size;
+    size_t    _len;
+};
+
+static DSerialIsrParser parser;
+static BufferStream *wire;
+static int producer_done;
+static unsigned long taken;   // Packets the reader has read or seen dropped
+
+// Message n: 4 bytes of n, then 1 to MAX_MSG_LEN - 4 bytes made from it
+static uint8_t makeMessage(uint32_t n, uint8_t *data){
+  uint8_t len = 5 + n % (MAX_MSG_LEN - 4);
+  memcpy(data, &n, sizeof(n));
+  for(uint8_t i = 4; i < len; i++){
+    data[i] = (uint8_t)(n * 31 + i * 97);
+  }
+  return len;
+}
+
+static void *producer(void *arg){
+  const uint8_t *bytes = wire->data();
+  size_t len = wire->length();
+  unsigned long sent = 0;
+
+  for(size_t i = 0; i < len; i++){
+    parser.receiveByte(bytes[i]);
+    if(bytes[i] != 0){
+      continue;
+    }
+    sent++;
+    if(sent % BURST_EVERY < BURST_LEN){
+      continue;
+    }
+    while(sent - __atomic_load_n(&taken, __ATOMIC_ACQUIRE) >= RX_RING_SIZE){
+      sched_yield();
+    }
+  }
+  __atomic_store_n(&producer_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+int main(int argc, char **argv){
+  unsigned long packets = 200000;
+  unsigned long received = 0;
+  unsigned long dropped = 0;
+  uint16_t bad_frames = 0;
+  unsigned long errors = 0;
+  unsigned long last_micros = 0;
+  uint8_t expected[MAX_MSG_LEN];
+  uint32_t last = 0;
+  BufferStream idle(0);
+  dserial_msg_t msg;
+  dserial_stats_t counts;
+  pthread_t thread;
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:")) != -1){
+    switch(opt){
+      case 'n': packets = strtoul(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "usage: %s [-n packets]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  wire = new BufferStream(packets * (MAX_MSG_LEN + 3));
+  for(uint32_t n = 1; n <= packets; n++){
+    uint8_t data[MAX_MSG_LEN];
+    sendPacket(*wire, data, makeMessage(n, data));
+  }
+
+  pthread_create(&thread, NULL, producer, NULL);
+  for(;;){
+    int done = __atomic_load_n(&producer_done, __ATOMIC_ACQUIRE);
+    int result = parser.readPacket(idle, &msg);
+    // Packets dropped with the ring full are counted as bad frames
+    parser.getCounts(&counts);
+    dropped += (uint16_t)(counts.bad_frames - bad_frames);
+    bad_frames = counts.bad_frames;
+    received += (result == 1);
+    __atomic_store_n(&taken, received + dropped, __ATOMIC_RELEASE);
+    if(result == 0){
+      if(done){
+        break;
+      }
+      continue;
+    }
+    if(result == -1){
+      fprintf(stderr, "bad packet after %u\n", last);
+      errors++;
+      continue;
+    }
+    uint32_t n;
+    memcpy(&n, msg.data, sizeof(n));
+    if(msg.len != makeMessage(n, expected) ||
+       memcmp(msg.data, expected, msg.len) != 0){
+      fprintf(stderr, "packet %u is damaged\n", n);
+      errors++;
+    } else if(n <= last){
+      fprintf(stderr, "packet %u came after %u\n", n, last);
+      errors++;
+    } else if(parser.frameMicros() < last_micros){
+      fprintf(stderr, "packet %u ended before the one read before it\n", n);
+      errors++;
+    }
+    last = n;
+    last_micros = parser.frameMicros();
+  }
+  pthread_join(thread, NULL);
+
+  if(counts.frames_in != received){
+    fprintf(stderr, "%lu packets read, %lu counted\n", received,
+            (unsigned long)counts.frames_in);
+    errors++;
+  }
+  if(received + dropped != packets){
+    fprintf(stderr, "%lu packets sent, %lu read and %lu counted dropped\n",
+            packets, received, dropped);
+    errors++;
+  }
+
+  printf("%lu packets sent, %lu read, %lu dropped with the ring full\n",
+         packets, received, dropped);
+  if(errors){
+    printf("FAIL: %lu errors\n", errors);
+    return 1;
+  }
+  printf("PASS\n");
+  return 0;
+}
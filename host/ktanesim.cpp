@@ -0,0 +1,320 @@
+/** @file ktanesim.cpp
+ *  @brief Plays a game between a KTANEController and KTANEModules on a SimBus
+ *
+ *  The controller starts up as controller.ino does, then every module
+ *  strikes a few times at random and solves. At the end the controller has
+ *  to have counted every strike and solve, and every module has to have
+ *  the config and the final strike count (modules that discovery missed
+ *  get found later, as if they had been plugged in late, and -p powers the
+ *  last module up late for real). Every module
+ *  also reports its DSerial stats to the controller every STATS_INTERVAL
+ *  ms, and each has to have been heard from. Modules are never sent a
+ *  RESET, softwareReset() does not come back on a PC. The client events
+ *  the controller passes on (see KTANEController::setEventHandler) are
+ *  counted.
+ *
+ *  The time between passes of each module's loop, and of the controller's
+ *  (which chirps on strikes and solves and keeps its clock display up to
+ *  date as controller.ino does), is
+ *  measured too, as anything in them that blocks (a strike's LED, say)
+ *  keeps a real module from reading its inputs and the controller's clock
+ *  from ticking.
+ *
+ *  usage: ktanesim [-c modules] [-k strikes per module] [-b max baud]
+ *                  [-e bit error rate] [-d drop rate] [-t seconds] [-s seed]
+ *                  [-p ms the last module powers up after the rest]
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#include "Arduino.h"
+#include "DSerial.h"
+#include "KTANECommon.h"
+#include "KTANEMax7219.h"
+#include "SimBus.h"
+#include <unistd.h>
+
+#define STATS_INTERVAL 2000
+
+typedef struct module_st {
+  DSerialClient *client;
+  KTANEModule *module;
+  int strikes_left;
+  int got_config;
+  int stats_reports;  // Received by the controller
+  dserial_stats_t stats; // Totals of the reports
+} module_t;
+
+static SimBus *bus;
+static SimPort *ports[SIM_MAX_PORTS];
+static DSerialMaster *master;
+static KTANEController *controller;
+static module_t modules[SIM_MAX_PORTS];
+static int num_modules = 5;
+static int strikes_each = 2;
+static unsigned long max_baud = 57600;
+static unsigned long late_ms;
+static config_t config;
+
+// Gaps between passes of a loop once the game is on
+typedef struct loop_gaps_st {
+  unsigned long passes;
+  unsigned long max;
+  unsigned long over[3]; // 1, 10 and 100 ms
+} loop_gaps_t;
+
+static loop_gaps_t module_gaps, controller_gaps;
+static KTANETonePlayer *speaker;
+static const int strike_chirp[] = {340, 140};
+static const int solve_chirp[] = {140, 340};
+static const int chirp_durations[] = {150, 150};
+static KTANEMax7219<2, 3, 4> clock_display; // Pins as on controller.ino
+static unsigned long clock_writes;          // Digits sent to clock_display
+
+// Counts the time since the last pass, and starts the next
+static void loopPass(loop_gaps_t *gaps, unsigned long *last_pass){
+  unsigned long gap = micros() - *last_pass;
+  *last_pass += gap;
+  gaps->passes++;
+  if(gap > gaps->max){
+    gaps->max = gap;
+  }
+  for(int i = 0, limit = 1000; i < 3; i++, limit *= 10){
+    gaps->over[i] += (gap > (unsigned long)limit);
+  }
+}
+
+static void reportGaps(const char *name, loop_gaps_t *gaps){
+  printf("%s loops: %lu passes, longest %.1f ms, %lu over 1 ms, "
+         "%lu over 10 ms, %lu over 100 ms\n", name, gaps->passes,
+         gaps->max / 1000.0, gaps->over[0], gaps->over[1], gaps->over[2]);
+}
+static int num_found;
+static unsigned long ready_millis;
+static unsigned long events[EVENT_CLIENT_JOINED + 1]; // Passed on by the
+                                                      // controller
+
+// Tasks are added controller first, so the running task is the port's index
+static void setBaud(unsigned long baud){
+  SimPort *port = ports[bus->currentTask()];
+  port->flushOutput();
+  port->begin(baud);
+}
+
+static void countEvent(uint8_t event, uint8_t client_id){
+  if(event <= EVENT_CLIENT_JOINED){
+    events[event]++;
+  }
+}
+
+// Adds up the stats reports the controller got
+static void collectStats(){
+  dserial_stats_t stats;
+  module_t *m;
+  int client_id;
+
+  while((client_id = controller->getClientStats(&stats)) != 0){
+    m = &modules[client_id];
+    m->stats_reports++;
+    m->stats.frames_in += stats.frames_in;
+    m->stats.frames_out += stats.frames_out;
+    m->stats.bad_frames += stats.bad_frames;
+    m->stats.retries += stats.retries;
+    m->stats.naks += stats.naks;
+  }
+}
+
+static void controllerTask(void *arg){
+  int strikes = 0;
+  int solves = 0;
+  unsigned long last_pass;
+
+  delay(1000);
+  num_found = master->identifyClients();
+  controller->sendConfig(&config);
+  while(!controller->clientsAreReady()){
+    controller->interpretData();
+    collectStats();
+  }
+  ready_millis = millis();
+  master->negotiateBaud();
+  clock_display.begin();
+  last_pass = micros();
+  for(;;){
+    loopPass(&controller_gaps, &last_pass);
+    controller->interpretData();
+    collectStats();
+    unsigned long game_s = (millis() - ready_millis) / 1000;
+    clock_display.setDigit(1, game_s / 600 % 10);
+    clock_display.setDigit(3, game_s / 60 % 10);
+    clock_display.setDigit(4, game_s % 60 / 10);
+    clock_display.setDigit(2, game_s % 10);
+    clock_writes += clock_display.update();
+    if(strikes < controller->getStrikes()){
+      speaker->play(strike_chirp, chirp_durations, 2, KTANE_TONE_PREEMPT);
+      strikes = controller->getStrikes();
+    }
+    if(solves < controller->getSolves()){
+      speaker->play(solve_chirp, chirp_durations, 2);
+      solves = controller->getSolves();
+    }
+  }
+}
+
+// Every field of the config made it across the CONFIG message
+static int sameConfig(config_t *a, config_t *b){
+  return a->ports == b->ports && a->batteries == b->batteries &&
+         a->indicators == b->indicators && !strcmp(a->serial, b->serial);
+}
+
+static void moduleTask(void *arg){
+  module_t *m = (module_t *)arg;
+  unsigned long next_millis;
+  unsigned long stats_millis = millis();
+  unsigned long last_pass;
+
+  // Powered off until then, nothing that was sent reaches it
+  if(m == &modules[num_modules] && late_ms > 0){
+    SimPort *port = ports[m - modules];
+    delay(late_ms);
+    while(port->available()){
+      port->read();
+    }
+    stats_millis = millis();
+  }
+
+  while(!m->module->getConfig()){
+    m->module->interpretData();
+  }
+  m->got_config = sameConfig(m->module->getConfig(), &config);
+  m->module->sendReady();
+
+  next_millis = millis() + 1000 + bus->random() % 5000;
+  last_pass = micros();
+  for(;;){
+    loopPass(&module_gaps, &last_pass);
+    m->module->interpretData();
+    if(millis() - stats_millis >= STATS_INTERVAL){
+      stats_millis = millis();
+      m->module->sendStats();
+    }
+    if(!m->module->is_solved && (long)(millis() - next_millis) >= 0){
+      if(m->strikes_left > 0){
+        m->module->strike();
+        m->strikes_left--;
+      } else {
+        m->module->win();
+      }
+      next_millis = millis() + bus->random() % 5000;
+    }
+  }
+}
+
+int main(int argc, char **argv){
+  double bit_error_rate = 0;
+  double drop_rate = 0;
+  double seconds = 30;
+  uint32_t seed = 1;
+  sim_bus_stats_t stats;
+  dserial_stats_t master_stats;
+  int failed = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "c:k:b:e:d:t:s:p:")) != -1){
+    switch(opt){
+      case 'c': num_modules = atoi(optarg); break;
+      case 'k': strikes_each = atoi(optarg); break;
+      case 'b': max_baud = strtoul(optarg, NULL, 10); break;
+      case 'e': bit_error_rate = atof(optarg); break;
+      case 'd': drop_rate = atof(optarg); break;
+      case 't': seconds = atof(optarg); break;
+      case 's': seed = strtoul(optarg, NULL, 10); break;
+      case 'p': late_ms = strtoul(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "usage: %s [-c modules] [-k strikes per module] "
+                "[-b max baud] [-e bit error rate] [-d drop rate] "
+                "[-t seconds] [-s seed] [-p ms late]\n", argv[0]);
+        return 1;
+    }
+  }
+  if(num_modules < 1 || num_modules > MAX_CLIENTS - 1){
+    fprintf(stderr, "modules must be between 1 and %d\n", MAX_CLIENTS - 1);
+    return 1;
+  }
+
+  config.ports = 5;
+  config.batteries = 3;
+  config.indicators = 2;
+  strcpy(config.serial, "KTANE7");
+
+  bus = new SimBus(seed);
+  bus->setBitErrorRate(bit_error_rate);
+  bus->setDropRate(drop_rate);
+  for(int i = 0; i <= num_modules; i++){
+    ports[i] = new SimPort(*bus);
+  }
+  master = new DSerialMaster(*ports[0]);
+  master->setBaudControl(setBaud, max_baud);
+  controller = new KTANEController(*master);
+  speaker = new KTANETonePlayer(controller->getScheduler(), 5);
+  controller->setEventHandler(countEvent);
+  bus->addTask(controllerTask, NULL);
+  for(int i = 1; i <= num_modules; i++){
+    modules[i].client = new DSerialClient(*ports[i], i);
+    modules[i].client->setBaudControl(setBaud, max_baud);
+    modules[i].module = new KTANEModule(*modules[i].client, 3, 4);
+    modules[i].strikes_left = strikes_each;
+    bus->addTask(moduleTask, &modules[i]);
+  }
+
+  bus->run((unsigned long)(seconds * 1000000));
+
+  bus->getStats(&stats);
+  printf("%d modules, %d found at the start, %d at the end, ready after "
+         "%lu ms, %lu baud\n", num_modules, num_found,
+         master->getClients(NULL), ready_millis, master->getBaud());
+  printf("controller: %d strikes, %d solves\n", controller->getStrikes(),
+         controller->getSolves());
+  if(master->getClients(NULL) != num_modules ||
+     controller->getStrikes() != num_modules * strikes_each ||
+     controller->getSolves() != num_modules){
+    failed = 1;
+  }
+  for(int i = 1; i <= num_modules; i++){
+    KTANEModule *module = modules[i].module;
+    if(!modules[i].got_config || !module->is_solved ||
+       module->getNumStrikes() != num_modules * strikes_each ||
+       modules[i].stats_reports == 0){
+      printf("module %d: config %s, %s, sees %d strikes, %d stats "
+             "reports\n", i, modules[i].got_config ? "ok" : "wrong",
+             module->is_solved ? "solved" : "not solved",
+             module->getNumStrikes(), modules[i].stats_reports);
+      failed = 1;
+    }
+  }
+  reportGaps("module", &module_gaps);
+  reportGaps("controller", &controller_gaps);
+  printf("controller events: %lu suspect, %lu recovered, %lu lost, "
+         "%lu joined\n", events[EVENT_CLIENT_SUSPECT],
+         events[EVENT_CLIENT_RECOVERED], events[EVENT_CLIENT_LOST],
+         events[EVENT_CLIENT_JOINED]);
+  printf("controller clock: %lu digits sent\n", clock_writes);
+  master->getStats(&master_stats);
+  printf("controller dserial: %lu frames in, %lu out, %u bad, %u timeouts, "
+         "%u retries, %u NAKs\n", (unsigned long)master_stats.frames_in,
+         (unsigned long)master_stats.frames_out, master_stats.bad_frames,
+         master_stats.timeouts, master_stats.retries, master_stats.naks);
+  for(int i = 1; i <= num_modules && i <= 4; i++){
+    dserial_stats_t *m = &modules[i].stats;
+    printf("module %d reported: %lu frames in, %lu out, %u bad, %u retries, "
+           "%u NAKs in %d reports\n", i, (unsigned long)m->frames_in,
+           (unsigned long)m->frames_out, m->bad_frames, m->retries, m->naks,
+           modules[i].stats_reports);
+  }
+  printf("bus: %lu bytes, %lu collisions, %lu garbled, %lu bit errors, "
+         "%lu framing errors, %lu dropped, %lu overflows\n",
+         stats.bytes, stats.collisions, stats.garbled, stats.bit_errors,
+         stats.framing_errors, stats.dropped, stats.overflows);
+  printf("%s\n", failed ? "FAIL" : "PASS");
+  return failed;
+}
@@ -0,0 +1,235 @@
+/** @file synctest.cpp
+ *  @brief Restarts a client and loses its first burst, nothing may be lost
+ *
+ *  A client sends the master a few messages, then restarts (a new
+ *  DSerialClient on the same port and address, as after a reset) with more
+ *  queued. The first burst of replies carrying data after the link has
+ *  synced again is thrown away on the wire. The master knew the client's
+ *  SEQs from before the restart, and if its next poll's RACK were taken as
+ *  an ACK the client would drop messages the master never got. Every
+ *  message has to arrive once and in order.
+ *
+ *  The nodes share a loopback bus that hands each packet to every other
+ *  node as soon as its closing 0 is written, so the test only takes as long
+ *  as the exchanges need on the simulated clock.
+ *
+ *  usage: synctest [-b messages before the restart] [-a messages after]
+ *
+ *  @author Dillon Lareau (dlareau)
+ */
+
+#include "Arduino.h"
+#include "DSerial.h"
+#include <unistd.h>
+
+#define LOOP_MAX_PORTS 4
+#define LOOP_RX_BUFFER 1024
+#define CLIENT_ID 1
+#define MAX_CALLS 100000
+
+/** @brief A port on a bus with no wire, packets arrive as they end
+ *
+ *  A packet written while a drop is armed is decoded, and if it is a reply
+ *  with data it is thrown away, along with the rest of its burst.
+ */
+class LoopPort : public Stream {
+  public:
+    LoopPort(){
+      _head = 0;
+      _count = 0;
+      _packet_len = 0;
+      drop_burst = 0;
+      dropped = 0;
+      _dropping = 0;
+      ports[num_ports++] = this;
+    }
+
+    size_t write(uint8_t c){
+      if(_packet_len < sizeof(_packet)){
+        _packet[_packet_len++] = c;
+      }
+      if(c == 0){
+        if(!shouldDrop()){
+          for(int i = 0; i < num_ports; i++){
+            if(ports[i] != this){
+              ports[i]->receive(_packet, _packet_len);
+            }
+          }
+        }
+        _packet_len = 0;
+      }
+      return 1;
+    }
+
+    int available(){ return _count; }
+
+    int read(){
+      int c = peek();
+      if(_count > 0){
+        _head = (_head + 1) % LOOP_RX_BUFFER;
+        _count--;
+      }
+      return c;
+    }
+
+    int peek(){
+      return _count > 0 ? _rx[_head] : -1;
+    }
+
+    int drop_burst;         // Set to drop the next reply burst with data
+    unsigned long dropped;  // Replies dropped
+
+    static LoopPort *ports[LOOP_MAX_PORTS];
+    static int num_ports;
+
+  private:
+    int shouldDrop(){
+      DSerialIsrParser parser;
+      dserial_msg_t msg;
+      uint8_t ctl;
+
+      if(!drop_burst && !_dropping){
+        return 0;
+      }
+      for(size_t i = 0; i < _packet_len; i++){
+        parser.receiveByte(_packet[i]);
+      }
+      if(parser.readPacket(*this, &msg) != 1 || msg.len < 3 ||
+         msg.data[1] != ACK){
+        return 0;
+      }
+      ctl = msg.data[2];
+      if(!_dropping && !(msg.len > 5 && (ctl & CTL_OLDEST))){
+        return 0; // Not the start of a burst with data
+      }
+      drop_burst = 0;
+      _dropping = (ctl & CTL_MORE) != 0;
+      dropped++;
+      return 1;
+    }
+
+    void receive(const uint8_t *packet, size_t len){
+      for(size_t i = 0; i < len && _count < LOOP_RX_BUFFER; i++){
+        _rx[(_head + _count) % LOOP_RX_BUFFER] = packet[i];
+        _count++;
+      }
+    }
+
+    uint8_t   _rx[LOOP_RX_BUFFER];
+    int       _head;
+    int       _count;
+    uint8_t   _packet[2 * MAX_MSG_LEN + 4];
+    size_t    _packet_len;
+    int       _dropping;  // In a burst being dropped
+};
+
+LoopPort *LoopPort::ports[LOOP_MAX_PORTS];
+int LoopPort::num_ports = 0;
+
+static DSerialMaster *master;
+static DSerialClient *client;
+static LoopPort *client_port;
+static unsigned long sim_us;
+static int in_hook;
+static uint8_t next_queued = 1;
+static uint8_t next_expected = 1;
+static unsigned long errors;
+
+// While the master discovers the client, it runs whenever the master sleeps
+static void runClient(unsigned long us){
+  sim_us += us;
+  hostSetTime(sim_us);
+  if(in_hook){
+    return;
+  }
+  in_hook = 1;
+  client->doSerial();
+  in_hook = 0;
+}
+
+// Runs both nodes until the master has every message up to last, the
+// client queues them as there is room
+static int runUntil(uint8_t last){
+  uint8_t data[MAX_DATA_LEN];
+  uint8_t len;
+
+  for(int n = 0; n < MAX_CALLS && next_expected <= last; n++){
+    while(next_queued <= last && client->sendData(&next_queued, 1)){
+      next_queued++;
+    }
+    master->doSerial();
+    client->doSerial();
+    while(master->getData(data, sizeof(data), &len) == CLIENT_ID){
+      if(len != 1 || data[0] != next_expected){
+        fprintf(stderr, "got message %d, expected %d\n", data[0],
+                next_expected);
+        errors++;
+      }
+      next_expected = data[0] + 1;
+    }
+  }
+  return next_expected > last;
+}
+
+int main(int argc, char **argv){
+  int before = 2;
+  int after = 4;
+  int opt;
+
+  while((opt = getopt(argc, argv, "b:a:")) != -1){
+    switch(opt){
+      case 'b': before = atoi(optarg); break;
+      case 'a': after = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-b messages before the restart] "
+                "[-a messages after]\n", argv[0]);
+        return 1;
+    }
+  }
+  if(before < 1 || after < 1 || before + after > 250){
+    fprintf(stderr, "need 1 or more of each, at most 250 in all\n");
+    return 1;
+  }
+
+  master = new DSerialMaster(*new LoopPort());
+  client_port = new LoopPort();
+  client = new DSerialClient(*client_port, CLIENT_ID);
+  hostSetSleepHook(runClient);
+  if(master->identifyClients() != 1){
+    fprintf(stderr, "the client was not found\n");
+    return 1;
+  }
+  hostSetSleepHook(NULL);
+
+  if(!runUntil(before)){
+    fprintf(stderr, "only got %d of the first %d messages\n",
+            next_expected - 1, before);
+    return 1;
+  }
+
+  // Queued before the link syncs again, so they make up the first burst
+  delete client;
+  client = new DSerialClient(*client_port, CLIENT_ID);
+  while(next_queued <= before + after && client->sendData(&next_queued, 1)){
+    next_queued++;
+  }
+  client_port->drop_burst = 1;
+  if(!runUntil(before + after)){
+    fprintf(stderr, "only got %d of %d messages\n", next_expected - 1,
+            before + after);
+    errors++;
+  }
+
+  printf("%d messages before the restart, %d after, %lu replies dropped\n",
+         before, after, client_port->dropped);
+  if(client_port->dropped == 0){
+    printf("FAIL: no burst was dropped\n");
+    return 1;
+  }
+  if(errors){
+    printf("FAIL: %lu errors\n", errors);
+    return 1;
+  }
+  printf("PASS\n");
+  return 0;
+}
@@ -65,8 +65,14 @@ int relLastColorIndex(int color) {
   return retIndex;
 }
 
+void setBaud(unsigned long baud) {
+  serial_port.flushOutput();
+  serial_port.begin(baud);
+}
+
 void setup() {
   serial_port.begin(19200);
+  client.setBaudControl(setBaud, 57600);
   Serial.begin(19200);
 
   // Detect wires:
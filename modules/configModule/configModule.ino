@@ -109,7 +109,7 @@ void handleSubmit()
                  );
   config_to_raw(&config, &stored_config);
 
-  for(int i = 0; i < 7; i++){
+  for(int i = 0; i < RAW_CONFIG_LEN; i++){
     byte b = ((byte *)(&stored_config))[i];
     EEPROM.write(addr++, b);
   }
@@ -152,7 +152,7 @@ void setup(void)
 
   EEPROM.begin(512);
   int addr = 0;
-  for(int i = 0; i < 7; i++){
+  for(int i = 0; i < RAW_CONFIG_LEN; i++){
     byte b = EEPROM.read(addr++);
     ((byte *)(&stored_config))[i] = b;
   }
@@ -195,7 +195,7 @@ void loop(void)
       // Throw away data
       Serial.read();
     }
-    Serial.write((uint8_t *)(&stored_config), 7);
+    Serial.write((uint8_t *)(&stored_config), RAW_CONFIG_LEN);
     Serial.write(num_minutes);
   }
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "DSerial.h"
 #include "KTANECommon.h"
+#include "KTANEMax7219.h"
 #include <NeoICSerial.h>
 #include <string.h>
 #include <Wire.h>
@@ -35,19 +36,17 @@ byte digits[12] = {
 };
 
 int brightness = 4;
-int win_melody[] = {262, 330, 294, 370, 392};
-int win_melody_durations[] = {8, 8, 8, 8, 2};
-int win_melody_len = 5;
-int lose_melody[] = {659, 622, 587, 554};
-int lose_melody_durations[] = {8,8,8,1};
-int lose_melody_len = 4;
+// Notes in Hz, durations in ms
+const int win_melody[] = {262, 330, 294, 370, 392};
+const int win_melody_durations[] = {125, 125, 125, 125, 500};
+const int lose_melody[] = {659, 622, 587, 554};
+const int lose_melody_durations[] = {125, 125, 125, 1000};
+const int strike_chirp[] = {340, 140};
+const int solve_chirp[] = {140, 340};
+const int chirp_durations[] = {150, 150};
 
 
-byte max7219_reg_decodeMode  = 0x09;
-byte max7219_reg_intensity   = 0x0a;
-byte max7219_reg_scanLimit   = 0x0b;
-byte max7219_reg_shutdown    = 0x0c;
-byte max7219_reg_displayTest = 0x0f;
+KTANEMax7219<LOAD_PIN, CLOCK_PIN, DATA_PIN> clock_display;
 
 // Objects
 Adafruit_AlphaNum4 alpha1 = Adafruit_AlphaNum4();
@@ -58,6 +57,7 @@ unsigned long num_minutes;
 NeoICSerial serial_port;
 DSerialMaster master(serial_port);
 KTANEController controller(master);
+KTANETonePlayer speaker(controller.getScheduler(), SPEAKER_PIN);
 
 // Globals
 int strikes = 0;
@@ -65,21 +65,6 @@ int solves = 0;
 unsigned long dest_time;
 int num_modules;
 
-void playMelody(int *melody, int* durations, int melody_len) {
-  for (int thisNote = 0; thisNote < melody_len; thisNote++) {
-
-    int noteDuration = 1000 / durations[thisNote];
-    tone(SPEAKER_PIN, melody[thisNote], noteDuration);
-
-    // to distinguish the notes, set a minimum time between them.
-    int pauseBetweenNotes = noteDuration * 1.30;
-    delayWithUpdates(controller, pauseBetweenNotes);
-
-    // stop the tone playing:
-    noTone(SPEAKER_PIN);
-  }
-}
-
 void youLose() {
   // Play lose music
   alpha1.clear();
@@ -92,11 +77,11 @@ void youLose() {
   alpha2.writeDigitAscii(3, ' ');
   alpha1.writeDisplay();
   alpha2.writeDisplay();
-  playMelody(lose_melody, lose_melody_durations, lose_melody_len);
+  speaker.play(lose_melody, lose_melody_durations, 4); // After a chirp
 
-  // Stop clock
+  // Stop clock, the melody plays on
   while(1){
-    delayWithUpdates(controller, 10);
+    controller.interpretData();
   }
 }
 
@@ -112,11 +97,11 @@ void youWin() {
   alpha2.writeDigitAscii(3, 'R');
   alpha1.writeDisplay();
   alpha2.writeDisplay();
-  playMelody(win_melody, win_melody_durations, win_melody_len);
+  speaker.play(win_melody, win_melody_durations, 5); // After a chirp
 
-  // Stop clock
+  // Stop clock, the melody plays on
   while(1){
-    delayWithUpdates(controller, 10);
+    controller.interpretData();
   }
 }
 
@@ -127,7 +112,7 @@ void getConfigESP(){
   while (Serial.available() <= 0) {
     delay(10);
   }
-  for(int i = 0; i < 7; i++) {
+  for(int i = 0; i < RAW_CONFIG_LEN; i++) {
     ((char *)(&recv_config))[i] = Serial.read();
   }
   num_minutes = Serial.read();
@@ -143,9 +128,15 @@ void getConfigManual(){
   num_minutes = 6;
 }
 
+void setBaud(unsigned long baud) {
+  serial_port.flushOutput();
+  serial_port.begin(baud);
+}
+
 void setup() {
   // Serial setup
   serial_port.begin(19200);
+  master.setBaudControl(setBaud, 57600);
   Serial.begin(19200);
 
   delay(1000);
@@ -160,20 +151,12 @@ void setup() {
   pinMode(SPEAKER_PIN,   OUTPUT);
 
   // Clock 7-segment setup
-  pinMode(DATA_PIN, OUTPUT);
-  pinMode(CLOCK_PIN,  OUTPUT);
-  pinMode(LOAD_PIN,   OUTPUT);
-
-  maxSingle(max7219_reg_scanLimit, 0x07, LOAD_PIN, CLOCK_PIN, DATA_PIN);      
-  maxSingle(max7219_reg_decodeMode, 0x00, LOAD_PIN, CLOCK_PIN, DATA_PIN);
-  maxSingle(max7219_reg_shutdown, 0x01, LOAD_PIN, CLOCK_PIN, DATA_PIN);
-  maxSingle(max7219_reg_displayTest, 0x00, LOAD_PIN, CLOCK_PIN, DATA_PIN);
-  maxSingle(max7219_reg_intensity, 0x0f & 0x0f, LOAD_PIN, CLOCK_PIN, DATA_PIN);
-
-  maxSingle(1, digits[0], LOAD_PIN, CLOCK_PIN, DATA_PIN);
-  maxSingle(2, digits[3], LOAD_PIN, CLOCK_PIN, DATA_PIN);
-  maxSingle(3, digits[1], LOAD_PIN, CLOCK_PIN, DATA_PIN);
-  maxSingle(4, DIG4(digits[2]), LOAD_PIN, CLOCK_PIN, DATA_PIN);
+  clock_display.begin();
+  clock_display.setDigit(1, digits[0]);
+  clock_display.setDigit(2, digits[3]);
+  clock_display.setDigit(3, digits[1]);
+  clock_display.setDigit(4, DIG4(digits[2]));
+  clock_display.update();
 
   // Serial alphanumeric setup
   alpha1.begin(0x71);
@@ -201,6 +184,7 @@ void setup() {
   while(!controller.clientsAreReady()) {
     controller.interpretData();
   }
+  master.negotiateBaud();
 
   dest_time = millis() + num_minutes*60*1000;
 }
@@ -208,6 +192,11 @@ void setup() {
 void loop() {
   controller.interpretData();
 
+  // Modules plugged in mid-game are found by the master, wait for them too
+  if(master.getClients(NULL) > num_modules) {
+    num_modules = master.getClients(NULL);
+  }
+
   if(millis() > dest_time) {
     youLose();
   } else {
@@ -215,29 +204,24 @@ void loop() {
     unsigned long diff_time = dest_time - millis();
     int seconds = (diff_time / 1000)%60;
     int minutes = diff_time / 60000;
-    maxSingle(1, digits[minutes/10], LOAD_PIN, CLOCK_PIN, DATA_PIN);
-    maxSingle(3, DOT(digits[minutes%10]), LOAD_PIN, CLOCK_PIN, DATA_PIN);
-    maxSingle(4, DIG4(DOT(digits[seconds/10])), LOAD_PIN, CLOCK_PIN, DATA_PIN);
-    maxSingle(2, digits[seconds%10], LOAD_PIN, CLOCK_PIN, DATA_PIN);
+    // Only the digits that changed go out, about once a second
+    clock_display.setDigit(1, digits[minutes/10]);
+    clock_display.setDigit(3, DOT(digits[minutes%10]));
+    clock_display.setDigit(4, DIG4(DOT(digits[seconds/10])));
+    clock_display.setDigit(2, digits[seconds%10]);
+    clock_display.update();
   }
 
+  // A strike is heard straight away, a solve after whatever is playing
   if(strikes < controller.getStrikes()){
-    tone(5, 340, 150);
-    delayWithUpdates(controller, 200);
-    tone(5, 140, 150);
-    delayWithUpdates(controller, 150);
-    noTone(5);
+    speaker.play(strike_chirp, chirp_durations, 2, KTANE_TONE_PREEMPT);
     strikes = controller.getStrikes();
     Serial.println("STRIKE!");
     Serial.println(strikes);
   }
 
   if(solves < controller.getSolves()){
-    tone(5, 140, 150);
-    delayWithUpdates(controller, 200);
-    tone(5, 340, 150);
-    delayWithUpdates(controller, 150);
-    noTone(5);
+    speaker.play(solve_chirp, chirp_durations, 2);
     solves = controller.getSolves();
   }
 
@@ -6,8 +6,14 @@ NeoICSerial serial_port;
 DSerialClient client(serial_port, MY_ADDRESS);
 KTANEModule module(client, 3, 4);
 
+void setBaud(unsigned long baud) {
+  serial_port.flushOutput();
+  serial_port.begin(baud);
+}
+
 void setup() {
   serial_port.begin(19200);
+  client.setBaudControl(setBaud, 57600);
   Serial.begin(19200);
   
   while(!module.getConfig()){
@@ -1,11 +1,12 @@
 #include "DSerial.h"
 #include "KTANECommon.h"
+#include "KTANEMax7219.h"
 #include <NeoICSerial.h>
 
 #define DATA_IN_PIN 11
 #define LOAD_PIN 12
 #define CLOCK_PIN 13
-#define DISP_SINGLE(x,y) maxSingle((x), (y), LOAD_PIN, CLOCK_PIN, DATA_IN_PIN)
+#define DISP_SINGLE(x,y) display.setDigit((x), (y))
 
 #define BUTTON1_PIN 14
 #define BUTTON2_PIN 15
@@ -30,11 +31,9 @@ int stage = 0;
 // Has 6 elements to stop overflow when you win
 int led_pins[6] = {LED1_PIN, LED2_PIN, LED3_PIN, LED4_PIN, LED5_PIN, LED5_PIN};
 
-byte max7219_reg_decodeMode  = 0x09;
-byte max7219_reg_intensity   = 0x0a;
-byte max7219_reg_scanLimit   = 0x0b;
-byte max7219_reg_shutdown    = 0x0c;
-byte max7219_reg_displayTest = 0x0f;
+// CLOCK and DATA_IN are SCK and MOSI, but LOAD is on MISO, which the
+// hardware SPI would make an input. So the pins are driven directly.
+KTANEMax7219<LOAD_PIN, CLOCK_PIN, DATA_IN_PIN> display;
 
 int constants[5] = {
   0b10111110, // 0
@@ -46,6 +45,13 @@ int constants[5] = {
 
 int digits[5] = {3, 8, 6, 5, 4};
 
+// The waiting screen between stages is a frame every WAIT_FRAME_MS: 5 that
+// clear the digits, 15 that spin them, then the displays stay dark until
+// the last one brings the next stage up, 2500 ms in all.
+#define WAIT_FRAME_MS 100
+#define WAIT_LAST_FRAME 25
+int wait_frame = -1; // Frame of the waiting screen, -1 when not showing it
+
 uint8_t getIndexFromNumber(uint8_t *buttons, uint8_t num){
   for(int i = 0; i < 4; i++) {
     if(buttons[i] == num) {
@@ -61,6 +67,7 @@ void updateDisplays() {
   DISP_SINGLE(8, constants[bottom_nums[stage][2]]);
   DISP_SINGLE(3, constants[bottom_nums[stage][3]]);
   DISP_SINGLE(4, constants[top_nums[stage]]);
+  display.update();
   for(int i = 0; i < 5; i++) {
     digitalWrite(led_pins[i], LOW);
   }
@@ -69,23 +76,32 @@ void updateDisplays() {
   }
 }
 
-void displayWaitingScreen() {
-
-  // needs to delay for a total of 2500
-  for(int i = 0; i < 5; i++) {
-    DISP_SINGLE(digits[i], 0);
-    delayWithUpdates(module, 100);
-  }
-  for(int i = 0; i < 15; i++){
+void waitingScreenFrame(void *arg) {
+  if(wait_frame < 5) {
+    DISP_SINGLE(digits[wait_frame], 0);
+  } else if(wait_frame < 20) {
     for(int j = 0; j < 5; j++) {
-      DISP_SINGLE(digits[j], 1 << ((i+j)%7));
+      DISP_SINGLE(digits[j], 1 << ((wait_frame - 5 + j)%7));
     }
-    delayWithUpdates(module, 100);
-  }
-  for(int i = 0; i < 5; i++) {
-    DISP_SINGLE(digits[i], 0);
+  } else if(wait_frame == 20) {
+    for(int i = 0; i < 5; i++) {
+      DISP_SINGLE(digits[i], 0);
+    }
+  } else if(wait_frame == WAIT_LAST_FRAME) {
+    module.getScheduler().cancel(waitingScreenFrame, NULL);
+    wait_frame = -1;
+    updateDisplays();
+    return;
   }
-  delayWithUpdates(module, 500);
+  display.update();
+  wait_frame++;
+}
+
+// Shows the waiting screen, then the current stage. Buttons are ignored
+// until it is done.
+void displayWaitingScreen() {
+  wait_frame = 0;
+  module.getScheduler().schedule(waitingScreenFrame, NULL, 0, WAIT_FRAME_MS);
 }
 
 void generateRandomNumbers() {
@@ -198,13 +214,16 @@ void generateRandomNumbers() {
   // }
 }
 
+void setBaud(unsigned long baud) {
+  serial_port.flushOutput();
+  serial_port.begin(baud);
+}
+
 void setup() {
   serial_port.begin(19200);
+  client.setBaudControl(setBaud, 57600);
   Serial.begin(19200);
 
-  pinMode(DATA_IN_PIN, OUTPUT);
-  pinMode(LOAD_PIN, OUTPUT);
-  pinMode(CLOCK_PIN, OUTPUT);
   pinMode(BUTTON1_PIN, INPUT);
   pinMode(BUTTON2_PIN, INPUT);
   pinMode(BUTTON3_PIN, INPUT);
@@ -215,14 +234,7 @@ void setup() {
   pinMode(LED4_PIN, OUTPUT);
   pinMode(LED5_PIN, OUTPUT);
 
-  DISP_SINGLE(max7219_reg_scanLimit, 0x07);
-  DISP_SINGLE(max7219_reg_decodeMode, 0x00);  // using an led matrix (not digits)
-  DISP_SINGLE(max7219_reg_shutdown, 0x01);    // not in shutdown mode
-  DISP_SINGLE(max7219_reg_displayTest, 0x00); // no display test
-   for (int e=1; e<=8; e++) {    // empty registers, turn all LEDs off
-    DISP_SINGLE(e,0);
-  }
-  DISP_SINGLE(max7219_reg_intensity, 0x0f & 0x0f); // the first 0x0f is the value you can set
+  display.begin(); // Clears all 8 digits
 
   while(!module.getConfig()){
     module.interpretData();
@@ -242,7 +254,7 @@ void loop() {
 
   module.interpretData();
 
-  if(!module.is_solved) {
+  if(!module.is_solved && wait_frame < 0) {
     if(digitalRead(BUTTON1_PIN)) {
       button_pressed = 0;
     } else if(digitalRead(BUTTON2_PIN)) {
@@ -264,8 +276,7 @@ void loop() {
       if(stage == 5){
         module.win();
       } else {
-      displayWaitingScreen();
-      updateDisplays();
+        displayWaitingScreen();
       }
     }
   }
@@ -1,5 +1,6 @@
 #include "DSerial.h"
 #include "KTANECommon.h"
+#include "KTANEDisplay.h"
 #include <NeoICSerial.h>
 #include "morse.h"
 #include <Wire.h>
@@ -16,9 +17,11 @@ NeoICSerial serial_port;
 DSerialClient client(serial_port, MY_ADDRESS);
 KTANEModule module(client, 3, 4);
 Adafruit_7segment matrix = Adafruit_7segment();
+KTANEHT16K33Cache matrix_cache(matrix.displaybuffer, 0x70);
 
 int goal_freq;
 int selected_freq = 0;
+int shown_freq = -1; // On the display, -1 before the first draw
 uint8_t morse_bits[8];
 int morse_index;
 int morse_length;
@@ -40,8 +43,14 @@ int getMorseBit(uint8_t *bits, int index) {
   return bits[index/8] & mask;
 }
 
+void setBaud(unsigned long baud) {
+  serial_port.flushOutput();
+  serial_port.begin(baud);
+}
+
 void setup() {
   serial_port.begin(19200);
+  client.setBaudControl(setBaud, 57600);
   Serial.begin(19200);
   matrix.begin(0x70);
   
@@ -112,11 +121,14 @@ void loop() {
     }
 
 
-    matrix.writeDigitNum(0, 3);
-    matrix.writeDigitNum(1, freqs[selected_freq][0] - '0');
-    matrix.writeDigitNum(3, freqs[selected_freq][1] - '0');
-    matrix.writeDigitNum(4, freqs[selected_freq][2] - '0');
-    matrix.writeDisplay();
+    if(selected_freq != shown_freq) {
+      matrix.writeDigitNum(0, 3);
+      matrix.writeDigitNum(1, freqs[selected_freq][0] - '0');
+      matrix.writeDigitNum(3, freqs[selected_freq][1] - '0');
+      matrix.writeDigitNum(4, freqs[selected_freq][2] - '0');
+      matrix_cache.flush();
+      shown_freq = selected_freq;
+    }
 
     if(!digitalRead(BUTTON_TX_PIN)) {
       if(selected_freq == goal_freq) {
@@ -1,5 +1,6 @@
 #include "DSerial.h"
 #include "KTANECommon.h"
+#include "KTANEDisplay.h"
 #include <NeoICSerial.h>
 #include <Arduino.h>
 #include <U8g2lib.h>
@@ -14,12 +15,14 @@ KTANEModule module(client, 3, 4);
 // Serial pins: 8, 9
 // Display: 13, 11, 10 (clock, data, cs)
 U8G2_ST7920_128X64_1_HW_SPI u8g2(U8G2_R0, /* CS=*/ 10, /* reset=*/ U8X8_PIN_NONE);
+KTANEPageCache<U8G2> screen(u8g2);
 
 // Submit button: 2
 // Upper switches: 5, 6, 7, A5, A6
 // Lower switches: A0, A1, A2, A3, A4
 
 char *correct_str;
+char shown_str[6] = ""; // On the display
 char possible_letters[6][5];
 char *possible_words[35] = {
   "ABOUT", "AFTER", "AGAIN", "BELOW", "COULD",
@@ -31,28 +34,34 @@ char *possible_words[35] = {
   "WHERE", "WHICH", "WORLD", "WOULD", "WRITE"
 };
 
+void drawStr(U8G2 &u8g2, void *arg) {
+  char *str = (char *)arg;
+  u8g2.drawGlyph(4, 45, str[0]);
+  u8g2.drawGlyph(29, 45, str[1]);
+  u8g2.drawGlyph(54, 45, str[2]);
+  u8g2.drawGlyph(79, 45, str[3]);
+  u8g2.drawGlyph(104, 45, str[4]);
+  u8g2.drawLine(0, 0, 0, 63);
+  u8g2.drawLine(1, 0, 1, 63);
+  u8g2.drawLine(2, 0, 2, 63);
+  u8g2.drawLine(26, 0, 26, 63);
+  u8g2.drawLine(27, 0, 27, 63);
+  u8g2.drawLine(51, 0, 51, 63);
+  u8g2.drawLine(52, 0, 52, 63);
+  u8g2.drawLine(76, 0, 76, 63);
+  u8g2.drawLine(77, 0, 77, 63);
+  u8g2.drawLine(101, 0, 101, 63);
+  u8g2.drawLine(102, 0, 102, 63);
+  u8g2.drawLine(126, 0, 126, 63);
+  u8g2.drawLine(127, 0, 127, 63);
+}
+
+// Only the pages of the screen that changed are sent
 void dispStr(char *str) {
-  u8g2.firstPage();
-  do {
-    u8g2.drawGlyph(4, 45, str[0]);
-    u8g2.drawGlyph(29, 45, str[1]);
-    u8g2.drawGlyph(54, 45, str[2]);
-    u8g2.drawGlyph(79, 45, str[3]);
-    u8g2.drawGlyph(104, 45, str[4]);
-    u8g2.drawLine(0, 0, 0, 63);
-    u8g2.drawLine(1, 0, 1, 63);
-    u8g2.drawLine(2, 0, 2, 63);
-    u8g2.drawLine(26, 0, 26, 63);
-    u8g2.drawLine(27, 0, 27, 63);
-    u8g2.drawLine(51, 0, 51, 63);
-    u8g2.drawLine(52, 0, 52, 63);
-    u8g2.drawLine(76, 0, 76, 63);
-    u8g2.drawLine(77, 0, 77, 63);
-    u8g2.drawLine(101, 0, 101, 63);
-    u8g2.drawLine(102, 0, 102, 63);
-    u8g2.drawLine(126, 0, 126, 63);
-    u8g2.drawLine(127, 0, 127, 63);
-  } while(u8g2.nextPage());
+  if(strncmp(str, shown_str, 5) != 0) {
+    screen.render(drawStr, str);
+    strncpy(shown_str, str, 5);
+  }
 }
 
 void generateGrid(char* word) {
@@ -101,8 +110,14 @@ void generateGrid(char* word) {
   }
 }
 
+void setBaud(unsigned long baud) {
+  serial_port.flushOutput();
+  serial_port.begin(baud);
+}
+
 void setup() {
   serial_port.begin(19200);
+  client.setBaudControl(setBaud, 57600);
   Serial.begin(19200);
 
   u8g2.begin();
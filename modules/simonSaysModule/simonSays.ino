@@ -73,8 +73,14 @@ int get_button(){
   return button_pressed;
 }
 
+void setBaud(unsigned long baud) {
+  serial_port.flushOutput();
+  serial_port.begin(baud);
+}
+
 void setup() {
   serial_port.begin(19200);
+  client.setBaudControl(setBaud, 57600);
   Serial.begin(19200);
 
   pinMode(button_pins[0], INPUT);
@@ -52,8 +52,14 @@ uint8_t goal_matrix[32][16] = {
   { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
   { 0, 1, 2, 3, 5, 6, 7, 8, 9,10,13,14,16,20,21,25}};
 
+void setBaud(unsigned long baud) {
+  serial_port.flushOutput();
+  serial_port.begin(baud);
+}
+
 void setup() {
   serial_port.begin(19200);
+  client.setBaudControl(setBaud, 57600);
   Serial.begin(19200);
   
   while(!module.getConfig()){
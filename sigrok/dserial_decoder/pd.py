@@ -18,16 +18,15 @@
 ##
 
 import sigrokdecode as srd
-from functools import reduce
 
 byte_to_str = {0x86: "ACK",
                0x95: "NAK",
-               0x82: "START",
-               0x83: "END",
                0xD7: "WRITE",
                0xD2: "READ",
                0xB0: "NO_DATA",
                0xB1: "PING",
+               0xC7: "GROUP_WRITE",
+               0xE2: "BAUD",
                0xC0: "STRIKE",
                0xC1: "SOLVE",
                0xC2: "CONFIG",
@@ -38,12 +37,12 @@ byte_to_str = {0x86: "ACK",
 
 byte_to_str_small={0x86: "A",
                    0x95: "N",
-                   0x82: "S",
-                   0x83: "E",
                    0xD7: "W",
                    0xD2: "R",
                    0xB0: "ND",
                    0xB1: "P",
+                   0xC7: "GW",
+                   0xE2: "B",
                    0xC0: "XXX",
                    0xC1: "YYY",
                    0xC2: "C",
@@ -52,6 +51,59 @@ byte_to_str_small={0x86: "A",
                    0xC5: "#S",
                    }
 
+# DSerial's dserial_baud_rates, BAUD messages carry an index into it
+baud_rates = [19200, 38400, 57600, 115200]
+
+def crc8(message_bytes):
+    # CRC-8, polynomial 0x2F, init 0xFF, as in DSerial's crc8.h
+    crc = 0xFF
+    for byte in message_bytes:
+        crc ^= byte
+        for i in range(8):
+            if(crc & 0x80):
+                crc = ((crc << 1) ^ 0x2F) & 0xFF
+            else:
+                crc = (crc << 1) & 0xFF
+    return crc
+
+def cobs_decode(encoded_bytes):
+    # Undo the COBS encoding of a packet (without its closing 0), None if
+    # the packet is cut short
+    decoded = []
+    i = 0
+    while i < len(encoded_bytes):
+        code = encoded_bytes[i]
+        block = encoded_bytes[i + 1:i + code]
+        if(code == 0 or len(block) != code - 1):
+            return None
+        decoded.extend(block)
+        i += code
+        if(code != 0xFF and i < len(encoded_bytes)):
+            decoded.append(0)
+    return decoded
+
+def check_packet(encoded_bytes):
+    # Returns (message, error), the message includes the address
+    decoded = cobs_decode(encoded_bytes)
+    if(decoded is None or len(decoded) < 2):
+        return (None, "ERR: BAD FRAME")
+    # The CRC over the message and its CRC byte comes out as 0
+    if(crc8(decoded) != 0):
+        return (None, "ERR: BAD CRC")
+    return (decoded[:-1], None)
+
+def written_data(stripped_bytes):
+    # The data written by a master packet, a poll {READ}{CTL}{RACK}{WRITE}{DATA}
+    # or {READ}{CTL}{RACK}{GROUP_WRITE}{SEQ}{GROUPS}{DATA}, or a broadcast
+    # {GROUP_WRITE}{SEQ}{GROUPS}{DATA}
+    if(stripped_bytes[0] == 0xD2):
+        stripped_bytes = stripped_bytes[3:]
+    if(len(stripped_bytes) > 3 and stripped_bytes[0] == 0xC7):
+        return stripped_bytes[3:]
+    if(len(stripped_bytes) > 1 and stripped_bytes[0] == 0xD7):
+        return stripped_bytes[1:]
+    return []
+
 def bytes_to_msgs(client_id, message_bytes):
     converted_bytes = []
     short_converted_bytes = []
@@ -105,10 +157,7 @@ class Decoder(srd.Decoder):
         self.message_bytes_cl = []
         self.transaction_state = "WAITING"
         self.transaction_message = ""
-        self.escape_next_ms = False
-        self.escape_next_cl = False
-        self.escape_parity_ms = 0
-        self.escape_parity_cl = 0
+        self.transaction_parts = []
 
     def start(self):
         self.out_ann = self.register(srd.OUTPUT_ANN)
@@ -132,40 +181,23 @@ class Decoder(srd.Decoder):
         datavalue, databits = uart_data
 
         if rxtx == 0:
+            # Packets are COBS encoded and end with a 0
             if len(self.message_bytes_ms) == 0:
-                self.escape_parity_ms = 0
                 self.ss_pkt_ms = ss
-                if(datavalue != 0x82):
-                    self.es_pkt_ms = es
-                    self.putxms([0, ["BAD"]])
-                    return
-            if(datavalue == 0x9B):
-                self.escape_next_ms = True
-                self.escape_parity_ms = 1 - self.escape_parity_ms
+            if datavalue != 0:
+                self.message_bytes_ms.append(datavalue)
                 return
-            if(self.escape_next_ms):
-                self.escape_next_ms = False
-                datavalue = datavalue + 0x80
-
-            self.message_bytes_ms.append(datavalue)
-
-            if datavalue != 0x83:
+            if len(self.message_bytes_ms) == 0:
                 return
 
-            parity = reduce(lambda i, j: int(i) ^ int(j), self.message_bytes_ms)
-            if(self.escape_parity_ms):
-                parity = parity ^ 0x9B
-
-            if(self.message_bytes_ms[0] != 0x82):
-                msgs = ["ERR: NO START"]
-            elif(self.message_bytes_ms[-1] != 0x83):
-                msgs = ["ERR: NO END"]
-            elif(parity & 0x7F != 0):
-                msgs = ["ERR: BAD PARITY"]
+            message, error = check_packet(self.message_bytes_ms)
+            if(error):
+                msgs = [error]
             else:
-                stripped_bytes = self.message_bytes_ms[2:-2]
-                if(len(stripped_bytes) > 1 and stripped_bytes[1] == 0xC2):
-                    config_data = stripped_bytes[2:]
+                stripped_bytes = message[1:]
+                data = written_data(stripped_bytes)
+                if(len(data) >= 8 and data[0] == 0xC2):
+                    config_data = data[1:]
                     ports = (config_data[0] >> 2) & 7
                     batteries = (config_data[0] >> 5) & 7
                     serial = "".join([chr(x) for x in config_data[1:6]])
@@ -173,23 +205,37 @@ class Decoder(srd.Decoder):
                     indicators = (config_data[6] >> 6) & 7
                     config_str = "%d-%d-%d-%s" % (ports, batteries, indicators, serial)
                     msgs = ["X:WRITE CONFIG " + config_str, "W C " + config_str]
+                    write_message = "CONFIG " + config_str
                 else:
-                    msgs = bytes_to_msgs(self.message_bytes_ms[1], stripped_bytes)
+                    msgs = bytes_to_msgs(message[0], stripped_bytes)
+                    write_message = bytes_to_msgs(0, data)[0][2:]
 
                 # Transaction code
-                if(self.transaction_state == "WAITING" or self.transaction_state == "MID-PING"):
+                if(stripped_bytes[0] == 0x95):
+                    pass # NAK, the client resends its reply
+                elif(stripped_bytes[0] == 0xD2 and len(stripped_bytes) > 1):
                     self.ss_trn = self.ss_pkt_ms
-                    if(stripped_bytes[0] == 0xD7):
-                        self.transaction_state = "MID-WRITE"
-                        self.transaction_message = msgs[0][8:]
-                    elif(stripped_bytes[0] == 0xD2):
-                        self.transaction_state = "MID-READ"
-                    elif(stripped_bytes[0] == 0xB1):
-                        self.transaction_state = "MID-PING"
-
-                elif(self.transaction_state == "MID-READ2" and stripped_bytes[0] == 0x86):
-                    self.transaction_state = "MID-READ3"
-
+                    self.transaction_state = "MID-POLL"
+                    self.transaction_message = ""
+                    self.transaction_parts = []
+                    if(data):
+                        self.transaction_message = write_message
+                elif(stripped_bytes[0] == 0xB1):
+                    self.ss_trn = self.ss_pkt_ms
+                    self.transaction_state = "MID-PING"
+                elif(stripped_bytes[0] == 0xE2 and len(stripped_bytes) == 2):
+                    # Baud rate switch, the capture has to follow it to decode
+                    # anything after
+                    self.ss_trn = self.ss_pkt_ms
+                    self.es_trn = es
+                    rate = baud_rates[stripped_bytes[1]] if stripped_bytes[1] < len(baud_rates) else "?"
+                    self.putxtrn([2, ["M>%d: BAUD %s" % (message[0], rate)]])
+                    self.transaction_state = "WAITING"
+                elif(stripped_bytes[0] == 0xC7 and message[0] == 0x7F):
+                    self.ss_trn = self.ss_pkt_ms
+                    self.es_trn = es
+                    self.putxtrn([2, ["M>ALL: %s" % write_message]])
+                    self.transaction_state = "WAITING"
                 else:
                     self.transaction_state = "WAITING"
 
@@ -200,64 +246,48 @@ class Decoder(srd.Decoder):
 
         if rxtx == 1:
             if len(self.message_bytes_cl) == 0:
-                self.escape_parity_cl = 0
                 self.ss_pkt_cl = ss
-                if(datavalue != 0x82):
-                    self.es_pkt_cl = es
-                    self.putxcl([0, ["BAD"]])
-                    return
-
-            if(datavalue == 0x9B):
-                self.escape_next_cl = True
-                self.escape_parity_cl = 1 - self.escape_parity_cl
+            if datavalue != 0:
+                self.message_bytes_cl.append(datavalue)
                 return
-            if(self.escape_next_cl):
-                self.escape_next_cl = False
-                datavalue = datavalue + 0x80
-
-            self.message_bytes_cl.append(datavalue)
-
-            if datavalue != 0x83:
+            if len(self.message_bytes_cl) == 0:
                 return
 
-            parity = reduce(lambda i, j: int(i) ^ int(j), self.message_bytes_cl)
-            if(self.escape_parity_cl):
-                parity = parity ^ 0x9B
-            if(self.message_bytes_cl[0] != 0x82):
-                msgs = ["ERR: NO START"]
-            elif(self.message_bytes_cl[-1] != 0x83):
-                msgs = ["ERR: NO END"]
-            elif(parity & 0x7F != 0):
-                msgs = ["ERR: BAD PARITY"]
+            message, error = check_packet(self.message_bytes_cl)
+            if(error):
+                msgs = [error]
             else:
-                stripped_bytes = self.message_bytes_cl[2:-2]
-                client_id = self.message_bytes_cl[1]
+                stripped_bytes = message[1:]
+                client_id = message[0]
                 msgs = bytes_to_msgs(client_id, stripped_bytes)
 
-                # Transaction code
-                if(self.transaction_state == "MID-WRITE" and stripped_bytes[0] == 0x86):
-                    self.es_trn = es
-                    self.putxtrn([2, ["M>%d: %s" % (client_id, self.transaction_message)]])
-                    self.transaction_state = "WAITING"
-
-                elif(self.transaction_state == "MID-PING" and stripped_bytes[0] == 0x86):
+                # Transaction code, a reply is {ACK}{CTL}{BSEQ}{SEQ}{DATA},
+                # CTL_MORE (0x10) is set if another reply follows
+                if(self.transaction_state == "MID-PING" and stripped_bytes[0] == 0x86):
                     self.es_trn = es
                     self.putxtrn([2, ["CLIENT PINGED"]])
-                    self.transaction_state = "WAITING"
-
-                elif(self.transaction_state == "MID-READ"):
-                    if(stripped_bytes[0] == 0x86):
-                        self.es_trn = es
-                        if(self.options["show_nodata"] == "yes"):
-                            self.putxtrn([2, ["%d>M: NO DATA" % client_id]])
-                        self.transaction_state = "WAITING"
-                    else:
-                        self.transaction_message = msgs[0][2:]
-                        self.transaction_state = "MID-READ2"
 
-                elif(self.transaction_state == "MID-READ3" and stripped_bytes[0] == 0x86):
+                elif(self.transaction_state == "MID-POLL" and stripped_bytes[0] == 0x86):
                     self.es_trn = es
-                    self.putxtrn([2, ["%d>M: %s" % (client_id, self.transaction_message)]])
+                    if(len(stripped_bytes) > 4):
+                        reply = bytes_to_msgs(client_id, stripped_bytes[4:])[0]
+                        self.transaction_parts.append("%d>M: %s" %
+                            (client_id, reply.split(":", 1)[1]))
+                    if(len(stripped_bytes) > 1 and stripped_bytes[1] & 0x10):
+                        self.es_pkt_cl = es
+                        self.putxcl([1, msgs])
+                        self.message_bytes_cl = []
+                        return
+                    parts = []
+                    if(self.transaction_message):
+                        parts.append("M>%d: %s" % (client_id, self.transaction_message))
+                    parts.extend(self.transaction_parts)
+                    if(len(stripped_bytes) > 1 and stripped_bytes[1] & 0x0C):
+                        parts.append("SYNC")
+                    if(parts):
+                        self.putxtrn([2, [", ".join(parts)]])
+                    elif(self.options["show_nodata"] == "yes"):
+                        self.putxtrn([2, ["%d>M: NO DATA" % client_id]])
                     self.transaction_state = "WAITING"
 
             self.es_pkt_cl = es